@@ -72,6 +72,17 @@ extern "C" {
 #define CANIOT_ID_GET_SUBID(id)	   ((caniot_device_subid_t)((id >> 6U) & 0x7U))
 #define CANIOT_ID_GET_ENDPOINT(id) ((caniot_endpoint_t)((id >> 9U) & 0x3U))
 
+/* Extended (29-bit) CAN ID format, the 11 LSB are the standard CANIOT ID:
+ * - bits 0 -> 10: standard CANIOT ID
+ * - bits 11 -> 26: query id (0: not in a query context)
+ * - bits 27 -> 28: reserved (0)
+ */
+#define CANIOT_EXT_ID(std_id, query_id)                                                  \
+	(((uint32_t)(std_id)&0x7FFU) | (((uint32_t)(query_id)&0xFFFFU) << 11U))
+
+#define CANIOT_EXT_ID_GET_STD_ID(ext_id)   ((uint16_t)((ext_id)&0x7FFU))
+#define CANIOT_EXT_ID_GET_QUERY_ID(ext_id) ((uint16_t)(((ext_id) >> 11U) & 0xFFFFU))
+
 #define CANIOT_ADDR_LEN sizeof("0x3f")
 
 /* Defines for emulated devices */
@@ -130,14 +141,14 @@ typedef struct {
 	caniot_device_subid_t sid : 3U;
 	caniot_endpoint_t endpoint : 2U;
 
-	/* TODO query id
-	 0: not in a query context
-	 1 -> 7: query id
-
-	 targeted controller:
-	 0: broadcast, not targeted
-	 1 -> 7 : targeted controller
+#if CONFIG_CANIOT_QUERY_ID
+	/* Query id, only carried by extended CAN IDs (see CANIOT_EXT_ID)
+	 * 0: not in a query context
+	 * other: id set by the controller in the query and echoed by the device
+	 * in the response
 	 */
+	uint16_t query_id;
+#endif
 } caniot_id_t;
 
 struct caniot_attribute {
@@ -319,6 +330,33 @@ uint16_t caniot_id_to_canid(caniot_id_t id);
  */
 caniot_id_t caniot_canid_to_id(uint16_t canid);
 
+#if CONFIG_CANIOT_QUERY_ID
+/**
+ * @brief Tell whether the frame with the given ID must be sent with an extended
+ * (29-bit) CAN ID
+ */
+static inline bool caniot_id_is_extended(caniot_id_t id)
+{
+	return id.query_id != 0u;
+}
+
+/**
+ * @brief Convert CANIOT id to extended (29-bit) CAN id
+ *
+ * @param id
+ * @return uint32_t
+ */
+uint32_t caniot_id_to_ext_canid(caniot_id_t id);
+
+/**
+ * @brief Convert extended (29-bit) CAN id to CANIOT id
+ *
+ * @param ext_canid
+ * @return caniot_id_t
+ */
+caniot_id_t caniot_ext_canid_to_id(uint32_t ext_canid);
+#endif
+
 void caniot_test(void);
 
 #ifdef __cplusplus
@@ -48,10 +48,170 @@
 #define CONFIG_CANIOT_ASSERT 0
 #endif
 
+/* Carry a query id in extended (29-bit) CAN IDs, to match responses to queries */
 #ifndef CONFIG_CANIOT_QUERY_ID
 #define CONFIG_CANIOT_QUERY_ID 0u
 #endif
 
+/* Use a hashed timing wheel instead of the delta list to track the timeouts
+ * of the controller pending queries. */
+#ifndef CONFIG_CANIOT_CTRL_TIMING_WHEEL
+#define CONFIG_CANIOT_CTRL_TIMING_WHEEL 0u
+#endif
+
+/* Number of slots of the timing wheel (must be a power of 2) */
+#ifndef CONFIG_CANIOT_CTRL_TIMING_WHEEL_SLOTS
+#define CONFIG_CANIOT_CTRL_TIMING_WHEEL_SLOTS 64u
+#endif
+
+/* Resolution of the timing wheel in ms */
+#ifndef CONFIG_CANIOT_CTRL_TIMING_WHEEL_TICK_MS
+#define CONFIG_CANIOT_CTRL_TIMING_WHEEL_TICK_MS 10u
+#endif
+
+/* Maximum number of queries the controller can have pending for the same device */
+#ifndef CONFIG_CANIOT_CTRL_PIPELINE_DEPTH
+#define CONFIG_CANIOT_CTRL_PIPELINE_DEPTH 1u
+#endif
+
+/* Let other threads submit queries to the controller through a lock-free queue
+ * drained by caniot_controller_process() */
+#ifndef CONFIG_CANIOT_CTRL_SUBMIT_QUEUE
+#define CONFIG_CANIOT_CTRL_SUBMIT_QUEUE 0u
+#endif
+
+/* Size of the controller completion ring, events are queued in it instead of
+ * being passed to a callback if the controller is initialized without one
+ * (0 = disabled) */
+#ifndef CONFIG_CANIOT_CTRL_EVENT_RING_SIZE
+#define CONFIG_CANIOT_CTRL_EVENT_RING_SIZE 0u
+#endif
+
+/* Number of telemetry and attribute responses the controller keeps in cache
+ * (0 = disabled) */
+#ifndef CONFIG_CANIOT_CTRL_CACHE_SIZE
+#define CONFIG_CANIOT_CTRL_CACHE_SIZE 0u
+#endif
+
+/* Default time (in ms) a cached response is considered fresh */
+#ifndef CONFIG_CANIOT_CTRL_CACHE_TTL_MS
+#define CONFIG_CANIOT_CTRL_CACHE_TTL_MS 1000u
+#endif
+
+/* Let telemetry and read attribute queries wait for the response of an identical
+ * query already pending for the device instead of being sent */
+#ifndef CONFIG_CANIOT_CTRL_COALESCE
+#define CONFIG_CANIOT_CTRL_COALESCE 0u
+#endif
+
+/* Let broadcast queries collect the responses in a per-device table and complete
+ * as soon as all the expected devices answered */
+#ifndef CONFIG_CANIOT_CTRL_BCAST_AGGREGATE
+#define CONFIG_CANIOT_CTRL_BCAST_AGGREGATE 0u
+#endif
+
+/* Record the round-trip time of the controller queries in per-device and
+ * per-frame-type histograms */
+#ifndef CONFIG_CANIOT_CTRL_RTT_STATS
+#define CONFIG_CANIOT_CTRL_RTT_STATS 0u
+#endif
+
+/* Estimate the round-trip time of every device (RFC 6298) so that queries
+ * registered with CANIOT_TIMEOUT_AUTO time out shortly after a slow response
+ * would have been expected */
+#ifndef CONFIG_CANIOT_CTRL_ADAPTIVE_TIMEOUT
+#define CONFIG_CANIOT_CTRL_ADAPTIVE_TIMEOUT 0u
+#endif
+
+/* Lower bound of the adaptive timeouts (in ms) */
+#ifndef CONFIG_CANIOT_CTRL_TIMEOUT_AUTO_MIN_MS
+#define CONFIG_CANIOT_CTRL_TIMEOUT_AUTO_MIN_MS 50u
+#endif
+
+/* Upper bound of the adaptive timeouts (in ms), also used for broadcast queries */
+#ifndef CONFIG_CANIOT_CTRL_TIMEOUT_AUTO_MAX_MS
+#define CONFIG_CANIOT_CTRL_TIMEOUT_AUTO_MAX_MS 5000u
+#endif
+
+/* Adaptive timeout (in ms) of a device which never answered */
+#ifndef CONFIG_CANIOT_CTRL_TIMEOUT_AUTO_INIT_MS
+#define CONFIG_CANIOT_CTRL_TIMEOUT_AUTO_INIT_MS 1000u
+#endif
+
+/* Retransmit the queries which timed out with an exponential backoff, according
+ * to a per-query retry policy */
+#ifndef CONFIG_CANIOT_CTRL_RETRY
+#define CONFIG_CANIOT_CTRL_RETRY 0u
+#endif
+
+/* Limit the rate of the frames sent by the controller with token buckets, frames
+ * exceeding the rate are queued and sent by caniot_controller_process() */
+#ifndef CONFIG_CANIOT_CTRL_TX_SHAPER
+#define CONFIG_CANIOT_CTRL_TX_SHAPER 0u
+#endif
+
+/* Number of frames the controller tx queue can hold */
+#ifndef CONFIG_CANIOT_CTRL_TXQ_SIZE
+#define CONFIG_CANIOT_CTRL_TXQ_SIZE 8u
+#endif
+
+/* Default controller transmission rate in frames per second (0 = no limit) */
+#ifndef CONFIG_CANIOT_CTRL_TX_RATE_FPS
+#define CONFIG_CANIOT_CTRL_TX_RATE_FPS 0u
+#endif
+
+/* Default controller transmission rate in bits per second, frame lengths are
+ * estimated on the wire with stuff bits (0 = no limit) */
+#ifndef CONFIG_CANIOT_CTRL_TX_RATE_BPS
+#define CONFIG_CANIOT_CTRL_TX_RATE_BPS 0u
+#endif
+
+/* Default number of frames which can be sent back-to-back */
+#ifndef CONFIG_CANIOT_CTRL_TX_BURST
+#define CONFIG_CANIOT_CTRL_TX_BURST 4u
+#endif
+
+/* Enforce a minimum gap between the frames sent to a device and a maximum number
+ * of queries in flight, per device class or per device */
+#ifndef CONFIG_CANIOT_CTRL_DEVICE_PACING
+#define CONFIG_CANIOT_CTRL_DEVICE_PACING 0u
+#endif
+
+/* Default minimum gap (in ms) between the frames sent to a device (0 = none) */
+#ifndef CONFIG_CANIOT_CTRL_PACING_GAP_MS
+#define CONFIG_CANIOT_CTRL_PACING_GAP_MS 0u
+#endif
+
+/* Default maximum number of queries in flight per device (0 = no limit) */
+#ifndef CONFIG_CANIOT_CTRL_PACING_IN_FLIGHT
+#define CONFIG_CANIOT_CTRL_PACING_IN_FLIGHT 0u
+#endif
+
+/* Send the deferred frames by priority class: commands, then telemetry requests,
+ * attribute accesses and broadcast frames */
+#ifndef CONFIG_CANIOT_CTRL_TX_PRIORITY
+#define CONFIG_CANIOT_CTRL_TX_PRIORITY 0u
+#endif
+
+/* Time (in ms) after which a deferred frame is promoted by one priority class
+ * (0 = oldest frame first) */
+#ifndef CONFIG_CANIOT_CTRL_TX_AGING_MS
+#define CONFIG_CANIOT_CTRL_TX_AGING_MS 100u
+#endif
+
+/* Keep the frames the driver cannot take (-CANIOT_EAGAIN) in the tx queue and
+ * send them again later, instead of failing the query */
+#ifndef CONFIG_CANIOT_CTRL_TX_BACKPRESSURE
+#define CONFIG_CANIOT_CTRL_TX_BACKPRESSURE 0u
+#endif
+
+/* Number of delayed responses (e.g. to broadcast queries) the device holds until
+ * their release time, instead of passing the delay to driv->send()
+ * (0 = delay left to the driver) */
+#ifndef CONFIG_CANIOT_DEVICE_DELAYED_TX_SIZE
+#define CONFIG_CANIOT_DEVICE_DELAYED_TX_SIZE 0u
+#endif
+
 #define CANIOT_ATTR_NAME_MAX_LEN 48u
 
 #endif /* CANIOT_CONFIG_H_ */
\ No newline at end of file
@@ -15,6 +15,14 @@ extern "C" {
 
 #define CANIOT_TIMEOUT_FOREVER ((uint32_t)-1)
 
+/* Timeout derived from the round-trip times previously measured for the device,
+ * see caniot_controller_timeout_auto() */
+#define CANIOT_TIMEOUT_AUTO ((uint32_t)-2)
+
+/* Handle of the queries tracked with a caller-owned context,
+ * see caniot_controller_query_ex() */
+#define CANIOT_HANDLE_EXT ((uint8_t)0xFFu)
+
 struct caniot_pendq_time_handle {
 	union {
 		uint32_t timeout; /* Timeout if response is not yet received */
@@ -26,7 +34,223 @@ struct caniot_pendq_time_handle {
 	 * https://github.com/lucasdietrich/AVRTOS/blob/master/src/avrtos/dstruct/tqueue.c
 	 */
 	struct caniot_pendq_time_handle *next;
+
+#if CONFIG_CANIOT_CTRL_TIMING_WHEEL
+	/* "next" field of the previous item in the wheel slot (or the slot itself),
+	 * allows to remove the query from the wheel in O(1) */
+	struct caniot_pendq_time_handle **pprev;
+
+	/* Tick at which the query expires */
+	uint32_t expiry;
+
+	/* Time within the expiry tick at which the query expires (in ms) */
+	uint16_t expiry_ms;
+#endif
+};
+
+#if CONFIG_CANIOT_CTRL_BCAST_AGGREGATE
+/**
+ * @brief Responses to a broadcast query, see caniot_controller_query_broadcast()
+ */
+struct caniot_ctrl_bcast {
+	/**
+	 * @brief Bitfield of the devices expected to answer (set by the caller),
+	 * the query completes as soon as all of them answered.
+	 */
+	uint64_t expected;
+
+	/**
+	 * @brief Bitfield of the devices which answered
+	 */
+	uint64_t answered;
+
+	/**
+	 * @brief Controller clock when the query was sent (handed to the driver)
+	 */
+	uint32_t sent_ms;
+
+	struct {
+		/* Time between the query and the response (ms) */
+		uint32_t latency_ms;
+
+		/* Response frame (may be an error frame) */
+		struct caniot_frame response;
+	} results[CANIOT_DID_MAX_COUNT];
+};
+#endif
+
+#if CONFIG_CANIOT_CTRL_RTT_STATS
+/* Round-trip times are bucketed by power of 2, each power of 2 being divided
+ * in 4 linear sub-buckets (precision of 25%), up to 65535 ms */
+#define CANIOT_CTRL_RTT_BUCKETS 60u
+
+struct caniot_ctrl_rtt_hist {
+	/* Number of round-trip times recorded */
+	uint32_t count;
+
+	/* Maximum round-trip time recorded (ms) */
+	uint32_t max_ms;
+
+	uint32_t buckets[CANIOT_CTRL_RTT_BUCKETS];
+};
+
+struct caniot_ctrl_rtt_snapshot {
+	uint32_t count;
+
+	/* Percentiles (upper bound of the bucket) and maximum in ms */
+	uint32_t p50_ms;
+	uint32_t p90_ms;
+	uint32_t p99_ms;
+	uint32_t max_ms;
+};
+#endif
+
+#if CONFIG_CANIOT_CTRL_RETRY
+/**
+ * @brief Retransmission policy of a query which timed out,
+ * see caniot_controller_query_retry()
+ */
+struct caniot_ctrl_retry_policy {
+	/* Number of times the query is sent (including the first one),
+	 * 0 or 1 to disable the retransmissions */
+	uint8_t max_attempts;
+
+	/* Maximum percentage of the backoff randomly removed (0 - 100) */
+	uint8_t jitter_pct;
+
+	/* Time waited after the first timeout before retransmitting the query,
+	 * doubled after each attempt (ms) */
+	uint16_t base_backoff_ms;
+
+	/* Upper bound of the backoff (ms) */
+	uint16_t max_backoff_ms;
+};
+#endif
+
+#if CONFIG_CANIOT_CTRL_TX_SHAPER
+/**
+ * @brief Transmission rate of the controller (token buckets),
+ * see caniot_controller_tx_rate_set()
+ */
+struct caniot_ctrl_tx_rate {
+	/* Frames per second, 0 for no limit */
+	uint32_t frames_per_s;
+
+	/* Bits per second on the wire (stuff bits included), 0 for no limit */
+	uint32_t bits_per_s;
+
+	/* Number of frames which can be sent back-to-back (depth of the buckets) */
+	uint16_t burst;
+};
+
+#if CONFIG_CANIOT_CTRL_TX_PRIORITY
+/**
+ * @brief Priority classes of the frames sent by the controller, most urgent
+ * first
+ */
+typedef enum {
+	/* Commands */
+	CANIOT_CTRL_TX_PRIO_COMMAND = 0u,
+
+	/* Telemetry requests */
+	CANIOT_CTRL_TX_PRIO_TELEMETRY,
+
+	/* Attribute reads and writes */
+	CANIOT_CTRL_TX_PRIO_ATTRIBUTE,
+
+	/* Broadcast frames (e.g. discovery) */
+	CANIOT_CTRL_TX_PRIO_DISCOVERY,
+
+	CANIOT_CTRL_TX_PRIO_COUNT,
+} caniot_ctrl_tx_prio_t;
+
+/* Time spent in the tx queue by the frames of a priority class */
+struct caniot_ctrl_tx_wait {
+	/* Number of frames sent */
+	uint32_t count;
+
+	/* Sum and maximum of the waiting times (ms) */
+	uint32_t total_ms;
+	uint32_t max_ms;
+};
+#endif
+
+struct caniot_ctrl_txq_entry {
+	struct caniot_ctrl_txq_entry *next;
+
+	struct caniot_frame frame;
+
+	/* Query waiting for the frame to be sent, NULL if not tracked */
+	struct caniot_pendq *pq;
+
+	/* Timeout of the query, armed when the frame is sent */
+	uint32_t timeout;
+
+	/* Controller clock when the frame was queued */
+	uint32_t enqueued_ms;
+
+#if CONFIG_CANIOT_CTRL_TX_PRIORITY
+	caniot_ctrl_tx_prio_t prio;
+#endif
+};
+
+struct caniot_ctrl_tx_stats {
+	/* Number of frames in the tx queue, and highest number reached */
+	uint32_t pending;
+	uint32_t max_pending;
+
+	/* Number of frames which went through the tx queue */
+	uint32_t deferred;
+
+	/* Number of times the driver could not take a frame (-CANIOT_EAGAIN)
+	 * and the frame was kept for later, see CONFIG_CANIOT_CTRL_TX_BACKPRESSURE */
+	uint32_t busy;
+
+	/* Number of frames lost, because the tx queue was full or the driver
+	 * failed to send a deferred frame */
+	uint32_t dropped;
+};
+#endif
+
+#if CONFIG_CANIOT_CTRL_DEVICE_PACING
+/**
+ * @brief Pace of the frames sent to a device, see
+ * caniot_controller_pacing_set_class() and caniot_controller_pacing_set_did()
+ */
+struct caniot_ctrl_pacing {
+	/* Minimum time between two frames sent to the device (ms), 0 for no limit */
+	uint16_t min_gap_ms;
+
+	/* Maximum number of queries sent to the device and waiting for
+	 * their response, 0 for no limit */
+	uint8_t max_in_flight;
+};
+
+struct caniot_ctrl_pacing_state {
+	/* Pace of the device if custom, otherwise the pace of its class applies */
+	struct caniot_ctrl_pacing params;
+
+	/* Controller clock when the last frame was sent to the device */
+	uint32_t last_tx_ms;
+
+	/* Number of queries sent to the device and still pending */
+	uint8_t in_flight;
+
+	uint8_t custom : 1u;
+	uint8_t sent : 1u;
 };
+#endif
+
+#if CONFIG_CANIOT_CTRL_ADAPTIVE_TIMEOUT
+/* Round-trip time estimator of a device (Jacobson/Karels) */
+struct caniot_ctrl_rto {
+	/* Smoothed round-trip time (ms * 8), 0 if no sample yet */
+	uint32_t srtt_x8;
+
+	/* Round-trip time variation (ms * 4) */
+	uint32_t rttvar_x4;
+};
+#endif
 
 struct caniot_pendq {
 	/**
@@ -36,21 +260,21 @@ struct caniot_pendq {
 
 	/**
 	 * @brief Handle identifying the query.
-	 * (0 = invalid)
+	 * (0 = invalid, CANIOT_HANDLE_EXT = caller-owned context)
 	 */
 	uint8_t handle;
 
 	/**
 	 * @brief Query type, in order to identify the response.
-	 *
-	 * TODO: Use a unique identifier for the query that the device will forward
-	 * in the response. Use of extended CAN ID enables this.
 	 */
 	caniot_frame_type_t query_type;
 
 #if CONFIG_CANIOT_QUERY_ID
 	/**
 	 * @brief Query ID, in order to identify the response.
+	 *
+	 * Sent in the extended CAN ID of the query and echoed by the device in
+	 * the response. The LSB is the handle of the query.
 	 */
 	uint16_t query_id;
 #endif
@@ -74,6 +298,81 @@ struct caniot_pendq {
 		struct caniot_pendq *next;	     /* for memory allocation */
 	};
 
+#if CONFIG_CANIOT_CTRL_PIPELINE_DEPTH > 1
+	/**
+	 * @brief Next query pending for the same device (sent after this one).
+	 */
+	struct caniot_pendq *pipeline_next;
+#endif
+
+#if CONFIG_CANIOT_CTRL_RTT_STATS || CONFIG_CANIOT_CTRL_ADAPTIVE_TIMEOUT
+	/**
+	 * @brief Controller clock when the query was sent
+	 */
+	uint32_t sent_ms;
+#endif
+
+#if CONFIG_CANIOT_CTRL_RETRY
+	/**
+	 * @brief Retransmission state of the query
+	 */
+	struct {
+		struct caniot_ctrl_retry_policy policy;
+
+		/* Copy of the frame sent */
+		struct caniot_frame frame;
+
+		/* Timeout of each attempt */
+		uint32_t timeout;
+
+		/* Current attempt (0 if the query is never retransmitted) */
+		uint8_t attempt;
+
+		/* Waiting before the next retransmission */
+		uint8_t backoff : 1u;
+	} retry;
+#endif
+
+#if CONFIG_CANIOT_CTRL_TX_SHAPER
+	/**
+	 * @brief Entry of the tx queue holding the frame of the query,
+	 * NULL once sent
+	 */
+	struct caniot_ctrl_txq_entry *tx;
+#endif
+
+#if CONFIG_CANIOT_CTRL_DEVICE_PACING
+	/**
+	 * @brief Query counted in the in-flight queries of the device
+	 */
+	uint8_t in_flight;
+#endif
+
+#if CONFIG_CANIOT_CTRL_BCAST_AGGREGATE
+	/**
+	 * @brief Responses table if the query is an aggregated broadcast
+	 */
+	struct caniot_ctrl_bcast *bcast;
+#endif
+
+#if CONFIG_CANIOT_CTRL_COALESCE
+	/**
+	 * @brief Query whose response this (not sent) query waits for, NULL if
+	 * the query was sent.
+	 */
+	struct caniot_pendq *leader;
+
+	/**
+	 * @brief Queries waiting for the response to this query.
+	 */
+	struct caniot_pendq *waiters;
+
+	/**
+	 * @brief Next query waiting for the same leader.
+	 */
+	struct caniot_pendq *waiter_next;
+#endif
+
 	/**
 	 * @brief Bitfield of notified devices in case of broadcast query.
 	 */
@@ -103,6 +402,13 @@ typedef enum {
 	 * "pq" is set.
 	 */
 	CANIOT_CONTROLLER_EVENT_CONTEXT_QUERY,
+
+	/**
+	 * @brief Query served from the controller cache, nothing was sent.
+	 *
+	 * "pq" NULL, "response" is the cached frame.
+	 */
+	CANIOT_CONTROLLER_EVENT_CONTEXT_CACHE,
 } caniot_controller_event_context_t;
 
 typedef enum {
@@ -183,6 +489,20 @@ typedef struct {
 	void *user_data;
 } caniot_controller_event_t;
 
+#if CONFIG_CANIOT_CTRL_EVENT_RING_SIZE > 0
+/**
+ * @brief Event queued in the controller completion ring,
+ * see caniot_controller_poll_events()
+ */
+struct caniot_controller_event_record {
+	/* Event, "response" points to the copy below if set */
+	caniot_controller_event_t ev;
+
+	/* Copy of the response frame */
+	struct caniot_frame response;
+};
+#endif
+
 /**
  * @brief Callback to handle controller events
  *
@@ -240,6 +560,59 @@ struct caniot_discovery_params {
 	} data;
 };
 
+#if CONFIG_CANIOT_CTRL_CACHE_SIZE > 0
+struct caniot_ctrl_cache_entry {
+	/* Response frame, identified by device, type and endpoint or attribute key */
+	struct caniot_frame frame;
+
+	/* Controller clock value at which the entry is no longer fresh */
+	uint32_t expiry;
+
+	/* Controller clock value at which the entry was last updated */
+	uint32_t updated;
+
+	uint8_t valid : 1u;
+};
+#endif
+
+#if CONFIG_CANIOT_CTRL_SUBMIT_QUEUE
+typedef enum {
+	/* Send a query, see caniot_controller_query_ex() */
+	CANIOT_CTRL_SUBMIT_QUERY = 0u,
+
+	/* Cancel a query, see caniot_controller_query_ex_cancel() */
+	CANIOT_CTRL_SUBMIT_CANCEL,
+} caniot_ctrl_submit_op_t;
+
+/**
+ * @brief Request submitted to the controller from any thread, see
+ * caniot_controller_submit_query() and caniot_controller_submit_cancel().
+ *
+ * Provided by the submitter, it must remain valid until the request is executed
+ * (see caniot_controller_submission_done()).
+ */
+struct caniot_ctrl_submission {
+	/* Next submission in the queue */
+	struct caniot_ctrl_submission *next;
+
+	caniot_ctrl_submit_op_t op;
+
+	/* Caller-owned query context, NULL to send a query without tracking it */
+	struct caniot_pendq *pq;
+
+	caniot_did_t did;
+	uint32_t timeout;
+	bool suppress;
+
+	/* Copy of the query frame */
+	struct caniot_frame frame;
+
+	/* Result of the request, valid once done is set */
+	int status;
+	uint8_t done;
+};
+#endif
+
 struct caniot_controller {
 	struct {
 		/* Pool of queries to be allocated */
@@ -248,11 +621,41 @@ struct caniot_controller {
 		/* Free list of unallocated blocks */
 		struct caniot_pendq *free_list;
 
+#if CONFIG_CANIOT_CTRL_TIMING_WHEEL
+		struct {
+			/* Queries hashed by expiry tick */
+			struct caniot_pendq_time_handle
+				*slots[CONFIG_CANIOT_CTRL_TIMING_WHEEL_SLOTS];
+
+			/* Expired queries, waiting for their callback to be called */
+			struct caniot_pendq_time_handle *expired;
+
+			/* "next" field of the last expired query (or the list itself),
+			 * allows to append expired queries in O(1) */
+			struct caniot_pendq_time_handle **expired_tail;
+
+			/* Current tick */
+			uint32_t tick;
+
+			/* Time elapsed since the current tick (in ms) */
+			uint32_t tick_elapsed;
+		} wheel;
+#else
 		/* Timeout queue */
 		struct caniot_pendq_time_handle *timeout_queue;
+#endif
 
 		/* bitfield of pending devices */
 		uint64_t pending_devices_bf;
+
+#if CONFIG_CANIOT_QUERY_ID
+		/* Generation of the next query id */
+		uint8_t query_gen;
+#endif
+
+		/* Queries pending for each device (broadcast included), indexed by
+		 * DID, in the order they were sent */
+		struct caniot_pendq *by_did[CANIOT_DID_MAX_COUNT + 1u];
 	} pendingq;
 
 	/* Reference when caniot_controller_process() was last called */
@@ -261,6 +664,82 @@ struct caniot_controller {
 		uint16_t ms;
 	} last_process;
 
+	/* Time elapsed since the controller was initialized (in ms, wraps) */
+	uint32_t clock_ms;
+
+#if CONFIG_CANIOT_CTRL_RTT_STATS
+	/* Round-trip times of the queries answered */
+	struct {
+		struct caniot_ctrl_rtt_hist by_did[CANIOT_DID_MAX_COUNT];
+		struct caniot_ctrl_rtt_hist by_type[4u];
+	} rtt;
+#endif
+
+#if CONFIG_CANIOT_CTRL_ADAPTIVE_TIMEOUT
+	/* Round-trip time estimators used for CANIOT_TIMEOUT_AUTO */
+	struct caniot_ctrl_rto rto[CANIOT_DID_MAX_COUNT];
+#endif
+
+#if CONFIG_CANIOT_CTRL_TX_SHAPER
+	/* Transmit shaper */
+	struct {
+		struct caniot_ctrl_tx_rate rate;
+
+		/* Tokens available (thousandths of frame/bit) */
+		uint32_t frame_tokens;
+		uint32_t bit_tokens;
+
+		/* Controller clock when the buckets were last refilled */
+		uint32_t refill_ms;
+
+		/* Frames waiting to be sent (FIFO) */
+		struct caniot_ctrl_txq_entry *head;
+		struct caniot_ctrl_txq_entry *tail;
+		uint32_t count;
+
+		struct caniot_ctrl_tx_stats stats;
+
+#if CONFIG_CANIOT_CTRL_TX_BACKPRESSURE
+		/* Last frame sent was refused by the driver */
+		uint8_t busy;
+#endif
+
+		struct caniot_ctrl_txq_entry *free_list;
+		struct caniot_ctrl_txq_entry entries[CONFIG_CANIOT_CTRL_TXQ_SIZE];
+
+#if CONFIG_CANIOT_CTRL_TX_PRIORITY
+		struct caniot_ctrl_tx_wait wait[CANIOT_CTRL_TX_PRIO_COUNT];
+#endif
+	} tx;
+#endif
+
+#if CONFIG_CANIOT_CTRL_DEVICE_PACING
+	/* Pace of the frames sent to the devices */
+	struct {
+		struct caniot_ctrl_pacing by_cls[8u];
+		struct caniot_ctrl_pacing_state dev[CANIOT_DID_MAX_COUNT];
+	} pacing;
+#endif
+
+#if CONFIG_CANIOT_CTRL_RETRY
+	struct {
+		/* Policy applied to the queries sent by the controller */
+		struct caniot_ctrl_retry_policy policy;
+
+		/* State of the jitter generator */
+		uint32_t seed;
+	} retry;
+#endif
+
+#if CONFIG_CANIOT_CTRL_CACHE_SIZE > 0
+	struct {
+		struct caniot_ctrl_cache_entry entries[CONFIG_CANIOT_CTRL_CACHE_SIZE];
+
+		/* Time a new entry is considered fresh (ms) */
+		uint32_t ttl_ms;
+	} cache;
+#endif
+
 #if CONFIG_CANIOT_CONTROLLER_DISCOVERY
 	struct {
 		struct caniot_discovery_params params;
@@ -281,6 +760,28 @@ struct caniot_controller {
 	 */
 	const struct caniot_drivers_api *driv;
 #endif
+
+#if CONFIG_CANIOT_CTRL_EVENT_RING_SIZE > 0
+	/* Completion ring, used if no event callback is registered */
+	struct {
+		struct caniot_controller_event_record
+			records[CONFIG_CANIOT_CTRL_EVENT_RING_SIZE];
+
+		/* Index of the oldest record */
+		uint16_t head;
+
+		/* Number of records in the ring */
+		uint16_t count;
+
+		/* Number of events lost because the ring was full */
+		uint32_t dropped;
+	} events;
+#endif
+
+#if CONFIG_CANIOT_CTRL_SUBMIT_QUEUE
+	/* Stack of submissions (latest first), only accessed atomically */
+	struct caniot_ctrl_submission *submitq;
+#endif
 };
 
 typedef struct caniot_controller caniot_controller_t;
@@ -288,6 +789,9 @@ typedef struct caniot_controller caniot_controller_t;
 /**
  * @brief Initialize a controller, register the event callback and user data
  *
+ * If CONFIG_CANIOT_CTRL_EVENT_RING_SIZE is set, cb can be NULL, events are then
+ * queued in the controller completion ring (see caniot_controller_poll_events()).
+ *
  * @param ctrl
  * @param cb
  * @param user_data
@@ -327,6 +831,27 @@ int caniot_controller_deinit(struct caniot_controller *ctrl);
  */
 uint32_t caniot_controller_next_timeout(const struct caniot_controller *ctrl);
 
+/**
+ * @brief Get the absolute time at which the controller next needs to be
+ * processed, in ms on the controller clock.
+ *
+ * Covers query timeouts, retransmissions and frames deferred by the transmit
+ * shaper (rate limit, device pacing, driver backpressure). With the drivers
+ * API, the controller clock follows the time returned by driv->get_time()
+ * (sec * 1000 + ms, wrapping), so a tickless application can sleep until the
+ * deadline or until a frame is received, whichever comes first, then call
+ * caniot_controller_process().
+ *
+ * Frames waiting for an in-flight query to complete (pacing) have no deadline
+ * of their own, they are released on the response or the timeout.
+ *
+ * @param ctrl
+ * @param deadline_ms Absolute deadline (ms), left untouched if none
+ * @return true if a deadline is set, false if nothing is pending
+ */
+bool caniot_controller_next_deadline(const struct caniot_controller *ctrl,
+				     uint32_t *deadline_ms);
+
 /**
  * @brief Build a query frame to be sent to a device and register its context
  * for tracking.
@@ -344,6 +869,8 @@ uint32_t caniot_controller_next_timeout(const struct caniot_controller *ctrl);
  *  	- If timeout is -1 (CANIOT_TIMEOUT_FOREVER)  a context is allocated but
  *  	  the query should be cancelled if it doesn't get a response or if did is
  * BROADCAST
+ * 	- If timeout is CANIOT_TIMEOUT_AUTO the timeout is computed from the
+ * 	  round-trip times of the device (CONFIG_CANIOT_CTRL_ADAPTIVE_TIMEOUT)
  * 	- otherwise a context is allocated and the query will
  * 	  be automatically cancelled after timeout
  * @return int handle on success (> 0), negative value on error, 0 if no context allocated
@@ -376,6 +903,56 @@ int caniot_controller_query_cancel(struct caniot_controller *ctrl,
 				   uint8_t handle,
 				   bool suppress);
 
+/**
+ * @brief Same as caniot_controller_query_register() but the query is tracked
+ * using the context provided by the caller instead of one allocated from the
+ * controller pool.
+ *
+ * The context must remain valid until the query completes (event with
+ * terminated flag set) or is cancelled with caniot_controller_query_ex_cancel().
+ * Set pq->user_data before calling this function, events related to the query
+ * are reported with handle CANIOT_HANDLE_EXT and this user data.
+ *
+ * @param ctrl Controller
+ * @param pq Caller-owned query context
+ * @param did
+ * @param frame
+ * @param timeout Timeout in ms, must not be 0.
+ * @return int 0 on success, negative value on error
+ */
+int caniot_controller_query_register_ex(struct caniot_controller *ctrl,
+					struct caniot_pendq *pq,
+					caniot_did_t did,
+					struct caniot_frame *frame,
+					uint32_t timeout);
+
+/**
+ * @brief Return true if the query tracked with the caller-owned context is
+ * pending
+ *
+ * @param ctrl Controller
+ * @param pq Caller-owned query context, initialized or not
+ * @return true If pending
+ * @return false If completed, cancelled or never registered
+ */
+bool caniot_controller_query_ex_pending(struct caniot_controller *ctrl,
+					const struct caniot_pendq *pq);
+
+/**
+ * @brief Cancel a pending query tracked with a caller-owned context.
+ * Call the user callback if not suppressed
+ *
+ * The context can be reused or released by the caller once the function returns.
+ *
+ * @param ctrl Controller
+ * @param pq Caller-owned query context
+ * @param suppress If true, the user callback will not be called
+ * @return int 0 on success, negative value on error
+ */
+int caniot_controller_query_ex_cancel(struct caniot_controller *ctrl,
+				      struct caniot_pendq *pq,
+				      bool suppress);
+
 /**
  * @brief Process a single frame received from the CAN bus
  *
@@ -388,6 +965,154 @@ int caniot_controller_rx_frame(struct caniot_controller *ctrl,
 			       uint32_t time_passed_ms,
 			       const struct caniot_frame *frame);
 
+/**
+ * @brief Process a batch of frames received from the CAN bus
+ *
+ * All frames are dispatched before timeouts are updated, so that the timeout
+ * processing is done once for the whole batch.
+ *
+ * @param ctrl Controller
+ * @param time_passed_ms Time passed since last call to caniot_controller_process() in ms
+ * @param frames Array of received frames
+ * @param count Number of frames in the array
+ * @param status Optional array of count entries, filled with the result of the
+ *  processing of each frame (0 on success, negative value on error)
+ * @return int 0 if all frames have been processed successfully, first error
+ *  otherwise
+ */
+int caniot_controller_rx_frames(struct caniot_controller *ctrl,
+				uint32_t time_passed_ms,
+				const struct caniot_frame *frames,
+				size_t count,
+				int *status);
+
+#if CONFIG_CANIOT_CTRL_CACHE_SIZE > 0
+/**
+ * @brief Set the time new responses stay fresh in the controller cache
+ *
+ * @param ctrl Controller
+ * @param ttl_ms Time in ms, 0 disables caching of new responses
+ */
+void caniot_controller_cache_ttl_set(struct caniot_controller *ctrl, uint32_t ttl_ms);
+
+/**
+ * @brief Get the cached response to a telemetry or read attribute query frame.
+ *
+ * The cache is populated from the telemetry and attribute responses received
+ * (including orphan ones), an attribute entry is invalidated when a write
+ * attribute query is sent for it. With drivers, the controller clock is
+ * brought up to date before the freshness of the entry is checked.
+ *
+ * @param ctrl Controller
+ * @param did Device ID the query is for
+ * @param query Query frame, as built with caniot_build_query_telemetry() or
+ *  caniot_build_query_read_attribute()
+ * @return const struct caniot_frame* Fresh cached response, valid until the
+ *  next frame is received, NULL if none
+ */
+const struct caniot_frame *caniot_controller_cache_get(struct caniot_controller *ctrl,
+						       caniot_did_t did,
+						       const struct caniot_frame *query);
+
+/**
+ * @brief Drop all the cached responses of a device
+ *
+ * @param ctrl Controller
+ * @param did Device ID, CANIOT_DID_BROADCAST to drop all entries
+ */
+void caniot_controller_cache_invalidate(struct caniot_controller *ctrl, caniot_did_t did);
+#endif
+
+#if CONFIG_CANIOT_CTRL_RTT_STATS
+/**
+ * @brief Get the round-trip time statistics of the queries answered by a device
+ *
+ * Note: Responses to broadcast queries are not accounted.
+ *
+ * @param ctrl Controller
+ * @param did Device ID (not broadcast)
+ * @param snap Statistics
+ * @return int 0 on success, negative value on error
+ */
+int caniot_controller_rtt_snapshot_did(struct caniot_controller *ctrl,
+				       caniot_did_t did,
+				       struct caniot_ctrl_rtt_snapshot *snap);
+
+/**
+ * @brief Get the round-trip time statistics of the queries of a given type
+ *
+ * Note: Responses to broadcast queries are not accounted.
+ *
+ * @param ctrl Controller
+ * @param type Type of the query frame
+ * @param snap Statistics
+ * @return int 0 on success, negative value on error
+ */
+int caniot_controller_rtt_snapshot_type(struct caniot_controller *ctrl,
+					caniot_frame_type_t type,
+					struct caniot_ctrl_rtt_snapshot *snap);
+
+/**
+ * @brief Clear all round-trip time statistics
+ *
+ * @param ctrl Controller
+ */
+void caniot_controller_rtt_reset(struct caniot_controller *ctrl);
+#endif
+
+#if CONFIG_CANIOT_CTRL_ADAPTIVE_TIMEOUT
+/**
+ * @brief Get the timeout used for a query sent to a device with
+ * CANIOT_TIMEOUT_AUTO
+ *
+ * The timeout is srtt + 4 * rttvar (RFC 6298) computed from the round-trip
+ * times of the previous queries answered by the device, bounded by
+ * CONFIG_CANIOT_CTRL_TIMEOUT_AUTO_MIN_MS and CONFIG_CANIOT_CTRL_TIMEOUT_AUTO_MAX_MS.
+ * CONFIG_CANIOT_CTRL_TIMEOUT_AUTO_INIT_MS is used until the device answered,
+ * broadcast queries always use the upper bound.
+ *
+ * @param ctrl Controller
+ * @param did Device ID
+ * @return uint32_t Timeout in ms
+ */
+uint32_t caniot_controller_timeout_auto(const struct caniot_controller *ctrl,
+					caniot_did_t did);
+
+/**
+ * @brief Get the state of the round-trip time estimator of a device
+ *
+ * Note: Responses to broadcast queries and to retransmitted queries are not
+ * sampled.
+ *
+ * @param ctrl Controller
+ * @param did Device ID (not broadcast)
+ * @param rto Estimator state, srtt_x8 is 0 until the device answered
+ * @return int 0 on success, negative value on error
+ */
+int caniot_controller_rto_get(const struct caniot_controller *ctrl,
+			      caniot_did_t did,
+			      struct caniot_ctrl_rto *rto);
+#endif
+
+#if CONFIG_CANIOT_CTRL_EVENT_RING_SIZE > 0
+/**
+ * @brief Retrieve the events queued in the controller completion ring, oldest
+ * first.
+ *
+ * Only applicable if the controller is initialized without event callback.
+ * If the ring is full, new events are dropped and counted in events.dropped.
+ *
+ * @param ctrl Controller
+ * @param out Array to fill with the events, "response" of each event points to
+ *  the copy of the frame in the same record
+ * @param n Size of the array
+ * @return int Number of events retrieved, negative value on error
+ */
+int caniot_controller_poll_events(struct caniot_controller *ctrl,
+				  struct caniot_controller_event_record *out,
+				  size_t n);
+#endif
+
 /*____________________________________________________________________________*/
 
 /**
@@ -420,6 +1145,18 @@ void *caniot_controller_query_user_data_get(struct caniot_controller *ctrl,
  * Returned handle can be used to track the query status or cancel it.
  * It is necessarily positive. A value of 0 means that the query is not tracked.
  *
+ * Up to CONFIG_CANIOT_CTRL_PIPELINE_DEPTH tracked queries can be pending for
+ * the same device, responses are matched to the queries in the order they were
+ * sent (given their type, endpoint and attribute key). -CANIOT_EBUSY is
+ * returned if the pipeline of the device is full.
+ *
+ * With CONFIG_CANIOT_CTRL_COALESCE, a telemetry or read attribute query
+ * identical to one already pending for the device is not sent, it gets its own
+ * handle and completes with the response to the pending one.
+ *
+ * With CONFIG_CANIOT_CTRL_RETRY, the query is retransmitted according to the
+ * policy set with caniot_controller_retry_policy_set().
+ *
  * @param ctrl Controller
  * @param did ID of the device to query
  * @param frame Frame to send
@@ -431,6 +1168,203 @@ int caniot_controller_query(struct caniot_controller *ctrl,
 			    struct caniot_frame *frame,
 			    uint32_t timeout);
 
+#if CONFIG_CANIOT_CTRL_TX_SHAPER
+/**
+ * @brief Set the transmission rate of the controller
+ *
+ * Frames exceeding the rate are held in the tx queue (in order) and sent by
+ * caniot_controller_process(). The timeout of a deferred query starts when its
+ * frame is sent. If the tx queue is full, the query fails with -CANIOT_EAGAIN.
+ *
+ * The default rate is given by CONFIG_CANIOT_CTRL_TX_RATE_FPS,
+ * CONFIG_CANIOT_CTRL_TX_RATE_BPS and CONFIG_CANIOT_CTRL_TX_BURST.
+ *
+ * @param ctrl Controller
+ * @param rate Rate (copied)
+ */
+void caniot_controller_tx_rate_set(struct caniot_controller *ctrl,
+				   const struct caniot_ctrl_tx_rate *rate);
+
+/**
+ * @brief Get the number of frames waiting in the tx queue
+ *
+ * @param ctrl Controller
+ * @return uint32_t
+ */
+uint32_t caniot_controller_tx_pending(const struct caniot_controller *ctrl);
+
+/**
+ * @brief Get the statistics of the tx queue
+ *
+ * With CONFIG_CANIOT_CTRL_TX_BACKPRESSURE, frames the driver refuses with
+ * -CANIOT_EAGAIN (e.g. mailbox full) are kept in the tx queue and sent again
+ * by caniot_controller_process(), instead of failing the query.
+ *
+ * @param ctrl Controller
+ * @param stats Statistics
+ * @return int 0 on success, negative value on error
+ */
+int caniot_controller_tx_stats_get(const struct caniot_controller *ctrl,
+				   struct caniot_ctrl_tx_stats *stats);
+#endif
+
+#if CONFIG_CANIOT_CTRL_TX_PRIORITY
+/**
+ * @brief Get the time spent in the tx queue by the frames of a priority class
+ *
+ * Deferred frames are sent by priority class (see caniot_ctrl_tx_prio_t), a
+ * frame being promoted by one class every CONFIG_CANIOT_CTRL_TX_AGING_MS it
+ * waits. Frames sent without being queued are counted with a null wait.
+ *
+ * Note: Only the frames waiting in the tx queue are reordered, that is frames
+ * held back by a rate limit (caniot_controller_tx_rate_set()), by the pace of
+ * a device or by the driver (CONFIG_CANIOT_CTRL_TX_BACKPRESSURE). With the
+ * default unlimited rate, frames are sent in the order they are submitted.
+ *
+ * @param ctrl Controller
+ * @param prio Priority class
+ * @param wait Statistics
+ * @return int 0 on success, negative value on error
+ */
+int caniot_controller_tx_wait_get(const struct caniot_controller *ctrl,
+				  caniot_ctrl_tx_prio_t prio,
+				  struct caniot_ctrl_tx_wait *wait);
+#endif
+
+#if CONFIG_CANIOT_CTRL_DEVICE_PACING
+/**
+ * @brief Set the pace of the frames sent to the devices of a class
+ *
+ * Frames to a device which is not ready (gap not elapsed or too many queries in
+ * flight) wait in the tx queue, without delaying the frames to other devices.
+ * The default pace is given by CONFIG_CANIOT_CTRL_PACING_GAP_MS and
+ * CONFIG_CANIOT_CTRL_PACING_IN_FLIGHT.
+ *
+ * @param ctrl Controller
+ * @param cls Device class
+ * @param pacing Pace (copied)
+ * @return int 0 on success, negative value on error
+ */
+int caniot_controller_pacing_set_class(struct caniot_controller *ctrl,
+				       caniot_device_class_t cls,
+				       const struct caniot_ctrl_pacing *pacing);
+
+/**
+ * @brief Set the pace of the frames sent to a device, overriding the pace of
+ * its class
+ *
+ * @param ctrl Controller
+ * @param did Device ID (not broadcast)
+ * @param pacing Pace (copied), NULL to use the pace of the class again
+ * @return int 0 on success, negative value on error
+ */
+int caniot_controller_pacing_set_did(struct caniot_controller *ctrl,
+				     caniot_did_t did,
+				     const struct caniot_ctrl_pacing *pacing);
+#endif
+
+#if CONFIG_CANIOT_CTRL_RETRY
+/**
+ * @brief Send a query to a device, retransmit it if it times out
+ *
+ * When an attempt times out, the query is sent again after a backoff of
+ * base_backoff_ms * 2^(attempt - 1) (bounded by max_backoff_ms and shortened
+ * by the jitter). The query keeps its handle, a response received at any time
+ * completes it. A single CANIOT_CONTROLLER_EVENT_STATUS_TIMEOUT event is
+ * reported once the last attempt timed out.
+ *
+ * Broadcast queries and queries without timeout are never retransmitted.
+ *
+ * @param ctrl Controller
+ * @param did ID of the device to query
+ * @param frame Frame to send (copied)
+ * @param timeout Timeout of each attempt in ms
+ * @param policy Retransmission policy (copied)
+ * @return int Handle of the query, 0 if not tracked, negative value on error
+ */
+int caniot_controller_query_retry(struct caniot_controller *ctrl,
+				  caniot_did_t did,
+				  struct caniot_frame *frame,
+				  uint32_t timeout,
+				  const struct caniot_ctrl_retry_policy *policy);
+
+/**
+ * @brief Set the retransmission policy of the queries sent with
+ * caniot_controller_query() and caniot_controller_query_ex()
+ *
+ * @param ctrl Controller
+ * @param policy Policy (copied), NULL to disable the retransmissions (default)
+ */
+void caniot_controller_retry_policy_set(struct caniot_controller *ctrl,
+					const struct caniot_ctrl_retry_policy *policy);
+#endif
+
+/**
+ * @brief Send a query to a device and track it using the context provided by
+ * the caller (see caniot_controller_query_register_ex()).
+ *
+ * Tracking a query this way does not consume any context from the controller
+ * pool, the number of pending queries is only limited by the caller. The
+ * number of queries pending per device is still bounded by
+ * CONFIG_CANIOT_CTRL_PIPELINE_DEPTH, as it is to protect the device.
+ *
+ * @param ctrl Controller
+ * @param pq Caller-owned query context
+ * @param did ID of the device to query
+ * @param frame Frame to send
+ * @param timeout Timeout in ms, must not be 0.
+ * @return int 0 on success, -CANIOT_EBUSY if the context is still tracking a
+ *  query or if the pipeline of the device is full, negative value on error
+ */
+int caniot_controller_query_ex(struct caniot_controller *ctrl,
+			       struct caniot_pendq *pq,
+			       caniot_did_t did,
+			       struct caniot_frame *frame,
+			       uint32_t timeout);
+
+#if CONFIG_CANIOT_CTRL_CACHE_SIZE > 0
+/**
+ * @brief Same as caniot_controller_query() but if a fresh response to the query
+ * is in the controller cache, the event callback is called with it
+ * (context CANIOT_CONTROLLER_EVENT_CONTEXT_CACHE) and nothing is sent.
+ *
+ * @param ctrl Controller
+ * @param did ID of the device to query
+ * @param frame Frame to send
+ * @param timeout Timeout in ms, a value of 0 means no timeout.
+ * @return int Handle of the query, 0 if not tracked or served from the cache,
+ *  negative value on error
+ */
+int caniot_controller_query_cached(struct caniot_controller *ctrl,
+				   caniot_did_t did,
+				   struct caniot_frame *frame,
+				   uint32_t timeout);
+#endif
+
+#if CONFIG_CANIOT_CTRL_BCAST_AGGREGATE
+/**
+ * @brief Send a broadcast query and collect the responses in the table of
+ * the caller instead of reporting them one by one.
+ *
+ * A single event terminates the query, with "user_data" set to bcast:
+ * - CANIOT_CONTROLLER_EVENT_STATUS_OK as soon as all the devices in
+ *   bcast->expected answered ("response" is NULL),
+ * - CANIOT_CONTROLLER_EVENT_STATUS_TIMEOUT otherwise, the table then holds the
+ *   responses received.
+ *
+ * @param ctrl Controller
+ * @param bcast Responses table, "expected" must be set, it must remain valid
+ *  until the query terminates
+ * @param frame Frame to send
+ * @param timeout Timeout in ms, must not be 0.
+ * @return int Handle of the query, negative value on error
+ */
+int caniot_controller_query_broadcast(struct caniot_controller *ctrl,
+				      struct caniot_ctrl_bcast *bcast,
+				      struct caniot_frame *frame,
+				      uint32_t timeout);
+#endif
+
 /**
  * @brief Send a query without tracking it.
  *
@@ -445,17 +1379,92 @@ int caniot_controller_send(struct caniot_controller *ctrl,
 			   caniot_did_t did,
 			   struct caniot_frame *frame);
 
+#if CONFIG_CANIOT_CTRL_SUBMIT_QUEUE
+/**
+ * @brief Submit a query to the controller, can be called from any thread.
+ *
+ * The query is sent by the thread owning the controller on the next call to
+ * caniot_controller_process(), as if caniot_controller_query_ex() were called.
+ * If the query cannot be sent, a CANIOT_CONTROLLER_EVENT_STATUS_CANCELLED event
+ * is reported for it (unless pq is NULL) and the error is set in the
+ * submission status.
+ *
+ * @param ctrl Controller
+ * @param sub Submission storage
+ * @param pq Caller-owned query context, NULL to send the query without tracking it
+ * @param did ID of the device to query
+ * @param frame Frame to send (copied)
+ * @param timeout Timeout in ms, must be 0 if pq is NULL and not 0 otherwise.
+ * @return int 0 on success, negative value on error
+ */
+int caniot_controller_submit_query(struct caniot_controller *ctrl,
+				   struct caniot_ctrl_submission *sub,
+				   struct caniot_pendq *pq,
+				   caniot_did_t did,
+				   const struct caniot_frame *frame,
+				   uint32_t timeout);
+
+/**
+ * @brief Submit the cancellation of a query tracked with a caller-owned context,
+ * can be called from any thread.
+ *
+ * Executed on the next call to caniot_controller_process() as if
+ * caniot_controller_query_ex_cancel() were called.
+ *
+ * @param ctrl Controller
+ * @param sub Submission storage
+ * @param pq Caller-owned query context
+ * @param suppress If true, the user callback will not be called
+ * @return int 0 on success, negative value on error
+ */
+int caniot_controller_submit_cancel(struct caniot_controller *ctrl,
+				    struct caniot_ctrl_submission *sub,
+				    struct caniot_pendq *pq,
+				    bool suppress);
+
+/**
+ * @brief Tells whether the submission has been executed, in which case its
+ * status is valid and its storage can be reused.
+ *
+ * @param sub Submission
+ * @return true If executed
+ * @return false If still queued
+ */
+bool caniot_controller_submission_done(const struct caniot_ctrl_submission *sub);
+#endif
+
 /**
  *
  * @brief Check timeouts and receive incoming CANIOT message if any and handle it
  *
  * Note: Should be called on query timeout or when an incoming can message
  *
+ * Note: Requests submitted with caniot_controller_submit_query() or
+ *  caniot_controller_submit_cancel() are executed first, in submission order.
+ *
  * @param ctrl
  * @return int
  */
 int caniot_controller_process(struct caniot_controller *ctrl);
 
+/**
+ * @brief Same as caniot_controller_process() with a bounded amount of work
+ *
+ * Stops receiving frames once max_frames frames were handled or max_ms elapsed
+ * (measured with the driver get_time()), whichever comes first. Expired queries
+ * are reported every few frames of a burst, once the frames received so far are
+ * handled, and before returning (also on error).
+ *
+ * @param ctrl Controller
+ * @param max_frames Maximum number of frames received, 0 for no limit
+ * @param max_ms Maximum duration of the call in ms, 0 for no limit
+ * @return int 0 if all incoming frames were handled, 1 if the budget was
+ * exhausted (more frames may be pending, call again), negative value on error
+ */
+int caniot_controller_process_budget(struct caniot_controller *ctrl,
+				     uint32_t max_frames,
+				     uint32_t max_ms);
+
 /*____________________________________________________________________________*/
 
 // Discovery
@@ -137,6 +137,15 @@ struct caniot_device {
 
 #if CONFIG_CANIOT_DEVICE_DRIVERS_API
 	const struct caniot_drivers_api *driv;
+
+#if CONFIG_CANIOT_DEVICE_DELAYED_TX_SIZE > 0
+	/* Delayed frames, sorted by release time (ms) */
+	struct {
+		struct caniot_frame frames[CONFIG_CANIOT_DEVICE_DELAYED_TX_SIZE];
+		uint32_t release_ms[CONFIG_CANIOT_DEVICE_DELAYED_TX_SIZE];
+		uint8_t count;
+	} delayed_tx;
+#endif
 #endif
 
 	struct {
@@ -255,6 +264,26 @@ void caniot_app_deinit(struct caniot_device *dev);
  */
 int caniot_device_process(struct caniot_device *dev);
 
+/**
+ * @brief Send the delayed frames whose release time is reached
+ *
+ * Note: Also called by caniot_device_process(), to be called in between when
+ * the application sleeps longer than caniot_device_delayed_tx_remaining().
+ *
+ * @param dev
+ * @return int 0 on success, error returned by driv->send() otherwise (the
+ *  frame is sent again on the next call)
+ */
+int caniot_device_process_delayed_tx(struct caniot_device *dev);
+
+/**
+ * @brief Get time in ms until the next delayed frame is to be sent
+ *
+ * @param dev
+ * @return uint32_t (uint32_t)-1 if no frame is delayed
+ */
+uint32_t caniot_device_delayed_tx_remaining(struct caniot_device *dev);
+
 int caniot_device_scales_rdmdelay(struct caniot_device *dev, uint32_t *rdmdelay);
 
 bool caniot_device_time_synced(struct caniot_device *dev);
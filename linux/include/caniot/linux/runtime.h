@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2023 Lucas Dietrich <ld.adecy@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _CANIOT_LINUX_RUNTIME_H
+#define _CANIOT_LINUX_RUNTIME_H
+
+#include <caniot/controller.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Event loop driving a controller on a Linux host.
+ *
+ * A single epoll instance waits on:
+ * - the CAN socket, when a frame is received or when there is room again in
+ *   the socket buffer for the frames the flush function could not send,
+ * - a timerfd, armed from caniot_controller_next_deadline(),
+ * - an eventfd, to wake up the loop from another thread (e.g. after
+ *   caniot_controller_submit_query()).
+ *
+ * The controller must be initialized with caniot_controller_driv_init(), its
+ * drivers receive the frames and give the time used to arm the timer.
+ */
+struct caniot_linux_runtime {
+	struct caniot_controller *ctrl;
+
+	int epoll_fd;
+	int timer_fd;
+	int event_fd;
+
+	/* CAN socket watched for incoming frames, -1 if none */
+	int can_fd;
+
+	/* Sends the frames buffered by the drivers before waiting, optional.
+	 * Returns the number of frames left (socket buffer full), the CAN socket
+	 * is then watched for writability until they are all sent. */
+	int (*flush)(void);
+
+	/* CAN socket watched for writability (EPOLLOUT) */
+	bool tx_wait;
+
+	/* Deadline the timer is currently armed for */
+	uint32_t armed_deadline_ms;
+	bool armed;
+
+	bool stop;
+};
+
+/**
+ * @brief Initialize the runtime for the controller
+ *
+ * @param rt
+ * @param ctrl Controller initialized with caniot_controller_driv_init()
+ * @param can_fd File descriptor becoming readable when frames are received
+ *  (non-blocking), -1 if none
+ * @return int 0 on success, negative error code otherwise (-errno)
+ */
+int caniot_linux_runtime_init(struct caniot_linux_runtime *rt,
+			      struct caniot_controller *ctrl,
+			      int can_fd);
+
+/**
+ * @brief Set the function sending the frames buffered by the drivers (e.g.
+ * caniot_socketcan_flush()), called before waiting for events and when the CAN
+ * socket becomes writable again
+ *
+ * @param rt
+ * @param flush
+ */
+void caniot_linux_runtime_set_flush(struct caniot_linux_runtime *rt, int (*flush)(void));
+
+/**
+ * @brief Release the file descriptors owned by the runtime (the CAN socket
+ * is left open)
+ *
+ * @param rt
+ */
+void caniot_linux_runtime_deinit(struct caniot_linux_runtime *rt);
+
+/**
+ * @brief Wait for a single event and process the controller
+ *
+ * @param rt
+ * @param timeout_ms Maximum time to wait, -1 to wait for an event
+ * @return int Number of events handled (0 on timeout or signal),
+ *  negative error code otherwise
+ */
+int caniot_linux_runtime_run_once(struct caniot_linux_runtime *rt, int timeout_ms);
+
+/**
+ * @brief Run the event loop until caniot_linux_runtime_stop() is called
+ *
+ * @param rt
+ * @return int 0 when stopped, negative error code otherwise
+ */
+int caniot_linux_runtime_run(struct caniot_linux_runtime *rt);
+
+/**
+ * @brief Wake up the event loop, the controller is processed again.
+ *
+ * Note: Thread safe, to be called after submitting requests from another thread.
+ *
+ * @param rt
+ * @return int 0 on success, negative error code otherwise
+ */
+int caniot_linux_runtime_wakeup(struct caniot_linux_runtime *rt);
+
+/**
+ * @brief Make caniot_linux_runtime_run() return
+ *
+ * Note: Thread safe.
+ *
+ * @param rt
+ * @return int 0 on success, negative error code otherwise
+ */
+int caniot_linux_runtime_stop(struct caniot_linux_runtime *rt);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CANIOT_LINUX_RUNTIME_H */
@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2023 Lucas Dietrich <ld.adecy@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _CANIOT_LINUX_SOCKETCAN_H
+#define _CANIOT_LINUX_SOCKETCAN_H
+
+#include <caniot/caniot.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct can_frame;
+
+struct caniot_socketcan_config {
+	/* Network interface (e.g. "can0", "vcan0") */
+	const char *ifname;
+
+	/* Install a kernel filter so that only responses (frames addressed to
+	 * a controller) are received */
+	bool controller_filter;
+
+	/* Request kernel reception timestamps (SO_TIMESTAMPING), hardware ones
+	 * if the interface provides them. Used to fill the frame timestamp with
+	 * CONFIG_CANIOT_FRAME_TIMESTAMP, the time of the reception otherwise. */
+	bool timestamping;
+};
+
+struct caniot_socketcan_stats {
+	uint32_t rx_frames;
+	uint32_t rx_batches; /* recvmmsg() calls returning frames */
+	uint32_t rx_dropped; /* not CANIOT frames (RTR, error, CAN FD, ...) */
+
+	uint32_t tx_frames;
+	uint32_t tx_batches; /* sendmmsg() calls sending frames */
+	uint32_t tx_busy;    /* frames refused because the socket buffer is full */
+	uint32_t tx_dropped; /* frames dropped on send errors (e.g. interface down) */
+};
+
+/**
+ * @brief Drivers for the SocketCAN interface opened with caniot_socketcan_open()
+ *
+ * - recv() returns the frames received by a single recvmmsg() call one after
+ *   the other.
+ * - send() queues the frame, the frames are sent with a single sendmmsg()
+ *   call when the queue is full, before receiving frames or when
+ *   caniot_socketcan_flush() is called. -CANIOT_EAGAIN is returned if the
+ *   socket buffer is full. On other send errors the queued frames are dropped
+ *   and the error is returned (-errno), by recv() if they were sent from it.
+ * - get_time() returns the real time (CLOCK_REALTIME).
+ *
+ * Note: The drivers are thread safe.
+ */
+extern const struct caniot_drivers_api caniot_socketcan_drivers;
+
+/**
+ * @brief Open the SocketCAN interface used by caniot_socketcan_drivers
+ *
+ * @param config
+ * @return int 0 on success, negative error code otherwise (-errno)
+ */
+int caniot_socketcan_open(const struct caniot_socketcan_config *config);
+
+/**
+ * @brief Send the queued frames and close the interface
+ */
+void caniot_socketcan_close(void);
+
+/**
+ * @brief Get the (non-blocking) socket of the interface, to be polled for
+ * received frames (see caniot_linux_runtime_init())
+ *
+ * @return int socket, -1 if the interface is not open
+ */
+int caniot_socketcan_fd(void);
+
+/**
+ * @brief Send the queued frames
+ *
+ * @return int Number of frames still queued (socket buffer full), negative
+ *  error code otherwise (-errno), the queued frames are then dropped
+ */
+int caniot_socketcan_flush(void);
+
+/**
+ * @brief Get the statistics of the interface
+ *
+ * @param stats
+ */
+void caniot_socketcan_stats_get(struct caniot_socketcan_stats *stats);
+
+/**
+ * @brief Convert a CANIOT frame to a SocketCAN frame
+ *
+ * Frames carrying a query id are converted to extended CAN frames
+ * (CONFIG_CANIOT_QUERY_ID).
+ *
+ * @param cf
+ * @param frame
+ */
+void caniot_socketcan_to_can(struct can_frame *cf, const struct caniot_frame *frame);
+
+/**
+ * @brief Convert a SocketCAN frame to a CANIOT frame
+ *
+ * @param frame
+ * @param cf
+ * @return int 0 on success, -CANIOT_EINVAL if the frame is not a CANIOT frame
+ */
+int caniot_socketcan_from_can(struct caniot_frame *frame, const struct can_frame *cf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CANIOT_LINUX_SOCKETCAN_H */
@@ -0,0 +1,256 @@
+/*
+ * Copyright (c) 2023 Lucas Dietrich <ld.adecy@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <caniot/caniot_private.h>
+#include <caniot/linux/runtime.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#if !CONFIG_CANIOT_CTRL_DRIVERS_API
+#error "The Linux runtime requires CONFIG_CANIOT_CTRL_DRIVERS_API"
+#endif
+
+#define __DBG(fmt, ...) CANIOT_DBG("-- " fmt, ##__VA_ARGS__)
+
+/* Events handled per epoll_wait() call, one per file descriptor */
+#define RUNTIME_EVENTS_MAX 3u
+
+static int epoll_add(int epoll_fd, int fd)
+{
+	struct epoll_event ev = {
+		.events	 = EPOLLIN,
+		.data.fd = fd,
+	};
+
+	return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0 ? 0 : -errno;
+}
+
+/* Watch the CAN socket for writability only while frames are waiting for
+ * room in the socket buffer, it is writable most of the time */
+static int runtime_watch_tx(struct caniot_linux_runtime *rt, bool enable)
+{
+	struct epoll_event ev = {
+		.events	 = enable ? (EPOLLIN | EPOLLOUT) : EPOLLIN,
+		.data.fd = rt->can_fd,
+	};
+
+	if ((enable == rt->tx_wait) || (rt->can_fd < 0)) return 0;
+
+	if (epoll_ctl(rt->epoll_fd, EPOLL_CTL_MOD, rt->can_fd, &ev) < 0) return -errno;
+
+	rt->tx_wait = enable;
+
+	__DBG("runtime_watch_tx() enable=%u\n", enable);
+
+	return 0;
+}
+
+/* Send the frames buffered by the drivers, wait for the socket to become
+ * writable if some could not be sent */
+static int runtime_flush(struct caniot_linux_runtime *rt)
+{
+	if (rt->flush == NULL) return 0;
+
+	const int ret = rt->flush();
+	if (ret < 0) return ret;
+
+	return runtime_watch_tx(rt, ret > 0);
+}
+
+/* Read the counter of a timerfd/eventfd to clear its readiness */
+static void fd_drain(int fd)
+{
+	uint64_t count;
+
+	while (read(fd, &count, sizeof(count)) == (ssize_t)sizeof(count)) {
+	}
+}
+
+int caniot_linux_runtime_init(struct caniot_linux_runtime *rt,
+			      struct caniot_controller *ctrl,
+			      int can_fd)
+{
+	int ret;
+
+	if (!rt || !ctrl || !ctrl->driv) return -CANIOT_EINVAL;
+
+	memset(rt, 0x00, sizeof(*rt));
+	rt->ctrl     = ctrl;
+	rt->can_fd   = can_fd;
+	rt->timer_fd = -1;
+	rt->event_fd = -1;
+
+	rt->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (rt->epoll_fd < 0) return -errno;
+
+	rt->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (rt->timer_fd < 0) {
+		ret = -errno;
+		goto error;
+	}
+
+	rt->event_fd = eventfd(0u, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (rt->event_fd < 0) {
+		ret = -errno;
+		goto error;
+	}
+
+	if ((ret = epoll_add(rt->epoll_fd, rt->timer_fd)) < 0) goto error;
+	if ((ret = epoll_add(rt->epoll_fd, rt->event_fd)) < 0) goto error;
+	if ((can_fd >= 0) && (ret = epoll_add(rt->epoll_fd, can_fd)) < 0) goto error;
+
+	return 0;
+
+error:
+	caniot_linux_runtime_deinit(rt);
+	return ret;
+}
+
+void caniot_linux_runtime_set_flush(struct caniot_linux_runtime *rt, int (*flush)(void))
+{
+	if (!rt) return;
+
+	rt->flush = flush;
+}
+
+void caniot_linux_runtime_deinit(struct caniot_linux_runtime *rt)
+{
+	if (!rt) return;
+
+	if (rt->event_fd >= 0) close(rt->event_fd);
+	if (rt->timer_fd >= 0) close(rt->timer_fd);
+	if (rt->epoll_fd >= 0) close(rt->epoll_fd);
+
+	rt->epoll_fd = -1;
+	rt->timer_fd = -1;
+	rt->event_fd = -1;
+}
+
+/* Arm the timer for the next deadline of the controller, if it changed */
+static int runtime_arm(struct caniot_linux_runtime *rt)
+{
+	struct itimerspec its = {0};
+	uint32_t deadline_ms;
+	uint32_t sec;
+	uint16_t ms;
+
+	const bool pending = caniot_controller_next_deadline(rt->ctrl, &deadline_ms);
+
+	if ((pending == rt->armed) && (!pending || (deadline_ms == rt->armed_deadline_ms))) {
+		return 0;
+	}
+
+	if (pending) {
+		rt->ctrl->driv->get_time(&sec, &ms);
+
+		/* controller clock wraps, the difference does not */
+		int32_t delay_ms = (int32_t)(deadline_ms - (sec * 1000u + ms));
+
+		/* deadline already passed within the current millisecond,
+		 * retry on the next one rather than spinning */
+		delay_ms = MAX(delay_ms, 1);
+
+		its.it_value.tv_sec  = delay_ms / 1000;
+		its.it_value.tv_nsec = (long)(delay_ms % 1000) * 1000000L;
+	}
+
+	/* a zero it_value disarms the timer */
+	if (timerfd_settime(rt->timer_fd, 0, &its, NULL) < 0) return -errno;
+
+	rt->armed	      = pending;
+	rt->armed_deadline_ms = deadline_ms;
+
+	__DBG("runtime_arm() pending=%u deadline=%u\n", pending, deadline_ms);
+
+	return 0;
+}
+
+int caniot_linux_runtime_run_once(struct caniot_linux_runtime *rt, int timeout_ms)
+{
+	struct epoll_event events[RUNTIME_EVENTS_MAX];
+	int ret;
+
+	if (!rt || rt->epoll_fd < 0) return -CANIOT_EINVAL;
+
+	if ((ret = runtime_arm(rt)) < 0) return ret;
+
+	/* frames queued by the controller are sent before waiting for their
+	 * responses */
+	if ((ret = runtime_flush(rt)) < 0) return ret;
+
+	const int count = epoll_wait(rt->epoll_fd, events, RUNTIME_EVENTS_MAX, timeout_ms);
+	if (count < 0) return (errno == EINTR) ? 0 : -errno;
+
+	for (int i = 0; i < count; i++) {
+		const int fd = events[i].data.fd;
+
+		if (fd == rt->timer_fd) {
+			/* the deadline is computed again after processing */
+			fd_drain(fd);
+			rt->armed = false;
+		} else if (fd == rt->event_fd) {
+			fd_drain(fd);
+		} else if ((fd == rt->can_fd) && (events[i].events & EPOLLOUT)) {
+			/* room in the socket buffer for the frames left */
+			if ((ret = runtime_flush(rt)) < 0) return ret;
+		}
+
+		/* frames are read by the controller drivers */
+	}
+
+	ret = caniot_controller_process(rt->ctrl);
+	if (ret < 0) {
+		CANIOT_ERR("caniot_controller_process() failed: -%04x\n", -ret);
+	}
+
+	return count;
+}
+
+int caniot_linux_runtime_run(struct caniot_linux_runtime *rt)
+{
+	int ret = 0;
+
+	if (!rt) return -CANIOT_EINVAL;
+
+	/* requests and frames issued before the loop started */
+	caniot_controller_process(rt->ctrl);
+
+	while (!__atomic_load_n(&rt->stop, __ATOMIC_ACQUIRE)) {
+		ret = caniot_linux_runtime_run_once(rt, -1);
+		if (ret < 0) break;
+	}
+
+	return MIN(ret, 0);
+}
+
+int caniot_linux_runtime_wakeup(struct caniot_linux_runtime *rt)
+{
+	const uint64_t one = 1u;
+
+	if (!rt || rt->event_fd < 0) return -CANIOT_EINVAL;
+
+	/* counter saturated, a wakeup is pending anyway */
+	if ((write(rt->event_fd, &one, sizeof(one)) < 0) && (errno != EAGAIN)) {
+		return -errno;
+	}
+
+	return 0;
+}
+
+int caniot_linux_runtime_stop(struct caniot_linux_runtime *rt)
+{
+	if (!rt) return -CANIOT_EINVAL;
+
+	__atomic_store_n(&rt->stop, true, __ATOMIC_RELEASE);
+
+	return caniot_linux_runtime_wakeup(rt);
+}
@@ -0,0 +1,477 @@
+/*
+ * Copyright (c) 2023 Lucas Dietrich <ld.adecy@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/* recvmmsg(), sendmmsg() */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <net/if.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <caniot/caniot_private.h>
+#include <caniot/linux/socketcan.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+
+#define __DBG(fmt, ...) CANIOT_DBG("-- " fmt, ##__VA_ARGS__)
+
+/* Frames received/sent per system call */
+#ifndef CONFIG_CANIOT_SOCKETCAN_BATCH
+#define CONFIG_CANIOT_SOCKETCAN_BATCH 16u
+#endif
+
+#define SOCKETCAN_CMSG_SIZE CMSG_SPACE(sizeof(struct scm_timestamping))
+
+static struct {
+	int fd;
+	bool timestamping;
+
+	pthread_mutex_t rx_lock;
+	pthread_mutex_t tx_lock;
+
+	/* Frames received by the last recvmmsg() call, next one at rx_index */
+	struct {
+		struct can_frame frames[CONFIG_CANIOT_SOCKETCAN_BATCH];
+		struct mmsghdr msgs[CONFIG_CANIOT_SOCKETCAN_BATCH];
+		struct iovec iovs[CONFIG_CANIOT_SOCKETCAN_BATCH];
+		char cmsgs[CONFIG_CANIOT_SOCKETCAN_BATCH][SOCKETCAN_CMSG_SIZE];
+		uint32_t count;
+		uint32_t index;
+	} rx;
+
+	/* Frames queued for the next sendmmsg() call */
+	struct {
+		struct can_frame frames[CONFIG_CANIOT_SOCKETCAN_BATCH];
+		struct mmsghdr msgs[CONFIG_CANIOT_SOCKETCAN_BATCH];
+		struct iovec iovs[CONFIG_CANIOT_SOCKETCAN_BATCH];
+		uint32_t count;
+	} tx;
+
+	struct caniot_socketcan_stats stats;
+} sc = {
+	.fd	 = -1,
+	.rx_lock = PTHREAD_MUTEX_INITIALIZER,
+	.tx_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+void caniot_socketcan_to_can(struct can_frame *cf, const struct caniot_frame *frame)
+{
+	memset(cf, 0x00, sizeof(*cf));
+
+#if CONFIG_CANIOT_QUERY_ID
+	if (caniot_id_is_extended(frame->id)) {
+		cf->can_id = caniot_id_to_ext_canid(frame->id) | CAN_EFF_FLAG;
+	} else
+#endif
+	{
+		cf->can_id = caniot_id_to_canid(frame->id);
+	}
+
+	cf->len = MIN(frame->len, CAN_MAX_DLEN);
+	memcpy(cf->data, frame->buf, cf->len);
+}
+
+int caniot_socketcan_from_can(struct caniot_frame *frame, const struct can_frame *cf)
+{
+	if (cf->can_id & (CAN_RTR_FLAG | CAN_ERR_FLAG)) return -CANIOT_EINVAL;
+
+	caniot_clear_frame(frame);
+
+	if (cf->can_id & CAN_EFF_FLAG) {
+#if CONFIG_CANIOT_QUERY_ID
+		frame->id = caniot_ext_canid_to_id(cf->can_id & CAN_EFF_MASK);
+#else
+		return -CANIOT_EINVAL;
+#endif
+	} else {
+		frame->id = caniot_canid_to_id(cf->can_id & CAN_SFF_MASK);
+	}
+
+	frame->len = MIN(cf->len, CAN_MAX_DLEN);
+	memcpy(frame->buf, cf->data, frame->len);
+
+	return 0;
+}
+
+/* Last resort if no entropy source can be read. The entropy is only used for
+ * jitter and response delays, a generator seeded from the time is enough */
+static void entropy_fallback(uint8_t *buf, size_t len)
+{
+	static uint64_t counter;
+	struct timespec ts;
+	uint64_t x = 0u;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	const uint64_t seed = ((uint64_t)ts.tv_sec << 30u) ^ (uint64_t)ts.tv_nsec ^
+			      (__atomic_fetch_add(&counter, 1u, __ATOMIC_RELAXED) << 48u);
+
+	for (size_t i = 0u; i < len; i++) {
+		if ((i % sizeof(x)) == 0u) {
+			/* splitmix64 */
+			x = seed + (i / sizeof(x) + 1u) * 0x9E3779B97F4A7C15ull;
+			x = (x ^ (x >> 30u)) * 0xBF58476D1CE4E5B9ull;
+			x = (x ^ (x >> 27u)) * 0x94D049BB133111EBull;
+			x ^= x >> 31u;
+		}
+
+		buf[i] = (uint8_t)(x >> (8u * (i % sizeof(x))));
+	}
+}
+
+/* Fallback if getrandom() is not available (e.g. seccomp, old kernel) */
+static void entropy_urandom(uint8_t *buf, size_t len)
+{
+	const int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+
+	while ((fd >= 0) && (len > 0u)) {
+		const ssize_t ret = read(fd, buf, len);
+		if ((ret < 0) && (errno == EINTR)) continue;
+		if (ret <= 0) break;
+
+		buf += ret;
+		len -= (size_t)ret;
+	}
+
+	if (fd >= 0) close(fd);
+
+	if (len > 0u) {
+		CANIOT_WRN("no entropy source available, using the time\n");
+		entropy_fallback(buf, len);
+	}
+}
+
+static void socketcan_entropy(uint8_t *buf, size_t len)
+{
+	while (len > 0u) {
+		const ssize_t ret = getrandom(buf, len, 0u);
+		if (ret < 0) {
+			if ((errno == EINTR) || (errno == EAGAIN)) continue;
+
+			entropy_urandom(buf, len);
+			return;
+		}
+
+		buf += ret;
+		len -= (size_t)ret;
+	}
+}
+
+static void socketcan_get_time(uint32_t *sec, uint16_t *ms)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	*sec = (uint32_t)ts.tv_sec;
+	*ms  = (uint16_t)(ts.tv_nsec / 1000000L);
+}
+
+static void socketcan_set_time(uint32_t sec)
+{
+	/* the system time is not managed by the library */
+	(void)sec;
+}
+
+/* Send the queued frames, return the number of frames still queued */
+static int tx_flush(void)
+{
+	uint32_t sent = 0u;
+	int ret	      = 0;
+
+	while (sent < sc.tx.count) {
+		ret = sendmmsg(sc.fd, &sc.tx.msgs[sent], sc.tx.count - sent, MSG_DONTWAIT);
+		if (ret < 0) {
+			if ((errno == EAGAIN) || (errno == ENOBUFS)) {
+				/* socket buffer full, sent later */
+				ret = 0;
+			} else {
+				/* the frames would fail again (e.g. interface down),
+				 * drop them rather than keeping them queued forever */
+				ret = -errno;
+				sc.stats.tx_dropped += sc.tx.count - sent;
+				sent = sc.tx.count;
+			}
+			break;
+		}
+
+		sent += (uint32_t)ret;
+		sc.stats.tx_frames += (uint32_t)ret;
+		sc.stats.tx_batches++;
+	}
+
+	if (sent != 0u) {
+		memmove(sc.tx.frames,
+			&sc.tx.frames[sent],
+			(sc.tx.count - sent) * sizeof(struct can_frame));
+		sc.tx.count -= sent;
+	}
+
+	__DBG("tx_flush() sent=%u queued=%u ret=%d\n", sent, sc.tx.count, ret);
+
+	return (ret < 0) ? ret : (int)sc.tx.count;
+}
+
+int caniot_socketcan_flush(void)
+{
+	int ret;
+
+	if (sc.fd < 0) return -CANIOT_EINVAL;
+
+	pthread_mutex_lock(&sc.tx_lock);
+	ret = tx_flush();
+	pthread_mutex_unlock(&sc.tx_lock);
+
+	return ret;
+}
+
+static int socketcan_send(const struct caniot_frame *frame, uint32_t delay_ms)
+{
+	int ret = 0;
+
+	/* delayed frames are not supported by SocketCAN */
+	(void)delay_ms;
+
+	if (sc.fd < 0) return -CANIOT_EINVAL;
+
+	pthread_mutex_lock(&sc.tx_lock);
+
+	if ((sc.tx.count == CONFIG_CANIOT_SOCKETCAN_BATCH) && ((ret = tx_flush()) < 0)) {
+		goto exit;
+	}
+
+	if (sc.tx.count == CONFIG_CANIOT_SOCKETCAN_BATCH) {
+		sc.stats.tx_busy++;
+		ret = -CANIOT_EAGAIN;
+		goto exit;
+	}
+
+	caniot_socketcan_to_can(&sc.tx.frames[sc.tx.count++], frame);
+	ret = 0;
+
+exit:
+	pthread_mutex_unlock(&sc.tx_lock);
+
+	return ret;
+}
+
+#if CONFIG_CANIOT_FRAME_TIMESTAMP
+static void rx_timestamp(struct caniot_frame *frame, struct msghdr *hdr)
+{
+	struct timespec ts = {0};
+
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg != NULL;
+	     cmsg		  = CMSG_NXTHDR(hdr, cmsg)) {
+		if ((cmsg->cmsg_level == SOL_SOCKET) &&
+		    (cmsg->cmsg_type == SO_TIMESTAMPING)) {
+			struct scm_timestamping tss;
+
+			memcpy(&tss, CMSG_DATA(cmsg), sizeof(tss));
+
+			/* hardware timestamp if any, software otherwise */
+			ts = (tss.ts[2].tv_sec != 0) ? tss.ts[2] : tss.ts[0];
+		}
+	}
+
+	if (ts.tv_sec == 0) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+	}
+
+	frame->timestamp.sec  = (uint32_t)ts.tv_sec;
+	frame->timestamp.frac = (uint16_t)(ts.tv_nsec / 1000000L);
+}
+#endif
+
+/* Receive a batch of frames, return the number of frames received */
+static int rx_fill(void)
+{
+	for (uint32_t i = 0u; i < CONFIG_CANIOT_SOCKETCAN_BATCH; i++) {
+		sc.rx.msgs[i].msg_hdr.msg_control    = sc.timestamping ? sc.rx.cmsgs[i] : NULL;
+		sc.rx.msgs[i].msg_hdr.msg_controllen = sc.timestamping ? SOCKETCAN_CMSG_SIZE : 0u;
+	}
+
+	const int ret =
+		recvmmsg(sc.fd, sc.rx.msgs, CONFIG_CANIOT_SOCKETCAN_BATCH, MSG_DONTWAIT, NULL);
+	if (ret < 0) return (errno == EAGAIN) ? 0 : -errno;
+
+	sc.rx.count = (uint32_t)ret;
+	sc.rx.index = 0u;
+
+	sc.stats.rx_batches++;
+
+	__DBG("rx_fill() received=%d\n", ret);
+
+	return ret;
+}
+
+static int socketcan_recv(struct caniot_frame *frame)
+{
+	int ret = -CANIOT_EAGAIN;
+
+	if (sc.fd < 0) return -CANIOT_EINVAL;
+
+	/* the frames queued so far are sent before the responses are awaited,
+	 * a send error is reported once, the frames received are kept */
+	if ((ret = caniot_socketcan_flush()) < 0) return ret;
+	ret = -CANIOT_EAGAIN;
+
+	pthread_mutex_lock(&sc.rx_lock);
+
+	for (;;) {
+		if (sc.rx.index == sc.rx.count) {
+			const int count = rx_fill();
+			if (count <= 0) {
+				ret = (count < 0) ? count : -CANIOT_EAGAIN;
+				break;
+			}
+		}
+
+		const uint32_t i = sc.rx.index++;
+
+		/* CAN FD frames are not CANIOT frames */
+		if ((sc.rx.msgs[i].msg_len != CAN_MTU) ||
+		    (caniot_socketcan_from_can(frame, &sc.rx.frames[i]) != 0)) {
+			sc.stats.rx_dropped++;
+			continue;
+		}
+
+#if CONFIG_CANIOT_FRAME_TIMESTAMP
+		rx_timestamp(frame, &sc.rx.msgs[i].msg_hdr);
+#endif
+
+		sc.stats.rx_frames++;
+		ret = 0;
+		break;
+	}
+
+	pthread_mutex_unlock(&sc.rx_lock);
+
+	return ret;
+}
+
+const struct caniot_drivers_api caniot_socketcan_drivers = {
+	.entropy  = socketcan_entropy,
+	.get_time = socketcan_get_time,
+	.set_time = socketcan_set_time,
+	.send	  = socketcan_send,
+	.recv	  = socketcan_recv,
+};
+
+int caniot_socketcan_open(const struct caniot_socketcan_config *config)
+{
+	struct sockaddr_can addr = {.can_family = AF_CAN};
+	int ret;
+
+	if (!config || !config->ifname) return -CANIOT_EINVAL;
+	if (sc.fd >= 0) return -CANIOT_EINVAL;
+
+	const int fd = socket(PF_CAN, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, CAN_RAW);
+	if (fd < 0) return -errno;
+
+	addr.can_ifindex = (int)if_nametoindex(config->ifname);
+	if (addr.can_ifindex == 0) {
+		ret = -errno;
+		goto error;
+	}
+
+	if (config->controller_filter) {
+		/* responses only, standard and extended frames */
+		const uint32_t response_bit = CANIOT_ID(0u, CANIOT_RESPONSE, 0u, 0u, 0u);
+		const struct can_filter filters[] = {
+			{
+				.can_id	  = response_bit,
+				.can_mask = response_bit | CAN_EFF_FLAG | CAN_RTR_FLAG,
+			},
+#if CONFIG_CANIOT_QUERY_ID
+			{
+				.can_id	  = response_bit | CAN_EFF_FLAG,
+				.can_mask = response_bit | CAN_EFF_FLAG | CAN_RTR_FLAG,
+			},
+#endif
+		};
+
+		if (setsockopt(fd, SOL_CAN_RAW, CAN_RAW_FILTER, filters, sizeof(filters)) < 0) {
+			ret = -errno;
+			goto error;
+		}
+	}
+
+	if (config->timestamping) {
+		const int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+				  SOF_TIMESTAMPING_RX_HARDWARE |
+				  SOF_TIMESTAMPING_RAW_HARDWARE;
+
+		if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0) {
+			ret = -errno;
+			goto error;
+		}
+	}
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		ret = -errno;
+		goto error;
+	}
+
+	memset(&sc.stats, 0x00, sizeof(sc.stats));
+	sc.rx.count	 = 0u;
+	sc.rx.index	 = 0u;
+	sc.tx.count	 = 0u;
+	sc.timestamping = config->timestamping;
+
+	for (uint32_t i = 0u; i < CONFIG_CANIOT_SOCKETCAN_BATCH; i++) {
+		sc.rx.iovs[i].iov_base		   = &sc.rx.frames[i];
+		sc.rx.iovs[i].iov_len		   = sizeof(struct can_frame);
+		sc.rx.msgs[i].msg_hdr.msg_iov	   = &sc.rx.iovs[i];
+		sc.rx.msgs[i].msg_hdr.msg_iovlen = 1u;
+
+		sc.tx.iovs[i].iov_base		   = &sc.tx.frames[i];
+		sc.tx.iovs[i].iov_len		   = sizeof(struct can_frame);
+		sc.tx.msgs[i].msg_hdr.msg_iov	   = &sc.tx.iovs[i];
+		sc.tx.msgs[i].msg_hdr.msg_iovlen = 1u;
+	}
+
+	sc.fd = fd;
+
+	return 0;
+
+error:
+	close(fd);
+	return ret;
+}
+
+void caniot_socketcan_close(void)
+{
+	if (sc.fd < 0) return;
+
+	caniot_socketcan_flush();
+
+	close(sc.fd);
+	sc.fd = -1;
+}
+
+int caniot_socketcan_fd(void)
+{
+	return sc.fd;
+}
+
+void caniot_socketcan_stats_get(struct caniot_socketcan_stats *stats)
+{
+	if (!stats) return;
+
+	pthread_mutex_lock(&sc.rx_lock);
+	pthread_mutex_lock(&sc.tx_lock);
+	*stats = sc.stats;
+	pthread_mutex_unlock(&sc.tx_lock);
+	pthread_mutex_unlock(&sc.rx_lock);
+}
@@ -0,0 +1,345 @@
+/*
+ * Copyright (c) 2023 Lucas Dietrich <ld.adecy@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <caniot/caniot_private.h>
+#include <caniot/controller.h>
+#include <caniot/linux/runtime.h>
+#include <caniot/linux/socketcan.h>
+#include <linux/can.h>
+#include <net/if.h>
+#include <sys/socket.h>
+
+#define CHECK(statement)                                                                 \
+	if ((statement) == false) {                                                      \
+		printf("%s:%d: %s: `%s' failed\n",                                      \
+		       __FILE__,                                                         \
+		       __LINE__,                                                         \
+		       __func__,                                                         \
+		       #statement);                                                      \
+		return false;                                                            \
+	}
+#define CHECK_0(statement) CHECK((statement) == 0)
+
+void __assert(bool statement)
+{
+	if (statement == false) {
+		printf("Assertion failed\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*____________________________________________________________________________*/
+
+/* Drivers exchanging raw caniot frames over a datagram socket pair, the
+ * controller owns sockets[0], the test plays the devices on sockets[1] */
+static struct {
+	int sockets[2u];
+
+	/* frames flush() pretends to be unable to send */
+	int flush_pending;
+	uint32_t flush_calls;
+} z_sock;
+
+static void z_entropy(uint8_t *buf, size_t len)
+{
+	memset(buf, 0x01, len);
+}
+
+static void z_get_time(uint32_t *sec, uint16_t *ms)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	*sec = ts.tv_sec;
+	if (ms != NULL) *ms = ts.tv_nsec / 1000000;
+}
+
+static int z_send(const struct caniot_frame *frame, uint32_t delay_ms)
+{
+	(void)delay_ms;
+
+	return (send(z_sock.sockets[0u], frame, sizeof(*frame), 0) < 0) ? -errno : 0;
+}
+
+static int z_recv(struct caniot_frame *frame)
+{
+	const ssize_t ret = recv(z_sock.sockets[0u], frame, sizeof(*frame), MSG_DONTWAIT);
+
+	if (ret < 0) {
+		return ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ? -CANIOT_EAGAIN : -errno;
+	}
+
+	return 0;
+}
+
+static int z_flush(void)
+{
+	z_sock.flush_calls++;
+
+	return z_sock.flush_pending;
+}
+
+static const struct caniot_drivers_api z_drivers = {
+	.entropy  = z_entropy,
+	.get_time = z_get_time,
+	.set_time = NULL,
+	.send	  = z_send,
+	.recv	  = z_recv,
+};
+
+struct z_ctx {
+	struct caniot_controller ctrl;
+	struct caniot_linux_runtime rt;
+
+	uint32_t count;
+	caniot_controller_event_t last;
+};
+
+static bool z_event_cb(const caniot_controller_event_t *ev, void *user_data)
+{
+	struct z_ctx *x = user_data;
+
+	x->count++;
+	x->last = *ev;
+
+	return true;
+}
+
+static bool z_init(struct z_ctx *x)
+{
+	memset(x, 0x00, sizeof(*x));
+	memset(&z_sock, 0x00, sizeof(z_sock));
+
+	CHECK_0(socketpair(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0, z_sock.sockets));
+	CHECK_0(caniot_controller_driv_init(&x->ctrl, &z_drivers, z_event_cb, x));
+	CHECK_0(caniot_linux_runtime_init(&x->rt, &x->ctrl, z_sock.sockets[0u]));
+
+	return true;
+}
+
+static void z_deinit(struct z_ctx *x)
+{
+	caniot_controller_deinit(&x->ctrl);
+	caniot_linux_runtime_deinit(&x->rt);
+	close(z_sock.sockets[0u]);
+	close(z_sock.sockets[1u]);
+}
+
+static uint32_t z_now_ms(void)
+{
+	uint32_t sec;
+	uint16_t ms;
+
+	z_get_time(&sec, &ms);
+
+	return sec * 1000u + ms;
+}
+
+/*____________________________________________________________________________*/
+
+/* A query is answered through the CAN socket */
+bool z_runtime_response(void)
+{
+	struct z_ctx x;
+	struct caniot_frame req, resp;
+	const caniot_did_t did = CANIOT_DID(CANIOT_DEVICE_CLASS0, 1u);
+	int h;
+
+	CHECK(z_init(&x));
+
+	caniot_build_query_telemetry(&req, CANIOT_ENDPOINT_APP);
+	CHECK((h = caniot_controller_query(&x.ctrl, did, &req, 1000u)) > 0);
+
+	/* the device answers the query it received */
+	CHECK(recv(z_sock.sockets[1u], &resp, sizeof(resp), 0) == sizeof(resp));
+	resp.id.query = CANIOT_RESPONSE;
+	resp.len      = 8u;
+	CHECK(send(z_sock.sockets[1u], &resp, sizeof(resp), 0) == sizeof(resp));
+
+	CHECK(caniot_linux_runtime_run_once(&x.rt, 1000) == 1);
+	CHECK(x.count == 1u && x.last.handle == h);
+	CHECK(x.last.status == CANIOT_CONTROLLER_EVENT_STATUS_OK);
+
+	z_deinit(&x);
+
+	return true;
+}
+
+/* The timer wakes the loop up when the query times out */
+bool z_runtime_timeout(void)
+{
+	struct z_ctx x;
+	struct caniot_frame req;
+	int h;
+
+	/* the controller clock is read on initialization */
+	const uint32_t start_ms = z_now_ms();
+
+	CHECK(z_init(&x));
+
+	caniot_build_query_telemetry(&req, CANIOT_ENDPOINT_APP);
+	CHECK((h = caniot_controller_query(
+		       &x.ctrl, CANIOT_DID(CANIOT_DEVICE_CLASS0, 1u), &req, 20u)) > 0);
+
+	while ((x.count == 0u) && (z_now_ms() - start_ms < 1000u)) {
+		CHECK(caniot_linux_runtime_run_once(&x.rt, 1000) >= 0);
+	}
+
+	CHECK(x.count == 1u && x.last.handle == h);
+	CHECK(x.last.status == CANIOT_CONTROLLER_EVENT_STATUS_TIMEOUT);
+	CHECK(z_now_ms() - start_ms >= 20u);
+	CHECK(x.rt.armed == false);
+
+	z_deinit(&x);
+
+	return true;
+}
+
+/* The loop waits for the CAN socket to become writable while frames are left
+ * to flush, and only then */
+bool z_runtime_flush_pending(void)
+{
+	struct z_ctx x;
+
+	CHECK(z_init(&x));
+	caniot_linux_runtime_set_flush(&x.rt, z_flush);
+
+	/* socket writable, the frames left are flushed again without delay */
+	z_sock.flush_pending = 2;
+	CHECK(caniot_linux_runtime_run_once(&x.rt, 1000) == 1);
+	CHECK(x.rt.tx_wait == true);
+	CHECK(z_sock.flush_calls == 2u);
+
+	/* all frames sent, the loop sleeps */
+	z_sock.flush_pending = 0;
+	CHECK(caniot_linux_runtime_run_once(&x.rt, 10) == 0);
+	CHECK(x.rt.tx_wait == false);
+	CHECK(z_sock.flush_calls == 3u);
+
+	z_deinit(&x);
+
+	return true;
+}
+
+/* Query a device over vcan0 with the SocketCAN drivers, skipped if the
+ * interface does not exist (modprobe vcan; ip link add dev vcan0 type vcan;
+ * ip link set up vcan0) */
+bool z_socketcan_vcan_smoke(void)
+{
+	const struct caniot_socketcan_config config = {
+		.ifname		   = "vcan0",
+		.controller_filter = true,
+		.timestamping	   = false,
+	};
+	struct sockaddr_can addr = {.can_family = AF_CAN};
+	struct caniot_socketcan_stats stats;
+	struct caniot_frame req, resp;
+	struct can_frame cf;
+	struct z_ctx x;
+	int h;
+
+	addr.can_ifindex = (int)if_nametoindex(config.ifname);
+	if (addr.can_ifindex == 0) {
+		printf("\tvcan0 not found, skipped\n");
+		return true;
+	}
+
+	memset(&x, 0x00, sizeof(x));
+	CHECK_0(caniot_socketcan_open(&config));
+	CHECK_0(caniot_controller_driv_init(&x.ctrl, &caniot_socketcan_drivers, z_event_cb, &x));
+	CHECK_0(caniot_linux_runtime_init(&x.rt, &x.ctrl, caniot_socketcan_fd()));
+	caniot_linux_runtime_set_flush(&x.rt, caniot_socketcan_flush);
+
+	/* the device, on its own socket */
+	const int dev = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+	CHECK(dev >= 0);
+	CHECK_0(bind(dev, (struct sockaddr *)&addr, sizeof(addr)));
+
+	caniot_build_query_telemetry(&req, CANIOT_ENDPOINT_APP);
+	CHECK((h = caniot_controller_query(
+		       &x.ctrl, CANIOT_DID(CANIOT_DEVICE_CLASS0, 1u), &req, 1000u)) > 0);
+	CHECK_0(caniot_socketcan_flush());
+
+	CHECK(read(dev, &cf, sizeof(cf)) == sizeof(cf));
+	CHECK_0(caniot_socketcan_from_can(&resp, &cf));
+	CHECK(resp.id.query == CANIOT_QUERY);
+
+	/* the query sent by the device is not received by the controller */
+	CHECK(write(dev, &cf, sizeof(cf)) == sizeof(cf));
+
+	resp.id.query = CANIOT_RESPONSE;
+	resp.len      = 8u;
+	caniot_socketcan_to_can(&cf, &resp);
+	CHECK(write(dev, &cf, sizeof(cf)) == sizeof(cf));
+
+	while (x.count == 0u) {
+		CHECK(caniot_linux_runtime_run_once(&x.rt, 1000) > 0);
+	}
+
+	CHECK(x.count == 1u && x.last.handle == h);
+	CHECK(x.last.status == CANIOT_CONTROLLER_EVENT_STATUS_OK);
+
+	caniot_socketcan_stats_get(&stats);
+	CHECK(stats.tx_frames == 1u && stats.rx_frames == 1u);
+
+	close(dev);
+	caniot_controller_deinit(&x.ctrl);
+	caniot_linux_runtime_deinit(&x.rt);
+	caniot_socketcan_close();
+
+	return true;
+}
+
+/*____________________________________________________________________________*/
+
+struct test {
+	const char *name;
+	bool (*test_handler)(void);
+};
+
+#define TEST(_handler)                                                                   \
+	{                                                                                \
+		.name = #_handler, .test_handler = _handler                              \
+	}
+
+const struct test tests[] = {
+	TEST(z_runtime_response),
+	TEST(z_runtime_timeout),
+	TEST(z_runtime_flush_pending),
+	TEST(z_socketcan_vcan_smoke),
+};
+
+int main(void)
+{
+	uint32_t tests_runned = 0u;
+	uint32_t tests_failed = 0u;
+
+	for (size_t i = 0; i < ARRAY_SIZE(tests); i++) {
+		const bool success = tests[i].test_handler();
+
+		printf("%lu:\t%s -- %s\n", i, success ? "OK" : "NOK", tests[i].name);
+
+		tests_runned++;
+		if (!success) tests_failed++;
+	}
+
+	printf("\n========================================");
+	printf("\nTests runned: %u failed: %u\n", tests_runned, tests_failed);
+	printf("========================================\n");
+
+	return tests_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -4,97 +4,366 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
-#include <caniot/caniot.h>
-#include <malloc.h>
+#include "header.h"
+
 #include <memory.h>
+#include <stddef.h>
+#include <stdio.h>
 
-struct item;
+#include <caniot/caniot.h>
 
-struct item {
-	struct item *next;
-	struct caniot_frame frame;
-};
+#define CANBUS_STD_IDS 2048u
+
+static struct can_bus_slot default_arena[CANBUS_DEFAULT_CAPACITY];
 
 /**
- * @brief doubly linked queue
- * Note: Keeping track of the head and the tail allows
- * to queue and dequeue with O(1) complexity
+ * @brief Emulated CAN bus
+ * Note: Frames waiting for their delay are kept in a min-heap by release time,
+ * released frames in a min-heap by arbitration key, so that sending and
+ * receiving a frame is O(log n) whatever the number of frames queued.
  */
-struct {
-	struct item *head;
-	struct item *tail;
-} queue = {
-	.head = NULL,
-	.tail = NULL,
+static struct {
+	struct can_bus_slot *slots;
+	uint32_t capacity;
+
+	uint32_t count;	    /* frames queued */
+	uint32_t n_ready;   /* entries of the "ready" heap */
+	uint32_t n_delayed; /* entries of the "delayed" heap */
+	uint32_t n_free;    /* entries of the "free" stack */
+
+	/* sequence number of the next frame sent */
+	uint32_t seq;
+
+	/* bit rate (bit/s), 0 for instantaneous transfers */
+	uint32_t bitrate;
+
+	/* virtual time the bus becomes idle */
+	uint64_t idle_us;
+
+	/* virtual time of the first frame sent */
+	uint64_t start_us;
+
+	struct can_bus_stats stats;
+	struct can_bus_id_stats ids[CANBUS_STD_IDS];
+} bus = {
+	.bitrate = CANBUS_DEFAULT_BITRATE,
 };
 
+typedef bool (*heap_less_t)(uint32_t a, uint32_t b);
+
+/* Entry i of the queue stored in the field at "offset" of the slots */
+static uint32_t *queue_entry(size_t offset, uint32_t i)
+{
+	return (uint32_t *)((uint8_t *)&bus.slots[i] + offset);
+}
+
+/* frames with the same key are received in the order they were sent */
+static bool ready_less(uint32_t a, uint32_t b)
+{
+	const struct can_bus_slot *const sa = &bus.slots[a];
+	const struct can_bus_slot *const sb = &bus.slots[b];
+
+	return (sa->key != sb->key) ? (sa->key < sb->key) : ((int32_t)(sa->seq - sb->seq) < 0);
+}
+
+static bool delayed_less(uint32_t a, uint32_t b)
+{
+	const struct can_bus_slot *const sa = &bus.slots[a];
+	const struct can_bus_slot *const sb = &bus.slots[b];
+
+	return (sa->queued_us != sb->queued_us) ? (sa->queued_us < sb->queued_us)
+						: ((int32_t)(sa->seq - sb->seq) < 0);
+}
+
+static void heap_push(size_t offset, uint32_t *n, heap_less_t less, uint32_t slot)
+{
+	uint32_t i = (*n)++;
+
+	while (i > 0u) {
+		const uint32_t parent = (i - 1u) / 2u;
+
+		if (!less(slot, *queue_entry(offset, parent))) break;
+
+		*queue_entry(offset, i) = *queue_entry(offset, parent);
+		i			= parent;
+	}
+
+	*queue_entry(offset, i) = slot;
+}
+
+static uint32_t heap_pop(size_t offset, uint32_t *n, heap_less_t less)
+{
+	const uint32_t top  = *queue_entry(offset, 0u);
+	const uint32_t last = *queue_entry(offset, --(*n));
+	uint32_t i	    = 0u;
+
+	for (;;) {
+		uint32_t child = 2u * i + 1u;
+
+		if (child >= *n) break;
+		if ((child + 1u < *n) &&
+		    less(*queue_entry(offset, child + 1u), *queue_entry(offset, child))) {
+			child++;
+		}
+		if (!less(*queue_entry(offset, child), last)) break;
+
+		*queue_entry(offset, i) = *queue_entry(offset, child);
+		i			= child;
+	}
+
+	if (*n != 0u) {
+		*queue_entry(offset, i) = last;
+	}
+
+	return top;
+}
+
+#define READY	offsetof(struct can_bus_slot, ready)
+#define DELAYED offsetof(struct can_bus_slot, delayed)
+#define FREE	offsetof(struct can_bus_slot, free)
+
+/**
+ * @brief Reset the emulated CAN bus, optionally with a caller provided arena
+ *
+ * @param arena Storage for the frames, NULL to use the default one
+ * @param capacity Number of frames of the arena
+ * @return int 0 on success
+ */
+int can_bus_init(struct can_bus_slot *arena, uint32_t capacity)
+{
+	if (arena == NULL) {
+		arena	 = default_arena;
+		capacity = CANBUS_DEFAULT_CAPACITY;
+	}
+
+	if (capacity == 0u) {
+		return -CANIOT_EINVAL;
+	}
+
+	bus.slots     = arena;
+	bus.capacity  = capacity;
+	bus.count     = 0u;
+	bus.n_ready   = 0u;
+	bus.n_delayed = 0u;
+	bus.idle_us   = 0u;
+	memset(&bus.stats, 0x00, sizeof(bus.stats));
+	memset(bus.ids, 0x00, sizeof(bus.ids));
+
+	for (bus.n_free = 0u; bus.n_free < capacity; bus.n_free++) {
+		*queue_entry(FREE, bus.n_free) = capacity - 1u - bus.n_free;
+	}
+
+	return 0;
+}
+
+void can_bus_set_bitrate(uint32_t bitrate)
+{
+	bus.bitrate = bitrate;
+}
+
+/**
+ * @brief Number of bits the frame occupies on the bus, including worst-case
+ * bit stuffing and the interframe space
+ */
+uint32_t can_bus_frame_bits(const struct caniot_frame *frame)
+{
+	const uint32_t data = 8u * frame->len;
+
+#if CONFIG_CANIOT_QUERY_ID
+	if (caniot_id_is_extended(frame->id)) {
+		/* 54 stuffable header bits + data + CRC, 13 bits of delimiters,
+		 * ACK, EOF and interframe space */
+		return 67u + data + (54u + data - 1u) / 4u;
+	}
+#endif
+
+	return 47u + data + (34u + data - 1u) / 4u;
+}
+
+/* Arbitration field as seen on the wire, the lowest value wins: the 11-bit base
+ * ID first, then a standard frame wins over an extended frame with the same base
+ * ID (recessive SRR/IDE bits), then the 18-bit ID extension */
+static uint32_t frame_arbitration_key(const struct caniot_frame *frame)
+{
+#if CONFIG_CANIOT_QUERY_ID
+	if (caniot_id_is_extended(frame->id)) {
+		const uint32_t ext_id = caniot_id_to_ext_canid(frame->id);
+
+		return ((ext_id >> 18u) << 19u) | (1u << 18u) | (ext_id & 0x3FFFFu);
+	}
+#endif
+
+	return (uint32_t)caniot_id_to_canid(frame->id) << 19u;
+}
+
+void can_bus_stats_get(struct can_bus_stats *stats)
+{
+	if (stats != NULL) {
+		*stats		  = bus.stats;
+		stats->pending	  = bus.count;
+		stats->elapsed_us = (bus.stats.sent != 0u) ? vtime_get_us() - bus.start_us : 0u;
+	}
+}
+
+const struct can_bus_id_stats *can_bus_id_stats_get(uint16_t canid)
+{
+	return (canid < CANBUS_STD_IDS) ? &bus.ids[canid] : NULL;
+}
+
+void can_bus_report(void)
+{
+	struct can_bus_stats stats;
+
+	can_bus_stats_get(&stats);
+
+	printf("bus: %u bit/s sent=%u received=%u overflows=%u pending=%u "
+	       "max_pending=%u load=%.1f %%\n",
+	       bus.bitrate,
+	       stats.sent,
+	       stats.received,
+	       stats.overflows,
+	       stats.pending,
+	       stats.max_pending,
+	       stats.elapsed_us ? (100.0 * stats.busy_us) / stats.elapsed_us : 0.0);
+
+	for (uint16_t canid = 0u; canid < CANBUS_STD_IDS; canid++) {
+		const struct can_bus_id_stats *id = &bus.ids[canid];
+
+		if (id->frames != 0u) {
+			printf("\t[ 0x%03x ] frames=%u delay avg=%lu us max=%lu us\n",
+			       canid,
+			       id->frames,
+			       (unsigned long)(id->total_delay_us / id->frames),
+			       (unsigned long)id->max_delay_us);
+		}
+	}
+}
+
 /**
  * @brief Send a can message on the emulated CAN bus
  *
  * Frame pointed by the pointer can be deallocated after the function terminates.
  *
  * @param frame
- * @param delay_ms ignored, frame is always without delay
- * @return int 0 on success
+ * @param delay_ms the frame takes part in the arbitration once the delay elapsed
+ * @return int 0 on success, -CANIOT_EAGAIN if the bus is full (frame dropped)
  */
 int can_send(const struct caniot_frame *frame, uint32_t delay_ms)
 {
-	int ret = -CANIOT_EINVAL;
+	if (frame == NULL) {
+		return -CANIOT_EINVAL;
+	}
 
-	(void)delay_ms;
+	if (bus.slots == NULL) {
+		can_bus_init(NULL, 0u);
+	}
+
+	if (bus.count == bus.capacity) {
+		bus.stats.overflows++;
+		return -CANIOT_EAGAIN;
+	}
 
-	if (frame != NULL) {
-		struct item *item = malloc(sizeof(struct item));
+	const uint32_t idx		= *queue_entry(FREE, --bus.n_free);
+	struct can_bus_slot *const slot = &bus.slots[idx];
 
-		// copy frame
-		memcpy(&item->frame, frame, sizeof(struct caniot_frame));
+	memcpy(&slot->frame, frame, sizeof(struct caniot_frame));
+	slot->queued_us = vtime_get_us() + (uint64_t)delay_ms * 1000u;
+	slot->key	= frame_arbitration_key(frame);
+	slot->seq	= bus.seq++;
 
-		// queue can message
-		if (queue.tail != NULL) {
-			queue.tail->next = item;
-		} else {
-			queue.head = item;
-		}
-		queue.tail = item;
-		item->next = NULL;
+	/* released on the next reception, if the delay elapsed */
+	heap_push(DELAYED, &bus.n_delayed, delayed_less, idx);
 
-		ret = 0U;
+	if (bus.stats.sent++ == 0u) {
+		bus.start_us = vtime_get_us();
 	}
 
-	// printf("\tcan_send(%p, %u) = -0x%X\n", &frame, delay_ms, -ret);
+	bus.count++;
+	if (bus.count > bus.stats.max_pending) {
+		bus.stats.max_pending = bus.count;
+	}
+
+	// printf("\tcan_send(%p, %u) = 0\n", &frame, delay_ms);
 
-	return ret;
+	return 0;
 }
 
 /**
  * @brief Receive a CAN message from the emulated CAN bus
  *
+ * The frame with the highest priority (lowest CAN ID) among the frames whose
+ * delay elapsed wins the arbitration, frames with the same ID are received in
+ * the order they were sent. The virtual time is advanced to the end of the
+ * transmission of the frame.
+ *
+ * Note: Frames whose delay did not elapse yet are not received, the caller
+ * advances the virtual time (and handles the events due meanwhile) before
+ * trying again.
+ *
  * @param frame Should point to a valid memory space
- * @return int 0 on success
+ * @return int 0 on success, -CANIOT_EAGAIN if no frame is released
  */
 int can_recv(struct caniot_frame *frame)
 {
-	int ret = -CANIOT_EINVAL;
+	if (frame == NULL) {
+		return -CANIOT_EINVAL;
+	}
 
-	if (frame != NULL) {
-		// dequeue if not null
-		if (queue.head != NULL) {
-			struct item *item = queue.head;
-			queue.head	  = queue.head->next;
+	if (bus.count == 0u) {
+		return -CANIOT_EAGAIN;
+	}
 
-			if (queue.head == NULL) {
-				queue.tail = NULL;
-			}
+	/* transmission starts when the bus is idle */
+	const uint64_t now_us	= vtime_get_us();
+	const uint64_t start_us = (bus.idle_us > now_us) ? bus.idle_us : now_us;
 
-			memcpy(frame, &item->frame, sizeof(struct caniot_frame));
+	while ((bus.n_delayed != 0u) &&
+	       (bus.slots[*queue_entry(DELAYED, 0u)].queued_us <= start_us)) {
+		heap_push(READY,
+			  &bus.n_ready,
+			  ready_less,
+			  heap_pop(DELAYED, &bus.n_delayed, delayed_less));
+	}
 
-			ret = 0;
-		} else {
-			ret = -CANIOT_EAGAIN;
-		}
+	/* all frames are delayed, the time is not advanced past the events the
+	 * caller has to handle before */
+	if (bus.n_ready == 0u) {
+		return -CANIOT_EAGAIN;
+	}
+
+	/* arbitration, between the frames released */
+	const uint32_t idx		= heap_pop(READY, &bus.n_ready, ready_less);
+	const struct can_bus_slot slot = bus.slots[idx];
+
+	*queue_entry(FREE, bus.n_free++) = idx;
+	bus.count--;
+
+	uint64_t duration_us = 0u;
+
+	if (bus.bitrate != 0u) {
+		duration_us = ((uint64_t)can_bus_frame_bits(&slot.frame) * 1000000u +
+			       bus.bitrate - 1u) /
+			      bus.bitrate;
 	}
 
-	// printf("\tcan_recv(%p, 0) = -0x%X\n", &frame, -ret);
+	bus.idle_us = start_us + duration_us;
+	vtime_inc_us(bus.idle_us - now_us);
 
-	return ret;
-}
\ No newline at end of file
+	bus.stats.received++;
+	bus.stats.busy_us += duration_us;
+
+	struct can_bus_id_stats *const id = &bus.ids[caniot_id_to_canid(slot.frame.id)];
+	const uint64_t delay_us		  = start_us - slot.queued_us;
+
+	id->frames++;
+	id->total_delay_us += delay_us;
+	if (delay_us > id->max_delay_us) {
+		id->max_delay_us = delay_us;
+	}
+
+	memcpy(frame, &slot.frame, sizeof(struct caniot_frame));
+
+	// printf("\tcan_recv(%p, 0) = 0\n", &frame);
+
+	return 0;
+}
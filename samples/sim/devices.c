@@ -6,6 +6,8 @@
 
 #include "header.h"
 
+#include <stdlib.h>
+
 #include <caniot/caniot.h>
 #include <caniot/caniot_private.h>
 #include <caniot/device.h>
@@ -128,6 +130,25 @@ void init_devices(void)
 	}
 }
 
+/* Responses to a broadcast request are spread over the telemetry delay range
+ * of the device, as done by caniot_device_process() */
+static uint32_t response_delay(struct caniot_device *dev, const struct caniot_frame *req)
+{
+	if (caniot_is_broadcast(CANIOT_DID(req->id.cls, req->id.sid)) == false) {
+		return 0U;
+	}
+
+	const uint16_t delay_min = dev->config->telemetry.delay_min;
+	const uint16_t delay_max = dev->config->telemetry.delay_max;
+
+	uint32_t amplitude = CANIOT_TELEMETRY_DELAY_MAX_DEFAULT_MS;
+	if (delay_max > delay_min) {
+		amplitude = delay_max - delay_min;
+	}
+
+	return delay_min + ((uint32_t)rand() % amplitude);
+}
+
 void devices_process(const struct caniot_frame *req)
 {
 	struct caniot_frame resp;
@@ -141,7 +162,14 @@ void devices_process(const struct caniot_frame *req)
 			// caniot_explain_frame(&resp);
 			// printf("\n");
 
-			can_send(&resp, 0U);
+			const uint32_t delay_ms = response_delay(&devices[i], req);
+			if (delay_ms != 0U) {
+				printf("[DEV] %u response delayed by %u ms\n",
+				       devices[i].identification->did,
+				       delay_ms);
+			}
+
+			can_send(&resp, delay_ms);
 		}
 	}
 }
\ No newline at end of file
@@ -29,12 +29,60 @@ int ctrl_Q(uint32_t ctrlid,
 	   uint32_t timeout);
 int ctrl_C(uint32_t ctrlid, uint8_t handle, bool suppress);
 
+/* Frames the emulated CAN bus can hold by default */
+#define CANBUS_DEFAULT_CAPACITY 256u
+
+/* Default bit rate of the emulated CAN bus, 0 for instantaneous transfers */
+#define CANBUS_DEFAULT_BITRATE 125000u
+
+struct can_bus_slot {
+	struct caniot_frame frame;
+	uint64_t queued_us; /* virtual time the frame was sent at, plus its delay */
+
+	uint32_t key; /* arbitration field */
+	uint32_t seq; /* order of the can_send() calls */
+
+	/* Storage of the bus queues, the i-th slot of the arena holds the i-th
+	 * entry of each of them (slot indexes) */
+	uint32_t ready;	  /* heap of the frames released, by arbitration key */
+	uint32_t delayed; /* heap of the frames waiting for their delay */
+	uint32_t free;	  /* stack of the free slots */
+};
+
+struct can_bus_stats {
+	uint32_t sent;
+	uint32_t received;
+	uint32_t overflows; /* frames dropped because the bus was full */
+	uint32_t pending;
+	uint32_t max_pending;
+
+	uint64_t busy_us;    /* time spent transmitting frames */
+	uint64_t elapsed_us; /* time since the first frame */
+};
+
+/* Queueing delay (from can_send(), once its delay elapsed, to the start of the
+ * transmission) per 11-bit CANIOT ID */
+struct can_bus_id_stats {
+	uint32_t frames;
+	uint64_t total_delay_us;
+	uint64_t max_delay_us;
+};
+
+int can_bus_init(struct can_bus_slot *arena, uint32_t capacity);
+void can_bus_set_bitrate(uint32_t bitrate);
+void can_bus_stats_get(struct can_bus_stats *stats);
+const struct can_bus_id_stats *can_bus_id_stats_get(uint16_t canid);
+void can_bus_report(void);
+uint32_t can_bus_frame_bits(const struct caniot_frame *frame);
+
 int can_send(const struct caniot_frame *frame, uint32_t delay_ms);
 int can_recv(struct caniot_frame *frame);
 
 void get_time(uint32_t *sec, uint16_t *ms);
 void vtime_get(uint32_t *sec, uint16_t *ms);
 void vtime_inc(uint32_t inc_ms);
+uint64_t vtime_get_us(void);
+void vtime_inc_us(uint64_t inc_us);
 static inline void vtime_inc_const(void)
 {
 	vtime_inc(VTIME_INC_CONST_VAL);
@@ -82,6 +82,7 @@ int main(void)
 {
 	uint32_t counter = 0;
 
+	can_bus_init(NULL, 0u);
 	init_controllers();
 	init_devices();
 
@@ -126,20 +127,36 @@ int main(void)
 			case 's':
 				controllers_discovery_stop();
 				break;
+			case 'b':
+				can_bus_report();
+				break;
+			case '1':
+				can_bus_set_bitrate(125000u);
+				break;
+			case '2':
+				can_bus_set_bitrate(250000u);
+				break;
+			case '5':
+				can_bus_set_bitrate(500000u);
+				break;
 			default:
 				break;
 			}
 		}
 
-		/* Compute time delta */
+		/* Process a single frame */
+		ret = can_recv(&frame);
+
+		/* Compute time delta, once the frame is received: the controllers
+		 * see the time its transmission took */
+		vtime_get(&sec, &ms);
+		const uint64_t rx_time = (uint64_t)sec * 1000U + ms;
 		if (last_time == 0u) {
-			last_time = now;
+			last_time = rx_time;
 		}
-		const uint64_t delta = now - last_time;
-		last_time	     = now;
+		const uint64_t delta = rx_time - last_time;
+		last_time	     = rx_time;
 
-		/* Process a single frame */
-		ret = can_recv(&frame);
 		if (ret == 0U) {
 			// caniot_show_frame(&frame);
 			caniot_explain_frame(&frame);
@@ -152,7 +169,13 @@ int main(void)
 			}
 		} else if (ret == -CANIOT_EAGAIN) {
 			controllers_process(NULL, delta);
-			sleep(1);
+
+			/* frames may be released as the virtual time advances */
+			struct can_bus_stats stats;
+			can_bus_stats_get(&stats);
+			if (stats.pending == 0u) {
+				sleep(1);
+			}
 		} else {
 			printf("Error on can_recv\n");
 			exit(EXIT_FAILURE);
@@ -8,10 +8,13 @@
 #include <stdint.h>
 #include <stdio.h>
 
-static uint64_t time_ms = 0U;
+/* microsecond resolution for the bus timing model */
+static uint64_t time_us = 0U;
 
 void vtime_get(uint32_t *sec, uint16_t *ms)
 {
+	const uint64_t time_ms = time_us / 1000U;
+
 	if (sec != NULL) {
 		*sec = time_ms / 1000U;
 	}
@@ -28,5 +31,15 @@ void vtime_inc(uint32_t inc_ms)
 	// printf("[ vtime_inc %lu + %u ms = %lu ms]\n",
 	//        time_ms, inc_ms, time_ms + inc_ms);
 
-	time_ms += inc_ms;
+	time_us += (uint64_t)inc_ms * 1000U;
+}
+
+uint64_t vtime_get_us(void)
+{
+	return time_us;
+}
+
+void vtime_inc_us(uint64_t inc_us)
+{
+	time_us += inc_us;
 }
\ No newline at end of file
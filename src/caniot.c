@@ -503,6 +503,22 @@ caniot_id_t caniot_canid_to_id(uint16_t canid)
 	return id;
 }
 
+#if CONFIG_CANIOT_QUERY_ID
+uint32_t caniot_id_to_ext_canid(caniot_id_t id)
+{
+	return CANIOT_EXT_ID(caniot_id_to_canid(id), id.query_id);
+}
+
+caniot_id_t caniot_ext_canid_to_id(uint32_t ext_canid)
+{
+	caniot_id_t id = caniot_canid_to_id(CANIOT_EXT_ID_GET_STD_ID(ext_canid));
+
+	id.query_id = CANIOT_EXT_ID_GET_QUERY_ID(ext_canid);
+
+	return id;
+}
+#endif
+
 bool caniot_is_error_frame(caniot_id_t id)
 {
 	return id.query == CANIOT_RESPONSE &&
@@ -14,8 +14,56 @@
 
 #define INVALID_HANDLE ((uint8_t)0x00U)
 
+#if CONFIG_CANIOT_MAX_PENDING_QUERIES >= 255u
+#error "CONFIG_CANIOT_MAX_PENDING_QUERIES must be lower than CANIOT_HANDLE_EXT"
+#endif
+
+#if CONFIG_CANIOT_CTRL_RETRY && !CONFIG_CANIOT_CTRL_DRIVERS_API
+#error "CONFIG_CANIOT_CTRL_RETRY requires CONFIG_CANIOT_CTRL_DRIVERS_API"
+#endif
+
+#if CONFIG_CANIOT_CTRL_SUBMIT_QUEUE && !CONFIG_CANIOT_CTRL_DRIVERS_API
+#error "CONFIG_CANIOT_CTRL_SUBMIT_QUEUE requires CONFIG_CANIOT_CTRL_DRIVERS_API"
+#endif
+
+#if CONFIG_CANIOT_CTRL_BCAST_AGGREGATE && !CONFIG_CANIOT_CTRL_DRIVERS_API
+#error "CONFIG_CANIOT_CTRL_BCAST_AGGREGATE requires CONFIG_CANIOT_CTRL_DRIVERS_API"
+#endif
+
+#if CONFIG_CANIOT_CTRL_TX_SHAPER && !CONFIG_CANIOT_CTRL_DRIVERS_API
+#error "CONFIG_CANIOT_CTRL_TX_SHAPER requires CONFIG_CANIOT_CTRL_DRIVERS_API"
+#endif
+
+#if CONFIG_CANIOT_CTRL_DEVICE_PACING && !CONFIG_CANIOT_CTRL_TX_SHAPER
+#error "CONFIG_CANIOT_CTRL_DEVICE_PACING requires CONFIG_CANIOT_CTRL_TX_SHAPER"
+#endif
+
+#if CONFIG_CANIOT_CTRL_TX_BACKPRESSURE && !CONFIG_CANIOT_CTRL_TX_SHAPER
+#error "CONFIG_CANIOT_CTRL_TX_BACKPRESSURE requires CONFIG_CANIOT_CTRL_TX_SHAPER"
+#endif
+
+#if CONFIG_CANIOT_CTRL_TX_PRIORITY && !CONFIG_CANIOT_CTRL_TX_SHAPER
+#error "CONFIG_CANIOT_CTRL_TX_PRIORITY requires CONFIG_CANIOT_CTRL_TX_SHAPER"
+#endif
+
+/* Initial state of the retransmission jitter generator (any non-zero value) */
+#define RETRY_JITTER_SEED 0x2545F491u
+
+/* Query id is built from the handle of the query (LSB) for direct lookup */
+#define QUERY_ID(gen, handle)	((uint16_t)(((uint16_t)(gen) << 8u) | (handle)))
+#define QUERY_ID_GET_HANDLE(id) ((uint8_t)((id)&0xFFu))
+
 static void stop_discovery(struct caniot_controller *ctrl);
 
+#if CONFIG_CANIOT_CTRL_DRIVERS_API
+static void clock_refresh(struct caniot_controller *ctrl);
+#endif
+
+#if CONFIG_CANIOT_CTRL_TX_SHAPER
+static void txq_init(struct caniot_controller *ctrl);
+static void txq_drop(struct caniot_controller *ctrl, struct pendq *pq);
+#endif
+
 static bool is_query_pending_for(struct caniot_controller *ctrl, caniot_did_t did)
 {
 	ASSERT(ctrl != NULL);
@@ -41,476 +89,2130 @@ mark_query_pending_for(struct caniot_controller *ctrl, caniot_did_t did, bool st
 	}
 }
 
-// Finalize frame with device id
-static void finalize_query_frame(struct caniot_frame *frame, caniot_did_t did)
+#if CONFIG_CANIOT_CTRL_PIPELINE_DEPTH > 1
+
+/* Append the query at the end of the pipeline of its device */
+static void pipeline_append(struct caniot_controller *ctrl, struct pendq *pq)
 {
-	ASSERT(frame != NULL);
+	ASSERT(ctrl != NULL);
+	ASSERT(pq != NULL);
 
-	frame->id.query = CANIOT_QUERY;
+	struct pendq **prev_next_p = &ctrl->pendingq.by_did[pq->did];
+	while (*prev_next_p != NULL) {
+		prev_next_p = &(*prev_next_p)->pipeline_next;
+	}
 
-	frame->id.cls = CANIOT_DID_CLS(did);
-	frame->id.sid = CANIOT_DID_SID(did);
+	pq->pipeline_next = NULL;
+	*prev_next_p	  = pq;
 }
 
-static void _pendq_queue(struct pqt **root, struct pqt *item)
+static void pipeline_unlink(struct caniot_controller *ctrl, struct pendq *pq)
 {
-	ASSERT(root != NULL);
-	ASSERT(item != NULL);
+	ASSERT(ctrl != NULL);
+	ASSERT(pq != NULL);
 
-	struct pqt **prev_next_p = root;
+	struct pendq **prev_next_p = &ctrl->pendingq.by_did[pq->did];
 	while (*prev_next_p != NULL) {
-		struct pqt *p_current = *prev_next_p;
-
-		if (p_current->delay <= item->delay) {
-			item->delay -= p_current->delay;
-			prev_next_p = &(p_current->next);
-		} else {
-			item->next = p_current;
-			p_current->delay -= item->delay;
+		if (*prev_next_p == pq) {
+			*prev_next_p	  = pq->pipeline_next;
+			pq->pipeline_next = NULL;
 			break;
 		}
+		prev_next_p = &(*prev_next_p)->pipeline_next;
 	}
-	*prev_next_p = item;
 }
 
-static void
-pendq_queue(struct caniot_controller *ctrl, struct pendq *pq, uint32_t timeout)
+static uint8_t pipeline_count(struct caniot_controller *ctrl, caniot_did_t did)
 {
 	ASSERT(ctrl != NULL);
-	ASSERT(pq != NULL);
-	ASSERT(timeout != CANIOT_TIMEOUT_FOREVER);
 
-	if (pq == NULL) return;
+	uint8_t count = 0u;
+	struct pendq *pq;
 
-	/* last item doesn't have a "next" item */
-	pq->tie.next	= NULL;
-	pq->tie.timeout = timeout;
+	for (pq = ctrl->pendingq.by_did[did]; pq != NULL; pq = pq->pipeline_next) {
+		count++;
+	}
 
-	_pendq_queue(&ctrl->pendingq.timeout_queue, &pq->tie);
+	return count;
+}
 
-	__DBG("pendq_queue(ps: %p, timeout: %u)\n", (void *)pq, timeout);
+#endif /* CONFIG_CANIOT_CTRL_PIPELINE_DEPTH > 1 */
+
+/* Tells whether no more query can be sent to the device until a pending one
+ * completes */
+static bool is_pipeline_full(struct caniot_controller *ctrl, caniot_did_t did)
+{
+	ASSERT(ctrl != NULL);
+
+#if CONFIG_CANIOT_CTRL_PIPELINE_DEPTH > 1
+	return pipeline_count(ctrl, did) >= CONFIG_CANIOT_CTRL_PIPELINE_DEPTH;
+#else
+	return is_query_pending_for(ctrl, did);
+#endif
 }
 
-static void pendq_shift(struct caniot_controller *ctrl, uint32_t time_passed_ms)
+/* Register the query as pending for its device */
+static void pendq_track(struct caniot_controller *ctrl, struct pendq *pq)
 {
 	ASSERT(ctrl != NULL);
+	ASSERT(pq != NULL);
 
-	__DBG("pendq_shift(time_passed_ms: %u)\n", time_passed_ms);
+#if CONFIG_CANIOT_CTRL_PIPELINE_DEPTH > 1
+	pipeline_append(ctrl, pq);
+#else
+	ctrl->pendingq.by_did[pq->did] = pq;
+#endif
 
-	if (time_passed_ms == 0u) return;
+	mark_query_pending_for(ctrl, pq->did, true);
+}
 
-	struct pqt **prev_next_p = &ctrl->pendingq.timeout_queue;
-	while (*prev_next_p != NULL) {
-		struct pqt *p_current = *prev_next_p;
+/* Next query pending for the same device */
+static struct pendq *pendq_next_of_did(struct pendq *pq)
+{
+	ASSERT(pq != NULL);
 
-		if (p_current->delay <= time_passed_ms) {
-			if (p_current->delay != 0) {
-				time_passed_ms -= p_current->delay;
-				p_current->delay = 0;
-			}
-			prev_next_p = &(p_current->next);
-		} else {
-			p_current->delay -= time_passed_ms;
-			break;
-		}
-	}
+#if CONFIG_CANIOT_CTRL_PIPELINE_DEPTH > 1
+	return pq->pipeline_next;
+#else
+	(void)pq;
+	return NULL;
+#endif
 }
 
-static struct pendq *pendq_pop_expired(struct pqt **root)
+#if CONFIG_CANIOT_CTRL_COALESCE
+
+/* Find a query pending for the device the (not yet finalized) query frame can
+ * wait for the response of */
+static struct pendq *
+coalesce_find_leader(struct caniot_controller *ctrl, caniot_did_t did, struct caniot_frame *frame)
 {
-	ASSERT(root != NULL);
+	ASSERT(ctrl != NULL);
+	ASSERT(frame != NULL);
 
 	struct pendq *pq = NULL;
 
-	if ((*root != NULL) && ((*root)->delay == 0)) {
-		struct pqt *item = *root;
-		*root		 = (*root)->next;
+	if (caniot_is_broadcast(did)) {
+		goto exit;
+	}
 
-		pq = CONTAINER_OF(item, struct pendq, tie);
+	for (pq = ctrl->pendingq.by_did[did]; pq != NULL; pq = pendq_next_of_did(pq)) {
+		if (pq->query_type != frame->id.type) {
+			continue;
+		} else if ((frame->id.type == CANIOT_FRAME_TYPE_TELEMETRY) &&
+			   (pq->req_endpoint == frame->id.endpoint)) {
+			break;
+		} else if ((frame->id.type == CANIOT_FRAME_TYPE_READ_ATTRIBUTE) &&
+			   (pq->req_attr == frame->attr.key)) {
+			break;
+		}
 	}
 
-	__DBG("pendq_pop_expired() -> %p\n", (void *)pq);
+exit:
+	__DBG("coalesce_find_leader(did: %u, frame: %p) -> pq: %p\n",
+	      did,
+	      (void *)frame,
+	      (void *)pq);
 
 	return pq;
 }
 
-static struct pendq *pendq_pop(struct pqt **root)
+static void coalesce_attach(struct pendq *leader, struct pendq *pq)
 {
-	ASSERT(root != NULL);
-
-	struct pendq *pq = NULL;
-
-	if (*root != NULL) {
-		struct pqt *item = *root;
-		*root		 = (*root)->next;
+	ASSERT(leader != NULL);
+	ASSERT(pq != NULL);
 
-		pq = CONTAINER_OF(item, struct pendq, tie);
+	struct pendq **prev_next_p = &leader->waiters;
+	while (*prev_next_p != NULL) {
+		prev_next_p = &(*prev_next_p)->waiter_next;
 	}
 
-	__DBG("pendq_pop() -> %p\n", (void *)pq);
+	pq->leader	= leader;
+	pq->waiter_next = NULL;
+	*prev_next_p	= pq;
 
-	return pq;
+#if CONFIG_CANIOT_QUERY_ID
+	/* the response will carry the id of the leader */
+	pq->query_id = leader->query_id;
+#endif
 }
 
-static void pendq_tqueue_remove(struct caniot_controller *ctrl, struct pendq *pq)
+static void coalesce_detach(struct pendq *pq)
 {
-	ASSERT(ctrl != NULL);
 	ASSERT(pq != NULL);
+	ASSERT(pq->leader != NULL);
 
-	struct pqt **prev_next_p = &ctrl->pendingq.timeout_queue;
+	struct pendq **prev_next_p = &pq->leader->waiters;
 	while (*prev_next_p != NULL) {
-		struct pqt *p_current = *prev_next_p;
-		if (p_current == &pq->tie) {
-			__DBG("pendq_tqueue_remove(pq: %p) -> removed\n", (void *)pq);
-
-			*prev_next_p = p_current->next;
-			if (p_current->next != NULL) {
-				p_current->next->delay += pq->tie.delay;
-			}
-			pq->tie.next = NULL;
-			return;
+		if (*prev_next_p == pq) {
+			*prev_next_p = pq->waiter_next;
+			break;
 		}
-		prev_next_p = &(p_current->next);
+		prev_next_p = &(*prev_next_p)->waiter_next;
 	}
 
-	__DBG("pendq_tqueue_remove(pq: %p) -> not found\n", (void *)pq);
+	pq->leader	= NULL;
+	pq->waiter_next = NULL;
 }
 
-static struct pendq *pendq_alloc(struct caniot_controller *ctrl)
+/* Take the waiters off the leader, they are no longer attached to any query */
+static struct pendq *coalesce_take_waiters(struct pendq *leader)
 {
-	ASSERT(ctrl != NULL);
+	ASSERT(leader != NULL);
 
-	struct pendq *p = ctrl->pendingq.free_list;
-	if (p != NULL) {
-		__DBG("pendq_alloc() -> pq: %p\n", (void *)p);
+	struct pendq *const waiters = leader->waiters;
+	struct pendq *pq;
 
-		ctrl->pendingq.free_list = p->next;
-	} else {
-		__DBG("pendq_alloc() -> NULL\n");
+	for (pq = waiters; pq != NULL; pq = pq->waiter_next) {
+		pq->leader = NULL;
 	}
-	return p;
+	leader->waiters = NULL;
+
+	return waiters;
 }
 
-static void pendq_free(struct caniot_controller *ctrl, struct pendq *pq)
+/* The leader is about to be released without response, the first waiter takes
+ * its place for the device so that the response (if any) completes it */
+static void coalesce_promote(struct caniot_controller *ctrl, struct pendq *leader)
 {
 	ASSERT(ctrl != NULL);
+	ASSERT(leader != NULL);
 
-	if (pq != NULL) {
-		__DBG("pendq_free(pq: %p)\n", (void *)pq);
+	struct pendq *const heir = coalesce_take_waiters(leader);
+	struct pendq *pq;
 
-		pq->next		 = ctrl->pendingq.free_list;
-		pq->handle		 = INVALID_HANDLE;
-		ctrl->pendingq.free_list = pq;
-	} else {
-		__DBG("pendq_free(NULL)\n");
+	if (heir == NULL) return;
+
+	heir->waiters	  = heir->waiter_next;
+	heir->waiter_next = NULL;
+	for (pq = heir->waiters; pq != NULL; pq = pq->waiter_next) {
+		pq->leader = heir;
 	}
+
+#if CONFIG_CANIOT_CTRL_PIPELINE_DEPTH > 1
+	/* insert right after the leader, which is unlinked next */
+	heir->pipeline_next   = leader->pipeline_next;
+	leader->pipeline_next = heir;
+#else
+	ctrl->pendingq.by_did[leader->did] = heir;
+#endif
+
+	__DBG("coalesce_promote(leader: %p) -> heir: %p\n", (void *)leader, (void *)heir);
 }
 
-static void pendq_init_queue(struct caniot_controller *ctrl)
+#endif /* CONFIG_CANIOT_CTRL_COALESCE */
+
+/* Unregister the query for its device */
+static void pendq_untrack(struct caniot_controller *ctrl, struct pendq *pq)
 {
 	ASSERT(ctrl != NULL);
+	ASSERT(pq != NULL);
 
-	/* init free list */
-	ctrl->pendingq.free_list = NULL;
-	struct pendq *cur	 = ctrl->pendingq.pool;
-	while (cur < ctrl->pendingq.pool + CONFIG_CANIOT_MAX_PENDING_QUERIES) {
-		pendq_free(ctrl, cur++);
+#if CONFIG_CANIOT_CTRL_COALESCE
+	if (pq->leader != NULL) {
+		/* a waiting query is not tracked for the device */
+		coalesce_detach(pq);
+		return;
 	}
 
-	/* init timeout queue */
-	ctrl->pendingq.timeout_queue = NULL;
+	coalesce_promote(ctrl, pq);
+#endif
+
+#if CONFIG_CANIOT_CTRL_PIPELINE_DEPTH > 1
+	pipeline_unlink(ctrl, pq);
+#else
+	if (ctrl->pendingq.by_did[pq->did] == pq) {
+		ctrl->pendingq.by_did[pq->did] = NULL;
+	}
+#endif
+
+	mark_query_pending_for(ctrl, pq->did, ctrl->pendingq.by_did[pq->did] != NULL);
 }
 
-static struct pendq *pendq_get_by_did(struct caniot_controller *ctrl, caniot_did_t did)
+// Finalize frame with device id
+static void finalize_query_frame(struct caniot_frame *frame, caniot_did_t did)
 {
-	ASSERT(ctrl != NULL);
+	ASSERT(frame != NULL);
 
-	struct pendq *retpq = NULL;
+	frame->id.query = CANIOT_QUERY;
 
-	struct pqt *tie;
-	for (tie = ctrl->pendingq.timeout_queue; tie != NULL; tie = tie->next) {
-		struct pendq *const pq = CONTAINER_OF(tie, struct pendq, tie);
-		if (CANIOT_DID_EQ(pq->did, did)) {
-			retpq = pq;
-			break;
-		}
-	}
+	frame->id.cls = CANIOT_DID_CLS(did);
+	frame->id.sid = CANIOT_DID_SID(did);
+}
 
-	__DBG("pendq_get_by_did(did: %u) -> pq: %p\n", did, (void *)retpq);
+#if CONFIG_CANIOT_CTRL_TIMING_WHEEL
 
-	return retpq;
+#define WHEEL_SLOTS   CONFIG_CANIOT_CTRL_TIMING_WHEEL_SLOTS
+#define WHEEL_TICK_MS CONFIG_CANIOT_CTRL_TIMING_WHEEL_TICK_MS
+#define WHEEL_MASK    (WHEEL_SLOTS - 1u)
+
+#if (WHEEL_SLOTS == 0u) || ((WHEEL_SLOTS & WHEEL_MASK) != 0u)
+#error "CONFIG_CANIOT_CTRL_TIMING_WHEEL_SLOTS must be a power of 2"
+#endif
+
+/* Wrap-around safe comparison of ticks */
+static inline bool tick_reached(uint32_t expiry, uint32_t tick)
+{
+	return (int32_t)(expiry - tick) <= 0;
 }
 
-static struct pendq *pendq_get_by_handle(struct caniot_controller *ctrl, uint8_t handle)
+/* Insert item before the item pointed by *pos */
+static void wheel_link(struct pqt **pos, struct pqt *item)
 {
-	ASSERT(ctrl);
+	ASSERT(pos != NULL);
+	ASSERT(item != NULL);
 
-	struct pendq *pq = NULL;
+	item->next  = *pos;
+	item->pprev = pos;
+	if (*pos != NULL) {
+		(*pos)->pprev = &item->next;
+	}
+	*pos = item;
+}
 
-	if ((handle != INVALID_HANDLE) && (handle <= CONFIG_CANIOT_MAX_PENDING_QUERIES)) {
-		struct pendq *const tmp = &ctrl->pendingq.pool[handle - 1U];
+static void wheel_unlink(struct pqt *item)
+{
+	ASSERT(item != NULL);
+	ASSERT(item->pprev != NULL);
 
-		/* if handle is not exactly the same as the index,
-		 * the pq is not allocated */
-		if (tmp->handle == handle) {
-			pq = tmp;
-		}
+	*item->pprev = item->next;
+	if (item->next != NULL) {
+		item->next->pprev = item->pprev;
 	}
+	item->next  = NULL;
+	item->pprev = NULL;
+}
 
-	__DBG("pendq_get_by_handle(handle: %u) -> pq: %p\n", handle, (void *)pq);
+/* Unlink an item, from its slot or from the expired list */
+static void wheel_remove(struct caniot_controller *ctrl, struct pqt *item)
+{
+	ASSERT(ctrl != NULL);
+	ASSERT(item != NULL);
 
-	return pq;
+	if (ctrl->pendingq.wheel.expired_tail == &item->next) {
+		ctrl->pendingq.wheel.expired_tail = item->pprev;
+	}
+
+	wheel_unlink(item);
 }
 
-static bool pendq_is_broadcast(struct pendq *pq)
+static void wheel_expire(struct caniot_controller *ctrl, struct pqt *item)
 {
-	ASSERT(pq != NULL);
+	ASSERT(ctrl != NULL);
+	ASSERT(item != NULL);
 
-	return caniot_is_broadcast(pq->did);
+	/* Expired queries are appended to the expired list in order to keep
+	 * the order in which they expire */
+	wheel_link(ctrl->pendingq.wheel.expired_tail, item);
+	ctrl->pendingq.wheel.expired_tail = &item->next;
 }
 
-int caniot_controller_query_user_data_set(struct caniot_controller *ctrl,
-					  uint8_t handle,
-					  void *user_data)
+/* Whether the item expires at or before the current time */
+static bool wheel_item_expired(const struct caniot_controller *ctrl, const struct pqt *item)
 {
-#if CONFIG_CANIOT_CHECKS
-	if (!ctrl) return -CANIOT_EINVAL;
-#endif
+	const uint32_t tick = ctrl->pendingq.wheel.tick;
 
-	int ret		 = -CANIOT_EINVAL;
-	struct pendq *pq = pendq_get_by_handle(ctrl, handle);
+	return (item->expiry != tick) ? tick_reached(item->expiry, tick)
+				      : (item->expiry_ms <= ctrl->pendingq.wheel.tick_elapsed);
+}
 
-	if (pq != NULL) {
-		pq->user_data = user_data;
-		ret	      = 0;
-	}
+static void pendq_tqueue_init(struct caniot_controller *ctrl)
+{
+	ASSERT(ctrl != NULL);
 
-	return ret;
+	memset(&ctrl->pendingq.wheel, 0x00, sizeof(ctrl->pendingq.wheel));
+	ctrl->pendingq.wheel.expired_tail = &ctrl->pendingq.wheel.expired;
 }
 
-void *caniot_controller_query_user_data_get(struct caniot_controller *ctrl,
-					    uint8_t handle)
+static void
+pendq_queue(struct caniot_controller *ctrl, struct pendq *pq, uint32_t timeout)
 {
-#if CONFIG_CANIOT_CHECKS
-	if (!ctrl) return NULL;
-#endif
+	ASSERT(ctrl != NULL);
+	ASSERT(pq != NULL);
+	ASSERT(timeout != CANIOT_TIMEOUT_FOREVER);
 
-	void *user_data	 = NULL;
+	if (pq == NULL) return;
+
+	/* The query is hashed by the tick it expires in, the remainder allows
+	 * it to expire at the exact ms within the tick */
+	const uint64_t total = (uint64_t)ctrl->pendingq.wheel.tick_elapsed + timeout;
+
+	pq->tie.timeout	  = timeout;
+	pq->tie.expiry	  = ctrl->pendingq.wheel.tick + (uint32_t)(total / WHEEL_TICK_MS);
+	pq->tie.expiry_ms = (uint16_t)(total % WHEEL_TICK_MS);
+
+	if (timeout == 0u) {
+		wheel_expire(ctrl, &pq->tie);
+	} else {
+		wheel_link(&ctrl->pendingq.wheel.slots[pq->tie.expiry & WHEEL_MASK],
+			   &pq->tie);
+	}
+
+	__DBG("pendq_queue(ps: %p, timeout: %u) -> expiry: %u + %u ms\n",
+	      (void *)pq,
+	      timeout,
+	      pq->tie.expiry,
+	      pq->tie.expiry_ms);
+}
+
+static void pendq_shift(struct caniot_controller *ctrl, uint32_t time_passed_ms)
+{
+	ASSERT(ctrl != NULL);
+
+	__DBG("pendq_shift(time_passed_ms: %u)\n", time_passed_ms);
+
+	if (time_passed_ms == 0u) return;
+
+	const uint64_t elapsed = (uint64_t)ctrl->pendingq.wheel.tick_elapsed + time_passed_ms;
+	const uint32_t ticks   = elapsed / WHEEL_TICK_MS;
+	const uint32_t from    = ctrl->pendingq.wheel.tick;
+
+	ctrl->pendingq.wheel.tick_elapsed = elapsed % WHEEL_TICK_MS;
+	ctrl->pendingq.wheel.tick	  = from + ticks;
+
+	/* Every slot needs to be visited at most once, starting with the slot of
+	 * the tick in progress at the previous shift. Items hashed in a visited slot
+	 * which belong to a later round or to the remainder of the current tick are
+	 * left in place */
+	for (uint32_t i = 0u; i <= MIN(ticks, WHEEL_SLOTS - 1u); i++) {
+		struct pqt *item = ctrl->pendingq.wheel.slots[(from + i) & WHEEL_MASK];
+
+		while (item != NULL) {
+			struct pqt *const next = item->next;
+
+			if (wheel_item_expired(ctrl, item)) {
+				wheel_unlink(item);
+				wheel_expire(ctrl, item);
+			}
+
+			item = next;
+		}
+	}
+}
+
+static struct pendq *pendq_pop_expired(struct caniot_controller *ctrl)
+{
+	ASSERT(ctrl != NULL);
+
+	struct pendq *pq = NULL;
+	struct pqt *item = ctrl->pendingq.wheel.expired;
+
+	if (item != NULL) {
+		wheel_remove(ctrl, item);
+		pq = CONTAINER_OF(item, struct pendq, tie);
+	}
+
+	__DBG("pendq_pop_expired() -> %p\n", (void *)pq);
+
+	return pq;
+}
+
+static struct pendq *pendq_pop(struct caniot_controller *ctrl)
+{
+	ASSERT(ctrl != NULL);
+
+	struct pendq *pq = pendq_pop_expired(ctrl);
+
+	for (uint32_t i = 0u; (pq == NULL) && (i < WHEEL_SLOTS); i++) {
+		struct pqt *item = ctrl->pendingq.wheel.slots[i];
+		if (item != NULL) {
+			wheel_unlink(item);
+			pq = CONTAINER_OF(item, struct pendq, tie);
+		}
+	}
+
+	__DBG("pendq_pop() -> %p\n", (void *)pq);
+
+	return pq;
+}
+
+static void pendq_tqueue_remove(struct caniot_controller *ctrl, struct pendq *pq)
+{
+	ASSERT(ctrl != NULL);
+	ASSERT(pq != NULL);
+
+	if (pq->tie.pprev != NULL) {
+		__DBG("pendq_tqueue_remove(pq: %p) -> removed\n", (void *)pq);
+
+		wheel_remove(ctrl, &pq->tie);
+	} else {
+		__DBG("pendq_tqueue_remove(pq: %p) -> not found\n", (void *)pq);
+	}
+}
+
+/* Time from the current time to the expiry of the item (in ms) */
+static uint32_t wheel_item_remaining(const struct caniot_controller *ctrl,
+				     const struct pqt *item)
+{
+	return (item->expiry - ctrl->pendingq.wheel.tick) * WHEEL_TICK_MS +
+	       item->expiry_ms - ctrl->pendingq.wheel.tick_elapsed;
+}
+
+static uint32_t pendq_next_timeout(const struct caniot_controller *ctrl)
+{
+	ASSERT(ctrl != NULL);
+
+	uint32_t next = (uint32_t)-1;
+
+	if (ctrl->pendingq.wheel.expired != NULL) {
+		return 0u;
+	}
+
+	/* Slots are visited in expiry order, the first slot holding queries of the
+	 * current round holds the next to expire */
+	for (uint32_t i = 0u; (next == (uint32_t)-1) && (i < WHEEL_SLOTS); i++) {
+		const uint32_t tick = ctrl->pendingq.wheel.tick + i;
+		struct pqt *item    = ctrl->pendingq.wheel.slots[tick & WHEEL_MASK];
+
+		for (; item != NULL; item = item->next) {
+			if (item->expiry == tick) {
+				next = MIN(next, wheel_item_remaining(ctrl, item));
+			}
+		}
+	}
+
+	/* Otherwise all queries belong to later rounds */
+	for (uint32_t i = 0u; (next == (uint32_t)-1) && (i < WHEEL_SLOTS); i++) {
+		struct pqt *item = ctrl->pendingq.wheel.slots[i];
+
+		for (; item != NULL; item = item->next) {
+			next = MIN(next, wheel_item_remaining(ctrl, item));
+		}
+	}
+
+	return next;
+}
+
+#else
+
+static void _pendq_queue(struct pqt **root, struct pqt *item)
+{
+	ASSERT(root != NULL);
+	ASSERT(item != NULL);
+
+	struct pqt **prev_next_p = root;
+	while (*prev_next_p != NULL) {
+		struct pqt *p_current = *prev_next_p;
+
+		if (p_current->delay <= item->delay) {
+			item->delay -= p_current->delay;
+			prev_next_p = &(p_current->next);
+		} else {
+			item->next = p_current;
+			p_current->delay -= item->delay;
+			break;
+		}
+	}
+	*prev_next_p = item;
+}
+
+static void
+pendq_queue(struct caniot_controller *ctrl, struct pendq *pq, uint32_t timeout)
+{
+	ASSERT(ctrl != NULL);
+	ASSERT(pq != NULL);
+	ASSERT(timeout != CANIOT_TIMEOUT_FOREVER);
+
+	if (pq == NULL) return;
+
+	/* last item doesn't have a "next" item */
+	pq->tie.next	= NULL;
+	pq->tie.timeout = timeout;
+
+	_pendq_queue(&ctrl->pendingq.timeout_queue, &pq->tie);
+
+	__DBG("pendq_queue(ps: %p, timeout: %u)\n", (void *)pq, timeout);
+}
+
+static void pendq_shift(struct caniot_controller *ctrl, uint32_t time_passed_ms)
+{
+	ASSERT(ctrl != NULL);
+
+	__DBG("pendq_shift(time_passed_ms: %u)\n", time_passed_ms);
+
+	if (time_passed_ms == 0u) return;
+
+	struct pqt **prev_next_p = &ctrl->pendingq.timeout_queue;
+	while (*prev_next_p != NULL) {
+		struct pqt *p_current = *prev_next_p;
+
+		if (p_current->delay <= time_passed_ms) {
+			if (p_current->delay != 0) {
+				time_passed_ms -= p_current->delay;
+				p_current->delay = 0;
+			}
+			prev_next_p = &(p_current->next);
+		} else {
+			p_current->delay -= time_passed_ms;
+			break;
+		}
+	}
+}
+
+static struct pendq *pendq_pop_expired(struct caniot_controller *ctrl)
+{
+	ASSERT(ctrl != NULL);
+
+	struct pqt **const root = &ctrl->pendingq.timeout_queue;
+	struct pendq *pq	= NULL;
+
+	if ((*root != NULL) && ((*root)->delay == 0)) {
+		struct pqt *item = *root;
+		*root		 = (*root)->next;
+
+		pq = CONTAINER_OF(item, struct pendq, tie);
+	}
+
+	__DBG("pendq_pop_expired() -> %p\n", (void *)pq);
+
+	return pq;
+}
+
+static struct pendq *pendq_pop(struct caniot_controller *ctrl)
+{
+	ASSERT(ctrl != NULL);
+
+	struct pqt **const root = &ctrl->pendingq.timeout_queue;
+	struct pendq *pq	= NULL;
+
+	if (*root != NULL) {
+		struct pqt *item = *root;
+		*root		 = (*root)->next;
+
+		pq = CONTAINER_OF(item, struct pendq, tie);
+	}
+
+	__DBG("pendq_pop() -> %p\n", (void *)pq);
+
+	return pq;
+}
+
+static void pendq_tqueue_remove(struct caniot_controller *ctrl, struct pendq *pq)
+{
+	ASSERT(ctrl != NULL);
+	ASSERT(pq != NULL);
+
+	struct pqt **prev_next_p = &ctrl->pendingq.timeout_queue;
+	while (*prev_next_p != NULL) {
+		struct pqt *p_current = *prev_next_p;
+		if (p_current == &pq->tie) {
+			__DBG("pendq_tqueue_remove(pq: %p) -> removed\n", (void *)pq);
+
+			*prev_next_p = p_current->next;
+			if (p_current->next != NULL) {
+				p_current->next->delay += pq->tie.delay;
+			}
+			pq->tie.next = NULL;
+			return;
+		}
+		prev_next_p = &(p_current->next);
+	}
+
+	__DBG("pendq_tqueue_remove(pq: %p) -> not found\n", (void *)pq);
+}
+
+static void pendq_tqueue_init(struct caniot_controller *ctrl)
+{
+	ASSERT(ctrl != NULL);
+
+	ctrl->pendingq.timeout_queue = NULL;
+}
+
+static uint32_t pendq_next_timeout(const struct caniot_controller *ctrl)
+{
+	ASSERT(ctrl != NULL);
+
+	uint32_t next_timeout = (uint32_t)-1;
+
+	struct pqt *next = ctrl->pendingq.timeout_queue;
+
+	if (next != NULL) {
+		next_timeout = next->timeout;
+	}
+
+	return next_timeout;
+}
+#endif /* CONFIG_CANIOT_CTRL_TIMING_WHEEL */
+
+static struct pendq *pendq_alloc(struct caniot_controller *ctrl)
+{
+	ASSERT(ctrl != NULL);
+
+	struct pendq *p = ctrl->pendingq.free_list;
+	if (p != NULL) {
+		__DBG("pendq_alloc() -> pq: %p\n", (void *)p);
+
+		ctrl->pendingq.free_list = p->next;
+	} else {
+		__DBG("pendq_alloc() -> NULL\n");
+	}
+	return p;
+}
+
+/* Tells whether the pq context is provided by the caller (see
+ * caniot_controller_query_ex()) rather than allocated from the pool */
+static bool pendq_is_external(struct caniot_controller *ctrl, struct pendq *pq)
+{
+	ASSERT(ctrl != NULL);
+	ASSERT(pq != NULL);
+
+	return (pq < ctrl->pendingq.pool) ||
+	       (pq >= ctrl->pendingq.pool + CONFIG_CANIOT_MAX_PENDING_QUERIES);
+}
+
+static void pendq_free(struct caniot_controller *ctrl, struct pendq *pq)
+{
+	ASSERT(ctrl != NULL);
+
+#if CONFIG_CANIOT_CTRL_TX_SHAPER
+	/* the frame of the query is not sent yet */
+	if ((pq != NULL) && (pq->tx != NULL)) {
+		txq_drop(ctrl, pq);
+	}
+#endif
+
+#if CONFIG_CANIOT_CTRL_DEVICE_PACING
+	if ((pq != NULL) && (pq->in_flight != 0u)) {
+		ctrl->pacing.dev[pq->did].in_flight--;
+		pq->in_flight = 0u;
+	}
+#endif
+
+	if ((pq != NULL) && pendq_is_external(ctrl, pq)) {
+		__DBG("pendq_free(pq: %p) -> external\n", (void *)pq);
+
+		/* the caller owns the context, only mark it as released */
+		pq->handle = INVALID_HANDLE;
+	} else if (pq != NULL) {
+		__DBG("pendq_free(pq: %p)\n", (void *)pq);
+
+		pq->next		 = ctrl->pendingq.free_list;
+		pq->handle		 = INVALID_HANDLE;
+		ctrl->pendingq.free_list = pq;
+	} else {
+		__DBG("pendq_free(NULL)\n");
+	}
+}
+
+static void pendq_init_queue(struct caniot_controller *ctrl)
+{
+	ASSERT(ctrl != NULL);
+
+	/* init free list */
+	ctrl->pendingq.free_list = NULL;
+	struct pendq *cur	 = ctrl->pendingq.pool;
+	while (cur < ctrl->pendingq.pool + CONFIG_CANIOT_MAX_PENDING_QUERIES) {
+		pendq_free(ctrl, cur++);
+	}
+
+	pendq_tqueue_init(ctrl);
+}
+
+static struct pendq *pendq_get_by_did(struct caniot_controller *ctrl, caniot_did_t did)
+{
+	ASSERT(ctrl != NULL);
+
+	/* Oldest query pending for the device */
+	struct pendq *const retpq = ctrl->pendingq.by_did[CANIOT_DID_FROM_RAW(did)];
+
+	__DBG("pendq_get_by_did(did: %u) -> pq: %p\n", did, (void *)retpq);
+
+	return retpq;
+}
+
+static struct pendq *pendq_get_by_handle(struct caniot_controller *ctrl, uint8_t handle)
+{
+	ASSERT(ctrl);
+
+	struct pendq *pq = NULL;
+
+	if ((handle != INVALID_HANDLE) && (handle <= CONFIG_CANIOT_MAX_PENDING_QUERIES)) {
+		struct pendq *const tmp = &ctrl->pendingq.pool[handle - 1U];
+
+		/* if handle is not exactly the same as the index,
+		 * the pq is not allocated */
+		if (tmp->handle == handle) {
+			pq = tmp;
+		}
+	}
+
+	__DBG("pendq_get_by_handle(handle: %u) -> pq: %p\n", handle, (void *)pq);
+
+	return pq;
+}
+
+static bool pendq_is_broadcast(struct pendq *pq)
+{
+	ASSERT(pq != NULL);
+
+	return caniot_is_broadcast(pq->did);
+}
+
+int caniot_controller_query_user_data_set(struct caniot_controller *ctrl,
+					  uint8_t handle,
+					  void *user_data)
+{
+#if CONFIG_CANIOT_CHECKS
+	if (!ctrl) return -CANIOT_EINVAL;
+#endif
+
+	int ret		 = -CANIOT_EINVAL;
 	struct pendq *pq = pendq_get_by_handle(ctrl, handle);
 
-	if (pq != NULL) {
-		user_data = pq->user_data;
+	if (pq != NULL) {
+		pq->user_data = user_data;
+		ret	      = 0;
+	}
+
+	return ret;
+}
+
+void *caniot_controller_query_user_data_get(struct caniot_controller *ctrl,
+					    uint8_t handle)
+{
+#if CONFIG_CANIOT_CHECKS
+	if (!ctrl) return NULL;
+#endif
+
+	void *user_data	 = NULL;
+	struct pendq *pq = pendq_get_by_handle(ctrl, handle);
+
+	if (pq != NULL) {
+		user_data = pq->user_data;
+	}
+
+	return user_data;
+}
+
+static struct pendq *peek_pending_query(struct caniot_controller *ctrl, caniot_did_t did)
+{
+	ASSERT(ctrl != NULL);
+
+	struct pendq *pq = NULL;
+
+	if (is_query_pending_for(ctrl, did)) pq = pendq_get_by_did(ctrl, did);
+
+	__DBG("peek_pending_query(did: %u) -> pq: %p\n", did, (void *)pq);
+
+	return pq;
+}
+
+/**
+ * @brief Remove a pending query from the list of tracked queries.
+ *
+ * @param ctrl Controller instance
+ * @param pq Pending query to remove
+ */
+static void pendq_remove(struct caniot_controller *ctrl, struct pendq *pq)
+{
+	ASSERT(ctrl != NULL);
+	ASSERT(pq != NULL);
+
+	pendq_untrack(ctrl, pq);
+	pendq_tqueue_remove(ctrl, pq);
+	pendq_free(ctrl, pq);
+}
+
+#if CONFIG_CANIOT_CTRL_CACHE_SIZE > 0
+
+/* Tells whether the frame is a (response or query) frame the cache applies to,
+ * and in this case whether it relates to an attribute */
+static bool cache_applies_to(const struct caniot_frame *frame, bool *is_attr)
+{
+	switch (frame->id.type) {
+	case CANIOT_FRAME_TYPE_TELEMETRY:
+		*is_attr = false;
+		return true;
+	case CANIOT_FRAME_TYPE_READ_ATTRIBUTE:
+		*is_attr = true;
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool cache_entry_match(const struct caniot_ctrl_cache_entry *entry,
+			      caniot_did_t did,
+			      bool is_attr,
+			      const struct caniot_frame *frame)
+{
+	const struct caniot_frame *const cached = &entry->frame;
+
+	if (!entry->valid || (CANIOT_DID(cached->id.cls, cached->id.sid) != did)) {
+		return false;
+	} else if (is_attr) {
+		return (cached->id.type == CANIOT_FRAME_TYPE_READ_ATTRIBUTE) &&
+		       (cached->attr.key == frame->attr.key);
+	} else {
+		return (cached->id.type == CANIOT_FRAME_TYPE_TELEMETRY) &&
+		       (cached->id.endpoint == frame->id.endpoint);
+	}
+}
+
+static struct caniot_ctrl_cache_entry *
+cache_lookup(struct caniot_controller *ctrl, caniot_did_t did, const struct caniot_frame *frame)
+{
+	ASSERT(ctrl != NULL);
+	ASSERT(frame != NULL);
+
+	bool is_attr;
+	struct caniot_ctrl_cache_entry *entry;
+
+	if (!cache_applies_to(frame, &is_attr)) return NULL;
+
+	for (entry = ctrl->cache.entries;
+	     entry < ctrl->cache.entries + CONFIG_CANIOT_CTRL_CACHE_SIZE;
+	     entry++) {
+		if (cache_entry_match(entry, did, is_attr, frame)) {
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+static bool cache_entry_fresh(struct caniot_controller *ctrl,
+			      const struct caniot_ctrl_cache_entry *entry)
+{
+	return (int32_t)(entry->expiry - ctrl->clock_ms) > 0;
+}
+
+/* Store a received telemetry or attribute response */
+static void cache_update(struct caniot_controller *ctrl, const struct caniot_frame *frame)
+{
+	ASSERT(ctrl != NULL);
+	ASSERT(frame != NULL);
+
+	const caniot_did_t did = CANIOT_DID(frame->id.cls, frame->id.sid);
+	struct caniot_ctrl_cache_entry *entry, *victim;
+
+	if ((frame->id.query != CANIOT_RESPONSE) || caniot_is_error_frame(frame->id) ||
+	    (ctrl->cache.ttl_ms == 0u)) {
+		return;
+	}
+
+	victim = cache_lookup(ctrl, did, frame);
+	if (victim == NULL) {
+		bool is_attr;
+		if (!cache_applies_to(frame, &is_attr)) return;
+
+		/* Take a free entry, or evict the least recently updated one */
+		victim = ctrl->cache.entries;
+		for (entry = ctrl->cache.entries;
+		     entry < ctrl->cache.entries + CONFIG_CANIOT_CTRL_CACHE_SIZE;
+		     entry++) {
+			if (!entry->valid) {
+				victim = entry;
+				break;
+			} else if ((int32_t)(entry->updated - victim->updated) < 0) {
+				victim = entry;
+			}
+		}
+	}
+
+	victim->frame	= *frame;
+	victim->updated = ctrl->clock_ms;
+	victim->expiry	= ctrl->clock_ms + ctrl->cache.ttl_ms;
+	victim->valid	= 1u;
+
+	__DBG("cache_update(did: %u, type: %u) -> entry: %p\n",
+	      did,
+	      frame->id.type,
+	      (void *)victim);
+}
+
+/* Drop the cached value of the attribute a write query is sent for */
+static void cache_invalidate_attr(struct caniot_controller *ctrl,
+				  caniot_did_t did,
+				  uint16_t key)
+{
+	ASSERT(ctrl != NULL);
+
+	struct caniot_ctrl_cache_entry *entry;
+
+	for (entry = ctrl->cache.entries;
+	     entry < ctrl->cache.entries + CONFIG_CANIOT_CTRL_CACHE_SIZE;
+	     entry++) {
+		const caniot_did_t edid = CANIOT_DID(entry->frame.id.cls, entry->frame.id.sid);
+
+		if (entry->valid && caniot_deviceid_match(edid, did) &&
+		    (entry->frame.id.type == CANIOT_FRAME_TYPE_READ_ATTRIBUTE) &&
+		    (entry->frame.attr.key == key)) {
+			entry->valid = 0u;
+		}
+	}
+}
+
+void caniot_controller_cache_ttl_set(struct caniot_controller *ctrl, uint32_t ttl_ms)
+{
+#if CONFIG_CANIOT_CHECKS
+	if (!ctrl) return;
+#endif
+
+	ctrl->cache.ttl_ms = ttl_ms;
+}
+
+const struct caniot_frame *caniot_controller_cache_get(struct caniot_controller *ctrl,
+						       caniot_did_t did,
+						       const struct caniot_frame *query)
+{
+#if CONFIG_CANIOT_CHECKS
+	if (!ctrl || !query) return NULL;
+#endif
+
+#if CONFIG_CANIOT_CTRL_DRIVERS_API
+	/* time may have passed since the controller was last processed */
+	if (ctrl->driv != NULL) {
+		clock_refresh(ctrl);
+	}
+#endif
+
+	const struct caniot_ctrl_cache_entry *const entry = cache_lookup(ctrl, did, query);
+	const struct caniot_frame *frame		  = NULL;
+
+	if ((entry != NULL) && cache_entry_fresh(ctrl, entry)) {
+		frame = &entry->frame;
+	}
+
+	__DBG("caniot_controller_cache_get(did: %u, query: %p) -> frame: %p\n",
+	      did,
+	      (void *)query,
+	      (void *)frame);
+
+	return frame;
+}
+
+void caniot_controller_cache_invalidate(struct caniot_controller *ctrl, caniot_did_t did)
+{
+#if CONFIG_CANIOT_CHECKS
+	if (!ctrl) return;
+#endif
+
+	struct caniot_ctrl_cache_entry *entry;
+
+	for (entry = ctrl->cache.entries;
+	     entry < ctrl->cache.entries + CONFIG_CANIOT_CTRL_CACHE_SIZE;
+	     entry++) {
+		const caniot_did_t edid = CANIOT_DID(entry->frame.id.cls, entry->frame.id.sid);
+
+		if (caniot_deviceid_match(edid, did)) {
+			entry->valid = 0u;
+		}
+	}
+}
+
+#endif /* CONFIG_CANIOT_CTRL_CACHE_SIZE > 0 */
+
+// Initialize ctrl structure
+int caniot_controller_init(struct caniot_controller *ctrl,
+			   caniot_controller_event_cb_t cb,
+			   void *user_data)
+{
+	int ret = 0;
+
+	if (ctrl == NULL) {
+		ret = -CANIOT_ENULLCTRL;
+		goto exit;
+	}
+
+#if CONFIG_CANIOT_CTRL_EVENT_RING_SIZE == 0
+	if (cb == NULL) {
+		ret = -CANIOT_ENULLCTRLCB;
+		goto exit;
+	}
+#endif
+
+	memset(ctrl, 0, sizeof(struct caniot_controller));
+
+	ctrl->event_cb	= cb;
+	ctrl->user_data = user_data;
+
+	pendq_init_queue(ctrl);
+
+#if CONFIG_CANIOT_CTRL_CACHE_SIZE > 0
+	ctrl->cache.ttl_ms = CONFIG_CANIOT_CTRL_CACHE_TTL_MS;
+#endif
+
+#if CONFIG_CANIOT_CTRL_RETRY
+	ctrl->retry.seed = RETRY_JITTER_SEED;
+#endif
+
+#if CONFIG_CANIOT_CTRL_TX_SHAPER
+	txq_init(ctrl);
+#endif
+
+exit:
+	return ret;
+}
+
+#if CONFIG_CANIOT_CTRL_DRIVERS_API
+int caniot_controller_driv_init(struct caniot_controller *ctrl,
+				const struct caniot_drivers_api *driv,
+				caniot_controller_event_cb_t cb,
+				void *user_data)
+{
+	int ret = caniot_controller_init(ctrl, cb, user_data);
+	if (ret < 0) {
+		goto exit;
+	}
+
+	if (driv == NULL) {
+		ret = -CANIOT_EDRIVER;
+		goto exit;
+	}
+	ctrl->driv = driv;
+
+	/* the controller clock follows the driver time from now on */
+	driv->get_time(&ctrl->last_process.sec, &ctrl->last_process.ms);
+	ctrl->clock_ms = ctrl->last_process.sec * 1000u + ctrl->last_process.ms;
+
+exit:
+	return ret;
+}
+#else
+int caniot_controller_driv_init(struct caniot_controller *ctrl,
+				const struct caniot_drivers_api *driv,
+				caniot_controller_event_cb_t cb,
+				void *user_data)
+{
+	(void)ctrl;
+	(void)driv;
+	(void)cb;
+	(void)user_data;
+
+	return -CANIOT_ENOTSUP;
+}
+#endif
+
+uint32_t caniot_controller_next_timeout(const struct caniot_controller *ctrl)
+{
+#if CONFIG_CANIOT_CHECKS
+	if (!ctrl) return 0xFFFFFFFFu;
+#endif
+
+	return pendq_next_timeout(ctrl);
+}
+
+#if CONFIG_CANIOT_CTRL_TX_SHAPER
+static uint32_t txq_next_delay(const struct caniot_controller *ctrl);
+#endif
+
+bool caniot_controller_next_deadline(const struct caniot_controller *ctrl,
+				     uint32_t *deadline_ms)
+{
+#if CONFIG_CANIOT_CHECKS
+	if (!ctrl || !deadline_ms) return false;
+#endif
+
+	/* query timeouts and retransmissions, relative to the last update of
+	 * the timeouts which happened at the current controller clock */
+	uint32_t delay = pendq_next_timeout(ctrl);
+
+#if CONFIG_CANIOT_CTRL_TX_SHAPER
+	/* deferred frames */
+	delay = MIN(delay, txq_next_delay(ctrl));
+#endif
+
+#if CONFIG_CANIOT_CTRL_SUBMIT_QUEUE
+	/* submissions to execute */
+	if (__atomic_load_n(&ctrl->submitq, __ATOMIC_RELAXED) != NULL) {
+		delay = 0u;
+	}
+#endif
+
+	if (delay == (uint32_t)-1) {
+		__DBG("caniot_controller_next_deadline() -> none\n");
+		return false;
+	}
+
+	*deadline_ms = ctrl->clock_ms + delay;
+
+	__DBG("caniot_controller_next_deadline() -> %u\n", *deadline_ms);
+
+	return true;
+}
+
+#if CONFIG_CANIOT_CTRL_EVENT_RING_SIZE > 0
+static void event_ring_push(struct caniot_controller *ctrl,
+			    const caniot_controller_event_t *ev)
+{
+	ASSERT(ctrl != NULL);
+	ASSERT(ev != NULL);
+
+	if (ctrl->events.count >= CONFIG_CANIOT_CTRL_EVENT_RING_SIZE) {
+		ctrl->events.dropped++;
+		__DBG("event_ring_push(ev: %p) -> dropped\n", (void *)ev);
+		return;
+	}
+
+	struct caniot_controller_event_record *const rec =
+		&ctrl->events.records[(ctrl->events.head + ctrl->events.count) %
+				      CONFIG_CANIOT_CTRL_EVENT_RING_SIZE];
+
+	rec->ev = *ev;
+	if (ev->response != NULL) {
+		rec->response	 = *ev->response;
+		rec->ev.response = &rec->response;
+	}
+
+	ctrl->events.count++;
+}
+
+int caniot_controller_poll_events(struct caniot_controller *ctrl,
+				  struct caniot_controller_event_record *out,
+				  size_t n)
+{
+#if CONFIG_CANIOT_CHECKS
+	if (!ctrl || (!out && n)) return -CANIOT_EINVAL;
+#endif
+
+	size_t i;
+
+	for (i = 0u; (i < n) && (ctrl->events.count > 0u); i++) {
+		out[i] = ctrl->events.records[ctrl->events.head];
+		if (out[i].ev.response != NULL) {
+			out[i].ev.response = &out[i].response;
+		}
+
+		ctrl->events.head = (ctrl->events.head + 1u) % CONFIG_CANIOT_CTRL_EVENT_RING_SIZE;
+		ctrl->events.count--;
+	}
+
+	return (int)i;
+}
+#endif
+
+static bool call_user_callback(struct caniot_controller *ctrl,
+			       const caniot_controller_event_t *ev)
+{
+	ASSERT(ctrl != NULL);
+	ASSERT(ev != NULL);
+
+	__DBG("call_user_callback(ev: %p) -> did: %u handle: %u ctx: %u status: %u term: "
+	      "%u "
+	      "resp: %p\n",
+	      (void *)ev,
+	      ev->did,
+	      ev->handle,
+	      ev->context,
+	      ev->status,
+	      ev->terminated,
+	      (void *)ev->response);
+
+#if CONFIG_CANIOT_CTRL_EVENT_RING_SIZE > 0
+	if (ctrl->event_cb == NULL) {
+		event_ring_push(ctrl, ev);
+
+		/* keep broadcast queries pending until they time out */
+		return true;
+	}
+#endif
+
+	ASSERT(ctrl->event_cb != NULL);
+
+	return ctrl->event_cb(ev, ctrl->user_data);
+}
+
+static void orphan_resp_event(struct caniot_controller *ctrl,
+			      const struct caniot_frame *response)
+{
+	ASSERT(ctrl != NULL);
+	ASSERT(response != NULL);
+
+	const caniot_did_t did = CANIOT_DID(response->id.cls, response->id.sid);
+	const bool is_error    = caniot_is_error_frame(response->id);
+
+	const caniot_controller_event_t ev = {
+		.controller = ctrl,
+		.context    = CANIOT_CONTROLLER_EVENT_CONTEXT_ORPHAN,
+		.status	    = is_error ? CANIOT_CONTROLLER_EVENT_STATUS_ERROR
+				       : CANIOT_CONTROLLER_EVENT_STATUS_OK,
+
+		.did = did,
+
+		.terminated = 1U, /* meaningless in this context */
+		.handle	    = 0U, /* meaningless in this context */
+
+		.response = response,
+
+		.user_data = NULL,
+	};
+
+	call_user_callback(ctrl, &ev);
+}
+
+static bool pendq_is_discovery(struct caniot_controller *ctrl, struct pendq *pq)
+{
+	ASSERT(ctrl != NULL);
+	ASSERT(pq != NULL);
+
+#if CONFIG_CANIOT_CONTROLLER_DISCOVERY
+	return pendq_is_broadcast(pq) && ctrl->discovery.pending;
+#else
+	return false;
+#endif
+}
+
+static void
+cancelled_query_event(struct caniot_controller *ctrl, struct pendq *pq, bool suppress)
+{
+	ASSERT(pq != NULL);
+
+	const caniot_controller_event_t ev = {
+		.controller = ctrl,
+		.context    = CANIOT_CONTROLLER_EVENT_CONTEXT_QUERY,
+		.status	    = CANIOT_CONTROLLER_EVENT_STATUS_CANCELLED,
+
+		.did = pq->did,
+
+		.terminated = 1U,
+		.handle	    = pq->handle,
+
+		.response  = NULL,
+		.user_data = pq->user_data,
+	};
+
+	pendq_remove(ctrl, pq);
+
+#if CONFIG_CANIOT_CONTROLLER_DISCOVERY
+	if (pendq_is_discovery(ctrl, pq)) stop_discovery(ctrl);
+#endif
+
+	if (!suppress) call_user_callback(ctrl, &ev);
+}
+
+/* The frame of the query is sent, start waiting for the response */
+static void pendq_sent(struct caniot_controller *ctrl, struct pendq *pq, uint32_t timeout)
+{
+	ASSERT(ctrl != NULL);
+	ASSERT(pq != NULL);
+
+#if CONFIG_CANIOT_CTRL_RTT_STATS || CONFIG_CANIOT_CTRL_ADAPTIVE_TIMEOUT
+	pq->sent_ms = ctrl->clock_ms;
+#endif
+
+#if CONFIG_CANIOT_CTRL_BCAST_AGGREGATE
+	/* latencies don't include the time the frame waited in the tx queue */
+	if (pq->bcast != NULL) pq->bcast->sent_ms = ctrl->clock_ms;
+#endif
+
+#if CONFIG_CANIOT_CTRL_DEVICE_PACING
+	/* retransmissions are not counted twice */
+	if ((pq->in_flight == 0u) && !pendq_is_broadcast(pq)) {
+		ctrl->pacing.dev[pq->did].in_flight++;
+		pq->in_flight = 1u;
+	}
+#endif
+
+	if (timeout != CANIOT_TIMEOUT_FOREVER) {
+		pendq_queue(ctrl, pq, timeout);
+	}
+}
+
+#if CONFIG_CANIOT_CTRL_TX_SHAPER
+
+/* Tokens are counted in thousandths of frame/bit, so that the buckets are
+ * refilled by rate * elapsed ms */
+#define TX_TOKEN_SCALE 1000u
+
+/* Worst-case length of a frame on the wire (extended ID, 8 data bytes) */
+#define TX_FRAME_MAX_BITS 160u
+
+/* Worst-case number of bits of a frame on the wire, stuff bits included */
+static uint32_t tx_frame_bits(const struct caniot_frame *frame)
+{
+	const uint32_t data = 8u * MIN(frame->len, 8u);
+
+#if CONFIG_CANIOT_QUERY_ID
+	if (caniot_id_is_extended(frame->id)) {
+		return 67u + data + (54u + data - 1u) / 4u;
+	}
+#endif
+
+	return 47u + data + (34u + data - 1u) / 4u;
+}
+
+static uint32_t tx_bucket_refill(uint32_t tokens,
+				 uint32_t rate,
+				 uint32_t elapsed_ms,
+				 uint32_t depth)
+{
+	const uint64_t filled = (uint64_t)tokens + (uint64_t)rate * elapsed_ms;
+
+	return (uint32_t)MIN(filled, (uint64_t)depth * TX_TOKEN_SCALE);
+}
+
+static void tx_refill(struct caniot_controller *ctrl)
+{
+	ASSERT(ctrl != NULL);
+
+	const struct caniot_ctrl_tx_rate *const rate = &ctrl->tx.rate;
+	const uint32_t elapsed_ms		     = ctrl->clock_ms - ctrl->tx.refill_ms;
+
+	ctrl->tx.refill_ms = ctrl->clock_ms;
+
+	ctrl->tx.frame_tokens = tx_bucket_refill(
+		ctrl->tx.frame_tokens, rate->frames_per_s, elapsed_ms, rate->burst);
+	ctrl->tx.bit_tokens = tx_bucket_refill(ctrl->tx.bit_tokens,
+					       rate->bits_per_s,
+					       elapsed_ms,
+					       (uint32_t)rate->burst * TX_FRAME_MAX_BITS);
+}
+
+/* Take the tokens needed to send the frame, if available */
+static bool tx_consume(struct caniot_controller *ctrl, const struct caniot_frame *frame)
+{
+	ASSERT(ctrl != NULL);
+	ASSERT(frame != NULL);
+
+	const struct caniot_ctrl_tx_rate *const rate = &ctrl->tx.rate;
+	const uint32_t frame_cost		     = TX_TOKEN_SCALE;
+	const uint32_t bit_cost			     = tx_frame_bits(frame) * TX_TOKEN_SCALE;
+
+	if ((rate->frames_per_s != 0u) && (ctrl->tx.frame_tokens < frame_cost)) {
+		return false;
+	}
+
+	if ((rate->bits_per_s != 0u) && (ctrl->tx.bit_tokens < bit_cost)) {
+		return false;
+	}
+
+	if (rate->frames_per_s != 0u) ctrl->tx.frame_tokens -= frame_cost;
+	if (rate->bits_per_s != 0u) ctrl->tx.bit_tokens -= bit_cost;
+
+	return true;
+}
+
+#if CONFIG_CANIOT_CTRL_TX_BACKPRESSURE
+/* Give back the tokens of a frame the driver did not take */
+static void tx_refund(struct caniot_controller *ctrl, const struct caniot_frame *frame)
+{
+	ASSERT(ctrl != NULL);
+	ASSERT(frame != NULL);
+
+	const struct caniot_ctrl_tx_rate *const rate = &ctrl->tx.rate;
+
+	if (rate->frames_per_s != 0u) ctrl->tx.frame_tokens += TX_TOKEN_SCALE;
+	if (rate->bits_per_s != 0u) {
+		ctrl->tx.bit_tokens += tx_frame_bits(frame) * TX_TOKEN_SCALE;
+	}
+}
+#endif
+
+/* Tell whether a frame the driver refused is kept in the tx queue */
+static bool tx_busy(struct caniot_controller *ctrl, const struct caniot_frame *frame, int ret)
+{
+	ASSERT(ctrl != NULL);
+	ASSERT(frame != NULL);
+
+#if CONFIG_CANIOT_CTRL_TX_BACKPRESSURE
+	if (ret == -CANIOT_EAGAIN) {
+		/* mailbox full, the frame is sent again later */
+		tx_refund(ctrl, frame);
+		ctrl->tx.stats.busy++;
+		ctrl->tx.busy = 1u;
+		return true;
+	}
+#else
+	(void)ctrl;
+	(void)frame;
+	(void)ret;
+#endif
+
+	return false;
+}
+
+#if CONFIG_CANIOT_CTRL_DEVICE_PACING
+
+static const struct caniot_ctrl_pacing *pacing_of(const struct caniot_controller *ctrl,
+						  caniot_did_t did)
+{
+	ASSERT(ctrl != NULL);
+	ASSERT(did < CANIOT_DID_MAX_COUNT);
+
+	if (ctrl->pacing.dev[did].custom) {
+		return &ctrl->pacing.dev[did].params;
+	} else {
+		return &ctrl->pacing.by_cls[CANIOT_DID_CLS(did)];
+	}
+}
+
+/* Tell whether a frame can be sent to the device now */
+static bool pacing_allows(const struct caniot_controller *ctrl, caniot_did_t did)
+{
+	ASSERT(ctrl != NULL);
+
+	/* broadcast frames are not paced */
+	if (did >= CANIOT_DID_MAX_COUNT) return true;
+
+	const struct caniot_ctrl_pacing *const pacing = pacing_of(ctrl, did);
+	const struct caniot_ctrl_pacing_state *const dev = &ctrl->pacing.dev[did];
+
+	if ((pacing->max_in_flight != 0u) && (dev->in_flight >= pacing->max_in_flight)) {
+		return false;
+	}
+
+	if ((pacing->min_gap_ms != 0u) && dev->sent &&
+	    ((ctrl->clock_ms - dev->last_tx_ms) < pacing->min_gap_ms)) {
+		return false;
+	}
+
+	return true;
+}
+
+static bool txq_holds_did(const struct caniot_controller *ctrl, caniot_did_t did)
+{
+	ASSERT(ctrl != NULL);
+
+	for (const struct caniot_ctrl_txq_entry *entry = ctrl->tx.head; entry != NULL;
+	     entry = entry->next) {
+		if (CANIOT_DID(entry->frame.id.cls, entry->frame.id.sid) == did) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+int caniot_controller_pacing_set_class(struct caniot_controller *ctrl,
+				       caniot_device_class_t cls,
+				       const struct caniot_ctrl_pacing *pacing)
+{
+#if CONFIG_CANIOT_CHECKS
+	if (!ctrl || !pacing) return -CANIOT_EINVAL;
+#endif
+
+	if (cls >= ARRAY_SIZE(ctrl->pacing.by_cls)) return -CANIOT_EINVAL;
+
+	ctrl->pacing.by_cls[cls] = *pacing;
+
+	return 0;
+}
+
+int caniot_controller_pacing_set_did(struct caniot_controller *ctrl,
+				     caniot_did_t did,
+				     const struct caniot_ctrl_pacing *pacing)
+{
+#if CONFIG_CANIOT_CHECKS
+	if (!ctrl) return -CANIOT_EINVAL;
+#endif
+
+	if (did >= CANIOT_DID_MAX_COUNT) return -CANIOT_EDEVICE;
+
+	if (pacing != NULL) {
+		ctrl->pacing.dev[did].params = *pacing;
+		ctrl->pacing.dev[did].custom = 1u;
+	} else {
+		ctrl->pacing.dev[did].custom = 0u;
+	}
+
+	return 0;
+}
+
+#endif /* CONFIG_CANIOT_CTRL_DEVICE_PACING */
+
+/* Tell whether the frame has to wait in the tx queue */
+static bool txq_must_defer(struct caniot_controller *ctrl,
+			   const struct caniot_frame *frame)
+{
+	ASSERT(ctrl != NULL);
+	ASSERT(frame != NULL);
+
+#if CONFIG_CANIOT_CTRL_DEVICE_PACING
+	const caniot_did_t did = CANIOT_DID(frame->id.cls, frame->id.sid);
+
+	/* frames already deferred for the device are sent first, frames for
+	 * other devices are not held back by a paced device */
+	if (txq_holds_did(ctrl, did) || !pacing_allows(ctrl, did)) {
+		return true;
+	}
+#else
+	/* frames already deferred are sent first */
+	if (ctrl->tx.head != NULL) {
+		return true;
+	}
+#endif
+
+	return !tx_consume(ctrl, frame);
+}
+
+#if CONFIG_CANIOT_CTRL_TX_PRIORITY
+
+static caniot_ctrl_tx_prio_t tx_prio_of(const struct caniot_frame *frame)
+{
+	ASSERT(frame != NULL);
+
+	if (CANIOT_DID(frame->id.cls, frame->id.sid) == CANIOT_DID_BROADCAST) {
+		return CANIOT_CTRL_TX_PRIO_DISCOVERY;
+	}
+
+	switch (frame->id.type) {
+	case CANIOT_FRAME_TYPE_COMMAND:
+		return CANIOT_CTRL_TX_PRIO_COMMAND;
+	case CANIOT_FRAME_TYPE_TELEMETRY:
+		return CANIOT_CTRL_TX_PRIO_TELEMETRY;
+	default:
+		return CANIOT_CTRL_TX_PRIO_ATTRIBUTE;
+	}
+}
+
+/* Lower is more urgent, a frame gains one priority class every
+ * CONFIG_CANIOT_CTRL_TX_AGING_MS spent in the queue */
+static int32_t txq_entry_rank(const struct caniot_controller *ctrl,
+			      const struct caniot_ctrl_txq_entry *entry)
+{
+	const uint32_t waited_ms = ctrl->clock_ms - entry->enqueued_ms;
+
+	return (int32_t)(entry->prio * CONFIG_CANIOT_CTRL_TX_AGING_MS) -
+	       (int32_t)MIN(waited_ms, (uint32_t)INT32_MAX / 2u);
+}
+
+static void tx_wait_record(struct caniot_controller *ctrl,
+			   caniot_ctrl_tx_prio_t prio,
+			   uint32_t wait_ms)
+{
+	struct caniot_ctrl_tx_wait *const wait = &ctrl->tx.wait[prio];
+
+	wait->count++;
+	wait->total_ms += wait_ms;
+	wait->max_ms = MAX(wait->max_ms, wait_ms);
+}
+
+int caniot_controller_tx_wait_get(const struct caniot_controller *ctrl,
+				  caniot_ctrl_tx_prio_t prio,
+				  struct caniot_ctrl_tx_wait *wait)
+{
+#if CONFIG_CANIOT_CHECKS
+	if (!ctrl || !wait) return -CANIOT_EINVAL;
+#endif
+
+	if (prio >= CANIOT_CTRL_TX_PRIO_COUNT) return -CANIOT_EINVAL;
+
+	*wait = ctrl->tx.wait[prio];
+
+	return 0;
+}
+
+#endif /* CONFIG_CANIOT_CTRL_TX_PRIORITY */
+
+/* Hand the frame to the driver, after it waited in the tx queue for wait_ms */
+static int tx_transmit(struct caniot_controller *ctrl,
+		       const struct caniot_frame *frame,
+		       uint32_t wait_ms)
+{
+	ASSERT(ctrl != NULL);
+	ASSERT(frame != NULL);
+
+	const int ret = MIN(ctrl->driv->send(frame, 0u), 0);
+
+#if CONFIG_CANIOT_CTRL_TX_BACKPRESSURE
+	if (ret == 0) {
+		ctrl->tx.busy = 0u;
+	}
+#endif
+
+#if CONFIG_CANIOT_CTRL_TX_PRIORITY
+	if (ret == 0) {
+		tx_wait_record(ctrl, tx_prio_of(frame), wait_ms);
+	}
+#else
+	(void)wait_ms;
+#endif
+
+#if CONFIG_CANIOT_CTRL_DEVICE_PACING
+	const caniot_did_t did = CANIOT_DID(frame->id.cls, frame->id.sid);
+
+	if ((ret == 0) && (did < CANIOT_DID_MAX_COUNT)) {
+		ctrl->pacing.dev[did].last_tx_ms = ctrl->clock_ms;
+		ctrl->pacing.dev[did].sent	 = 1u;
+	}
+#endif
+
+	return ret;
+}
+
+static void txq_init(struct caniot_controller *ctrl)
+{
+	ASSERT(ctrl != NULL);
+
+	const struct caniot_ctrl_tx_rate rate = {
+		.frames_per_s = CONFIG_CANIOT_CTRL_TX_RATE_FPS,
+		.bits_per_s   = CONFIG_CANIOT_CTRL_TX_RATE_BPS,
+		.burst	      = CONFIG_CANIOT_CTRL_TX_BURST,
+	};
+
+	ctrl->tx.rate	  = rate;
+	ctrl->tx.head	  = NULL;
+	ctrl->tx.tail	  = NULL;
+	ctrl->tx.count	  = 0u;
+	ctrl->tx.refill_ms = ctrl->clock_ms;
+
+	/* buckets are full */
+	ctrl->tx.frame_tokens = (uint32_t)rate.burst * TX_TOKEN_SCALE;
+	ctrl->tx.bit_tokens   = (uint32_t)rate.burst * TX_FRAME_MAX_BITS * TX_TOKEN_SCALE;
+
+	ctrl->tx.free_list = NULL;
+	for (uint32_t i = 0u; i < CONFIG_CANIOT_CTRL_TXQ_SIZE; i++) {
+		ctrl->tx.entries[i].next = ctrl->tx.free_list;
+		ctrl->tx.free_list	 = &ctrl->tx.entries[i];
+	}
+
+#if CONFIG_CANIOT_CTRL_DEVICE_PACING
+	const struct caniot_ctrl_pacing pacing = {
+		.min_gap_ms    = CONFIG_CANIOT_CTRL_PACING_GAP_MS,
+		.max_in_flight = CONFIG_CANIOT_CTRL_PACING_IN_FLIGHT,
+	};
+
+	for (uint32_t i = 0u; i < ARRAY_SIZE(ctrl->pacing.by_cls); i++) {
+		ctrl->pacing.by_cls[i] = pacing;
+	}
+#endif
+}
+
+/* Send the frame if the rate allows it, otherwise defer it to the tx queue.
+ *
+ * Returns 0 if the frame was sent, 1 if it was deferred (the timeout of the
+ * query is then armed when the frame is actually sent), negative value on
+ * error. */
+static int txq_send(struct caniot_controller *ctrl,
+		    const struct caniot_frame *frame,
+		    struct pendq *pq,
+		    uint32_t timeout)
+{
+	ASSERT(ctrl != NULL);
+	ASSERT(frame != NULL);
+
+	int ret;
+	struct caniot_ctrl_txq_entry *entry;
+
+	tx_refill(ctrl);
+
+	if (txq_must_defer(ctrl, frame) == false) {
+		ret = tx_transmit(ctrl, frame, 0u);
+		if (tx_busy(ctrl, frame, ret) == false) {
+			goto exit;
+		}
+	}
+
+	entry = ctrl->tx.free_list;
+	if (entry == NULL) {
+		ctrl->tx.stats.dropped++;
+		ret = -CANIOT_EAGAIN;
+		goto exit;
+	}
+	ctrl->tx.free_list = entry->next;
+
+	entry->next	   = NULL;
+	entry->frame	   = *frame;
+	entry->pq	   = pq;
+	entry->timeout	   = timeout;
+	entry->enqueued_ms = ctrl->clock_ms;
+
+#if CONFIG_CANIOT_CTRL_TX_PRIORITY
+	entry->prio = tx_prio_of(frame);
+#endif
+
+	if (ctrl->tx.tail != NULL) {
+		ctrl->tx.tail->next = entry;
+	} else {
+		ctrl->tx.head = entry;
+	}
+	ctrl->tx.tail = entry;
+	ctrl->tx.count++;
+
+	ctrl->tx.stats.deferred++;
+	ctrl->tx.stats.max_pending = MAX(ctrl->tx.stats.max_pending, ctrl->tx.count);
+
+	if (pq != NULL) pq->tx = entry;
+
+	ret = 1;
+
+exit:
+	__DBG("txq_send(frame: %p, pq: %p, timeout: %u) -> ret: %d\n",
+	      (void *)frame,
+	      (void *)pq,
+	      timeout,
+	      ret);
+
+	return ret;
+}
+
+static void txq_unlink(struct caniot_controller *ctrl,
+		       struct caniot_ctrl_txq_entry *prev,
+		       struct caniot_ctrl_txq_entry *entry)
+{
+	ASSERT(ctrl != NULL);
+	ASSERT(entry != NULL);
+
+	if (prev != NULL) {
+		prev->next = entry->next;
+	} else {
+		ctrl->tx.head = entry->next;
+	}
+
+	if (ctrl->tx.tail == entry) {
+		ctrl->tx.tail = prev;
+	}
+
+	if (entry->pq != NULL) entry->pq->tx = NULL;
+
+	entry->next	   = ctrl->tx.free_list;
+	ctrl->tx.free_list = entry;
+	ctrl->tx.count--;
+}
+
+/* Forget the frame of a query released before it was sent */
+static void txq_drop(struct caniot_controller *ctrl, struct pendq *pq)
+{
+	ASSERT(ctrl != NULL);
+	ASSERT(pq != NULL);
+
+	struct caniot_ctrl_txq_entry *prev = NULL;
+	struct caniot_ctrl_txq_entry *entry;
+
+	for (entry = ctrl->tx.head; entry != NULL; prev = entry, entry = entry->next) {
+		if (entry == pq->tx) {
+			txq_unlink(ctrl, prev, entry);
+			break;
+		}
+	}
+
+	__DBG("txq_drop(pq: %p) -> entry: %p\n", (void *)pq, (void *)entry);
+}
+
+/* Next deferred frame to send (and the entry before it in the queue) */
+static struct caniot_ctrl_txq_entry *txq_pick(struct caniot_controller *ctrl,
+					      struct caniot_ctrl_txq_entry **prev_out)
+{
+	ASSERT(ctrl != NULL);
+	ASSERT(prev_out != NULL);
+
+	struct caniot_ctrl_txq_entry *prev = NULL;
+	struct caniot_ctrl_txq_entry *best = NULL;
+
+	*prev_out = NULL;
+
+	for (struct caniot_ctrl_txq_entry *entry = ctrl->tx.head; entry != NULL;
+	     prev = entry, entry = entry->next) {
+#if CONFIG_CANIOT_CTRL_DEVICE_PACING
+		/* skip the frames of the devices which are not ready */
+		if (!pacing_allows(ctrl,
+				   CANIOT_DID(entry->frame.id.cls, entry->frame.id.sid))) {
+			continue;
+		}
+#endif
+
+#if CONFIG_CANIOT_CTRL_TX_PRIORITY
+		/* the oldest frame is taken among the ones of equal rank */
+		if ((best == NULL) ||
+		    (txq_entry_rank(ctrl, entry) < txq_entry_rank(ctrl, best))) {
+			best	  = entry;
+			*prev_out = prev;
+		}
+#else
+		best	  = entry;
+		*prev_out = prev;
+		break;
+#endif
 	}
 
-	return user_data;
+	return best;
 }
 
-static struct pendq *peek_pending_query(struct caniot_controller *ctrl, caniot_did_t did)
+/* Send the deferred frames the rate allows */
+static void txq_release(struct caniot_controller *ctrl)
 {
 	ASSERT(ctrl != NULL);
 
-	struct pendq *pq = NULL;
+	struct caniot_ctrl_txq_entry *prev;
+	struct caniot_ctrl_txq_entry *entry;
+	struct pendq *pq;
+	uint32_t timeout;
+	int ret;
 
-	if (is_query_pending_for(ctrl, did)) pq = pendq_get_by_did(ctrl, did);
+	tx_refill(ctrl);
 
-	__DBG("peek_pending_query(did: %u) -> pq: %p\n", did, (void *)pq);
+	while ((entry = txq_pick(ctrl, &prev)) != NULL) {
+		if (tx_consume(ctrl, &entry->frame) == false) break;
 
-	return pq;
+		ret = tx_transmit(ctrl, &entry->frame, ctrl->clock_ms - entry->enqueued_ms);
+		if (tx_busy(ctrl, &entry->frame, ret) == true) break;
+
+		pq	= entry->pq;
+		timeout = entry->timeout;
+
+		txq_unlink(ctrl, prev, entry);
+
+		/* if the frame could not be sent, the query times out */
+		if (ret < 0) {
+			ctrl->tx.stats.dropped++;
+		}
+
+		if (pq != NULL) {
+			pendq_sent(ctrl, pq, timeout);
+		}
+
+		__DBG("txq_release(pq: %p) -> ret: %d\n", (void *)pq, ret);
+	}
 }
 
-/**
- * @brief Remove a pending query from the list of tracked queries.
- *
- * @param ctrl Controller instance
- * @param pq Pending query to remove
- */
-static void pendq_remove(struct caniot_controller *ctrl, struct pendq *pq)
+/* Time until the bucket holds the given number of tokens */
+static uint32_t tx_bucket_delay(uint32_t tokens, uint32_t rate, uint32_t cost, uint32_t depth)
 {
-	ASSERT(ctrl != NULL);
-	ASSERT(pq != NULL);
+	if ((rate == 0u) || (tokens >= cost)) return 0u;
 
-	mark_query_pending_for(ctrl, pq->did, false);
-	pendq_tqueue_remove(ctrl, pq);
-	pendq_free(ctrl, pq);
+	/* never enough tokens */
+	if (cost > depth * TX_TOKEN_SCALE) return (uint32_t)-1;
+
+	return (cost - tokens + rate - 1u) / rate;
 }
 
-// Initialize ctrl structure
-int caniot_controller_init(struct caniot_controller *ctrl,
-			   caniot_controller_event_cb_t cb,
-			   void *user_data)
+/* Time until the next deferred frame can be sent, (uint32_t)-1 if none */
+static uint32_t txq_next_delay(const struct caniot_controller *ctrl)
 {
-	int ret = 0;
+	ASSERT(ctrl != NULL);
 
-	if (ctrl == NULL) {
-		ret = -CANIOT_ENULLCTRL;
-		goto exit;
-	}
+	const struct caniot_ctrl_tx_rate *const rate = &ctrl->tx.rate;
+	const uint32_t elapsed_ms		     = ctrl->clock_ms - ctrl->tx.refill_ms;
+	const uint32_t frame_depth		     = rate->burst;
+	const uint32_t bit_depth		     = (uint32_t)rate->burst * TX_FRAME_MAX_BITS;
+	const uint32_t frame_tokens		     = tx_bucket_refill(
+		ctrl->tx.frame_tokens, rate->frames_per_s, elapsed_ms, frame_depth);
+	const uint32_t bit_tokens = tx_bucket_refill(
+		ctrl->tx.bit_tokens, rate->bits_per_s, elapsed_ms, bit_depth);
+	uint32_t next = (uint32_t)-1;
+
+#if CONFIG_CANIOT_CTRL_TX_BACKPRESSURE
+	/* the driver is expected to accept frames again shortly */
+	if ((ctrl->tx.head != NULL) && ctrl->tx.busy) return 1u;
+#endif
 
-	if (cb == NULL) {
-		ret = -CANIOT_ENULLCTRLCB;
-		goto exit;
-	}
+	for (const struct caniot_ctrl_txq_entry *entry = ctrl->tx.head; entry != NULL;
+	     entry = entry->next) {
+		uint32_t delay = 0u;
 
-	memset(ctrl, 0, sizeof(struct caniot_controller));
+#if CONFIG_CANIOT_CTRL_DEVICE_PACING
+		const caniot_did_t did = CANIOT_DID(entry->frame.id.cls, entry->frame.id.sid);
 
-	ctrl->event_cb	= cb;
-	ctrl->user_data = user_data;
+		if (did < CANIOT_DID_MAX_COUNT) {
+			const struct caniot_ctrl_pacing *const pacing  = pacing_of(ctrl, did);
+			const struct caniot_ctrl_pacing_state *const dev = &ctrl->pacing.dev[did];
+			const uint32_t since_ms = ctrl->clock_ms - dev->last_tx_ms;
 
-	pendq_init_queue(ctrl);
+			/* waits for a response or a timeout */
+			if ((pacing->max_in_flight != 0u) &&
+			    (dev->in_flight >= pacing->max_in_flight)) {
+				continue;
+			}
 
-exit:
-	return ret;
+			if ((pacing->min_gap_ms != 0u) && dev->sent &&
+			    (since_ms < pacing->min_gap_ms)) {
+				delay = pacing->min_gap_ms - since_ms;
+			}
+		}
+#endif
+
+		delay = MAX(delay,
+			    tx_bucket_delay(frame_tokens,
+					    rate->frames_per_s,
+					    TX_TOKEN_SCALE,
+					    frame_depth));
+		delay = MAX(delay,
+			    tx_bucket_delay(bit_tokens,
+					    rate->bits_per_s,
+					    tx_frame_bits(&entry->frame) * TX_TOKEN_SCALE,
+					    bit_depth));
+
+		next = MIN(next, delay);
+	}
+
+	return next;
 }
 
-#if CONFIG_CANIOT_CTRL_DRIVERS_API
-int caniot_controller_driv_init(struct caniot_controller *ctrl,
-				const struct caniot_drivers_api *driv,
-				caniot_controller_event_cb_t cb,
-				void *user_data)
+void caniot_controller_tx_rate_set(struct caniot_controller *ctrl,
+				   const struct caniot_ctrl_tx_rate *rate)
 {
-	int ret = caniot_controller_init(ctrl, cb, user_data);
-	if (ret < 0) {
-		goto exit;
-	}
+#if CONFIG_CANIOT_CHECKS
+	if (!ctrl || !rate) return;
+#endif
 
-	if (driv == NULL) {
-		ret = -CANIOT_EDRIVER;
-		goto exit;
-	}
-	ctrl->driv = driv;
+	tx_refill(ctrl);
 
-exit:
-	return ret;
+	ctrl->tx.rate = *rate;
+
+	/* tokens exceeding the new depth are lost */
+	ctrl->tx.frame_tokens = tx_bucket_refill(ctrl->tx.frame_tokens, 0u, 0u, rate->burst);
+	ctrl->tx.bit_tokens   = tx_bucket_refill(
+		  ctrl->tx.bit_tokens, 0u, 0u, (uint32_t)rate->burst * TX_FRAME_MAX_BITS);
 }
-#else
-int caniot_controller_driv_init(struct caniot_controller *ctrl,
-				const struct caniot_drivers_api *driv,
-				caniot_controller_event_cb_t cb,
-				void *user_data)
+
+uint32_t caniot_controller_tx_pending(const struct caniot_controller *ctrl)
 {
-	(void)ctrl;
-	(void)driv;
-	(void)cb;
-	(void)user_data;
+#if CONFIG_CANIOT_CHECKS
+	if (!ctrl) return 0u;
+#endif
 
-	return -CANIOT_ENOTSUP;
+	return ctrl->tx.count;
 }
-#endif
 
-uint32_t caniot_controller_next_timeout(const struct caniot_controller *ctrl)
+int caniot_controller_tx_stats_get(const struct caniot_controller *ctrl,
+				   struct caniot_ctrl_tx_stats *stats)
 {
 #if CONFIG_CANIOT_CHECKS
-	if (!ctrl) return 0xFFFFFFFFu;
+	if (!ctrl || !stats) return -CANIOT_EINVAL;
 #endif
 
-	uint32_t next_timeout = (uint32_t)-1;
+	*stats	       = ctrl->tx.stats;
+	stats->pending = ctrl->tx.count;
 
-	struct pqt *next = ctrl->pendingq.timeout_queue;
+	return 0;
+}
 
-	if (next != NULL) {
-		next_timeout = next->timeout;
-	}
+#endif /* CONFIG_CANIOT_CTRL_TX_SHAPER */
 
-	return next_timeout;
-}
+#if CONFIG_CANIOT_CTRL_RETRY
 
-static bool call_user_callback(struct caniot_controller *ctrl,
-			       const caniot_controller_event_t *ev)
+/* xorshift32, only used to spread the retransmissions */
+static uint32_t retry_random(struct caniot_controller *ctrl)
 {
-	ASSERT(ctrl != NULL);
-	ASSERT(ev != NULL);
-	ASSERT(ctrl->event_cb != NULL);
+	uint32_t x = ctrl->retry.seed;
 
-	__DBG("call_user_callback(ev: %p) -> did: %u handle: %u ctx: %u status: %u term: "
-	      "%u "
-	      "resp: %p\n",
-	      (void *)ev,
-	      ev->did,
-	      ev->handle,
-	      ev->context,
-	      ev->status,
-	      ev->terminated,
-	      (void *)ev->response);
+	x ^= x << 13u;
+	x ^= x >> 17u;
+	x ^= x << 5u;
 
-	return ctrl->event_cb(ev, ctrl->user_data);
+	ctrl->retry.seed = x;
+
+	return x;
 }
 
-static void orphan_resp_event(struct caniot_controller *ctrl,
-			      const struct caniot_frame *response)
+static uint32_t retry_backoff_ms(struct caniot_controller *ctrl, struct pendq *pq)
 {
 	ASSERT(ctrl != NULL);
-	ASSERT(response != NULL);
-
-	const caniot_did_t did = CANIOT_DID(response->id.cls, response->id.sid);
-	const bool is_error    = caniot_is_error_frame(response->id);
-
-	const caniot_controller_event_t ev = {
-		.controller = ctrl,
-		.context    = CANIOT_CONTROLLER_EVENT_CONTEXT_ORPHAN,
-		.status	    = is_error ? CANIOT_CONTROLLER_EVENT_STATUS_ERROR
-				       : CANIOT_CONTROLLER_EVENT_STATUS_OK,
-
-		.did = did,
+	ASSERT(pq != NULL);
+	ASSERT(pq->retry.attempt >= 1u);
 
-		.terminated = 1U, /* meaningless in this context */
-		.handle	    = 0U, /* meaningless in this context */
+	const struct caniot_ctrl_retry_policy *const policy = &pq->retry.policy;
 
-		.response = response,
+	/* base * 2^(attempt - 1), bounded */
+	const uint32_t shift = MIN(pq->retry.attempt - 1u, 16u);
+	uint32_t backoff     = MIN((uint32_t)policy->base_backoff_ms << shift,
+				   (uint32_t)policy->max_backoff_ms);
 
-		.user_data = NULL,
-	};
+	/* remove up to jitter_pct percent of the backoff */
+	if (policy->jitter_pct != 0u) {
+		const uint32_t range = (backoff * MIN(policy->jitter_pct, 100u)) / 100u;
+		backoff -= retry_random(ctrl) % (range + 1u);
+	}
 
-	call_user_callback(ctrl, &ev);
+	/* a null timeout would expire in the current processing loop */
+	return MAX(backoff, 1u);
 }
 
-static bool pendq_is_discovery(struct caniot_controller *ctrl, struct pendq *pq)
+/* Handle the expiration of a query with a retry policy, returns true if the
+ * query is still pending (either waiting before a retransmission or for the
+ * response to the retransmission). */
+static bool pendq_retry(struct caniot_controller *ctrl, struct pendq *pq)
 {
 	ASSERT(ctrl != NULL);
 	ASSERT(pq != NULL);
 
-#if CONFIG_CANIOT_CONTROLLER_DISCOVERY
-	return pendq_is_broadcast(pq) && ctrl->discovery.pending;
+	int ret;
+
+	if (pq->retry.attempt == 0u) return false;
+
+	if (pq->retry.backoff) {
+		pq->retry.backoff = 0u;
+		pq->retry.attempt++;
+
+#if CONFIG_CANIOT_CTRL_TX_SHAPER
+		ret = txq_send(ctrl, &pq->retry.frame, pq, pq->retry.timeout);
 #else
-	return false;
+		ret = MIN(ctrl->driv->send(&pq->retry.frame, 0u), 0);
 #endif
+		if (ret == 0) {
+			pendq_sent(ctrl, pq, pq->retry.timeout);
+		}
+
+		if (ret >= 0) goto exit;
+
+		/* the attempt is lost */
+	}
+
+	if (pq->retry.attempt >= pq->retry.policy.max_attempts) {
+		ret = -CANIOT_EAGAIN;
+		goto exit;
+	}
+
+	pq->retry.backoff = 1u;
+	pendq_queue(ctrl, pq, retry_backoff_ms(ctrl, pq));
+	ret = 0;
+
+exit:
+	__DBG("pendq_retry(pq: %p, attempt: %u, backoff: %u) -> ret: %d\n",
+	      (void *)pq,
+	      pq->retry.attempt,
+	      (uint32_t)pq->retry.backoff,
+	      ret);
+
+	return ret >= 0;
 }
 
-static void
-cancelled_query_event(struct caniot_controller *ctrl, struct pendq *pq, bool suppress)
+/* Enable the retry policy for a query which was just sent by the controller */
+static void pendq_retry_arm(struct caniot_controller *ctrl,
+			    struct pendq *pq,
+			    const struct caniot_frame *frame,
+			    const struct caniot_ctrl_retry_policy *policy)
 {
+	ASSERT(ctrl != NULL);
 	ASSERT(pq != NULL);
+	ASSERT(frame != NULL);
 
-	const caniot_controller_event_t ev = {
-		.controller = ctrl,
-		.context    = CANIOT_CONTROLLER_EVENT_CONTEXT_QUERY,
-		.status	    = CANIOT_CONTROLLER_EVENT_STATUS_CANCELLED,
-
-		.did = pq->did,
+	if ((policy == NULL) || (policy->max_attempts <= 1u)) return;
 
-		.terminated = 1U,
-		.handle	    = pq->handle,
+#if CONFIG_CANIOT_CTRL_COALESCE
+	/* the query was not sent, the leader retries on its behalf */
+	if (pq->leader != NULL) return;
+#endif
 
-		.response  = NULL,
-		.user_data = pq->user_data,
-	};
+	/* Queries which never expire cannot be retried, broadcast queries
+	 * are expected to time out */
+	if ((pq->retry.timeout == CANIOT_TIMEOUT_FOREVER) || pendq_is_broadcast(pq)) {
+		return;
+	}
 
-	pendq_remove(ctrl, pq);
+	pq->retry.policy  = *policy;
+	pq->retry.frame	  = *frame;
+	pq->retry.attempt = 1u;
+	pq->retry.backoff = 0u;
+}
 
-#if CONFIG_CANIOT_CONTROLLER_DISCOVERY
-	if (pendq_is_discovery(ctrl, pq)) stop_discovery(ctrl);
+void caniot_controller_retry_policy_set(struct caniot_controller *ctrl,
+					const struct caniot_ctrl_retry_policy *policy)
+{
+#if CONFIG_CANIOT_CHECKS
+	if (!ctrl) return;
 #endif
 
-	if (!suppress) call_user_callback(ctrl, &ev);
+	if (policy != NULL) {
+		ctrl->retry.policy = *policy;
+	} else {
+		memset(&ctrl->retry.policy, 0x00, sizeof(ctrl->retry.policy));
+	}
 }
 
+#endif /* CONFIG_CANIOT_CTRL_RETRY */
+
 static void pendq_call_expired(struct caniot_controller *ctrl)
 {
 	ASSERT(ctrl != NULL);
 
 	struct pendq *pq;
-	struct pqt **const q = &ctrl->pendingq.timeout_queue;
 
-	while ((pq = pendq_pop_expired(q)) != NULL) {
+	while ((pq = pendq_pop_expired(ctrl)) != NULL) {
+#if CONFIG_CANIOT_CTRL_RETRY
+		if (pendq_retry(ctrl, pq) == true) continue;
+#endif
+
 		const caniot_controller_event_t ev = {
 			.controller = ctrl,
 			.context    = CANIOT_CONTROLLER_EVENT_CONTEXT_QUERY,
@@ -525,7 +2227,7 @@ static void pendq_call_expired(struct caniot_controller *ctrl)
 			.user_data = pq->user_data,
 		};
 
-		mark_query_pending_for(ctrl, pq->did, false);
+		pendq_untrack(ctrl, pq);
 		pendq_free(ctrl, pq);
 
 #if CONFIG_CANIOT_CONTROLLER_DISCOVERY
@@ -536,22 +2238,84 @@ static void pendq_call_expired(struct caniot_controller *ctrl)
 	}
 }
 
+/* Tells whether the caller-owned context is tracking a query, the handle alone
+ * is not trusted as the context may never have been used */
+static bool pendq_ext_in_flight(struct caniot_controller *ctrl, const struct pendq *pq)
+{
+	ASSERT(ctrl != NULL);
+	ASSERT(pq != NULL);
+
+	struct pendq *cur;
+
+	if ((pq->handle != CANIOT_HANDLE_EXT) || (pq->did > CANIOT_DID_MAX_COUNT)) {
+		return false;
+	}
+
+	for (cur = ctrl->pendingq.by_did[pq->did]; cur != NULL; cur = pendq_next_of_did(cur)) {
+		if (cur == pq) return true;
+
+#if CONFIG_CANIOT_CTRL_COALESCE
+		for (struct pendq *w = cur->waiters; w != NULL; w = w->waiter_next) {
+			if (w == pq) return true;
+		}
+#endif
+	}
+
+	return false;
+}
+
+/**
+ * @brief Allocate a pq context from the pool, unless provided by the caller
+ * (ext_pq), and prepare it for the query frame.
+ */
 static struct pendq *pendq_alloc_and_prepare(struct caniot_controller *ctrl,
 					     caniot_did_t did,
-					     struct caniot_frame *frame)
+					     struct caniot_frame *frame,
+					     struct pendq *ext_pq)
 {
 	/* allocate */
-	struct pendq *pq = pendq_alloc(ctrl);
+	struct pendq *pq = (ext_pq != NULL) ? ext_pq : pendq_alloc(ctrl);
 
 	if (pq != NULL) {
 		/* prepare data */
 		pq->did	       = did;
-		pq->handle     = 1U + INDEX_OF(pq, ctrl->pendingq.pool, struct pendq);
+		pq->handle     = (ext_pq != NULL)
+					 ? CANIOT_HANDLE_EXT
+					 : 1U + INDEX_OF(pq, ctrl->pendingq.pool, struct pendq);
 		pq->query_type = frame->id.type;
 		pq->notified   = 0llu;
 
+#if CONFIG_CANIOT_CTRL_BCAST_AGGREGATE
+		pq->bcast = NULL;
+#endif
+
+#if CONFIG_CANIOT_CTRL_RTT_STATS || CONFIG_CANIOT_CTRL_ADAPTIVE_TIMEOUT
+		pq->sent_ms = ctrl->clock_ms;
+#endif
+
+#if CONFIG_CANIOT_CTRL_RETRY
+		pq->retry.attempt = 0u;
+		pq->retry.backoff = 0u;
+#endif
+
+#if CONFIG_CANIOT_CTRL_TX_SHAPER
+		pq->tx = NULL;
+#endif
+
+#if CONFIG_CANIOT_CTRL_DEVICE_PACING
+		pq->in_flight = 0u;
+#endif
+
+#if CONFIG_CANIOT_CTRL_COALESCE
+		pq->leader	= NULL;
+		pq->waiters	= NULL;
+		pq->waiter_next = NULL;
+#endif
+
 #if CONFIG_CANIOT_QUERY_ID
-		pq->query_id = 0u;
+		/* The generation makes the id of queries using the same pq
+		 * context successively distinct */
+		pq->query_id = QUERY_ID(ctrl->pendingq.query_gen++, pq->handle);
 #endif
 
 		switch (pq->query_type) {
@@ -575,6 +2339,7 @@ static int query(struct caniot_controller *ctrl,
 		 caniot_did_t did,
 		 struct caniot_frame *frame,
 		 uint32_t timeout,
+		 struct pendq *ext_pq,
 		 bool driv_send)
 {
 	int ret;
@@ -584,8 +2349,16 @@ static int query(struct caniot_controller *ctrl,
 	if (!ctrl || !frame) return -CANIOT_EINVAL;
 #endif
 
+#if CONFIG_CANIOT_CTRL_ADAPTIVE_TIMEOUT
+	if (timeout == CANIOT_TIMEOUT_AUTO) {
+		timeout = caniot_controller_timeout_auto(ctrl, did);
+	}
+#endif
+
 	const bool alloc_context = timeout != 0U;
 	struct pendq *pq	 = NULL;
+	struct pendq *leader	 = NULL;
+	bool deferred		 = false;
 
 	/* if timeout is defined, we need to allocate a context */
 	if (alloc_context == true) {
@@ -594,40 +2367,97 @@ static int query(struct caniot_controller *ctrl,
 			goto exit;
 		}
 
-		/* another query is already pending for the device */
-		if (is_query_pending_for(ctrl, did) == true) {
-			ret = -CANIOT_EBUSY;
-			goto exit;
+#if CONFIG_CANIOT_CTRL_COALESCE
+		/* an identical query is pending, wait for its response instead
+		 * of sending the frame (only if the controller sends it) */
+		if (driv_send == true) {
+			leader = coalesce_find_leader(ctrl, did, frame);
+		}
+#endif
+
+		/* the caller-owned context is tracking another query */
+		if ((ext_pq != NULL) && pendq_ext_in_flight(ctrl, ext_pq)) {
+			ret = -CANIOT_EBUSY;
+			goto exit;
+		}
+
+		/* too many queries are already pending for the device. Caller-owned
+		 * contexts are not exempted: the depth bounds the queries the
+		 * device has to buffer, not the contexts of the controller */
+		if ((leader == NULL) && (is_pipeline_full(ctrl, did) == true)) {
+			ret = -CANIOT_EBUSY;
+			goto exit;
+		}
+
+		pq = pendq_alloc_and_prepare(ctrl, did, frame, ext_pq);
+		if (pq == NULL) {
+			ret = -CANIOT_EPQALLOC;
+			goto exit;
+		}
+	}
+
+	/* finalize and send the query frame */
+	finalize_query_frame(frame, did);
+
+#if CONFIG_CANIOT_CTRL_CACHE_SIZE > 0
+	if (frame->id.type == CANIOT_FRAME_TYPE_WRITE_ATTRIBUTE) {
+		cache_invalidate_attr(ctrl, did, frame->attr.key);
+	}
+#endif
+
+#if CONFIG_CANIOT_QUERY_ID
+	frame->id.query_id = (pq != NULL) ? pq->query_id : 0u;
+#endif
+
+#if CONFIG_CANIOT_CTRL_COALESCE
+	if (leader != NULL) {
+		coalesce_attach(leader, pq);
+#if CONFIG_CANIOT_QUERY_ID
+		frame->id.query_id = pq->query_id;
+#endif
+
+		if (timeout != CANIOT_TIMEOUT_FOREVER) {
+			pendq_queue(ctrl, pq, timeout);
 		}
 
-		pq = pendq_alloc_and_prepare(ctrl, did, frame);
-		if (pq == NULL) {
-			ret = -CANIOT_EPQALLOC;
-			goto exit;
-		}
+		ret = pq->handle;
+		goto exit;
 	}
-
-	/* finalize and send the query frame */
-	finalize_query_frame(frame, did);
+#endif
 
 #if CONFIG_CANIOT_CTRL_DRIVERS_API
 	if (driv_send == true) {
 		/* send frame */
+#if CONFIG_CANIOT_CTRL_TX_SHAPER
+		ret = txq_send(ctrl, frame, pq, timeout);
+#else
 		ret = ctrl->driv->send(frame, 0U);
+#endif
 		if (ret < 0) {
+			/* release the context, the query is not pending */
+			pendq_free(ctrl, pq);
 			goto exit;
 		}
+
+#if CONFIG_CANIOT_CTRL_TX_SHAPER
+		/* the timeout is armed when the frame is actually sent */
+		deferred = (ret > 0);
+#endif
 	}
 #endif
 
 	if (alloc_context == true) {
-		if (timeout != CANIOT_TIMEOUT_FOREVER) {
+#if CONFIG_CANIOT_CTRL_RETRY
+		pq->retry.timeout = timeout;
+#endif
+
+		if (deferred == false) {
 			/* reference query for timeout */
-			pendq_queue(ctrl, pq, timeout);
+			pendq_sent(ctrl, pq, timeout);
 		}
 
 		/* tells that a query is pending for the device */
-		mark_query_pending_for(ctrl, did, true);
+		pendq_track(ctrl, pq);
 
 		ret = pq->handle;
 	} else {
@@ -654,7 +2484,7 @@ int caniot_controller_query_register(struct caniot_controller *ctrl,
 	if (!ctrl || !frame) return -CANIOT_EINVAL;
 #endif
 
-	int ret = query(ctrl, did, frame, timeout, false);
+	int ret = query(ctrl, did, frame, timeout, NULL, false);
 
 	__DBG("caniot_controller_query_register(did: %u, frame: %p, timeout: %u) -> ret: "
 	      "%d\n",
@@ -666,6 +2496,59 @@ int caniot_controller_query_register(struct caniot_controller *ctrl,
 	return ret;
 }
 
+int caniot_controller_query_register_ex(struct caniot_controller *ctrl,
+					struct caniot_pendq *pq,
+					caniot_did_t did,
+					struct caniot_frame *frame,
+					uint32_t timeout)
+{
+#if CONFIG_CANIOT_CHECKS
+	if (!ctrl || !pq || !frame) return -CANIOT_EINVAL;
+#endif
+
+	/* a context is required to track the query */
+	if (timeout == 0u) return -CANIOT_EINVAL;
+
+	int ret = query(ctrl, did, frame, timeout, pq, false);
+
+	__DBG("caniot_controller_query_register_ex(pq: %p, did: %u, frame: %p, timeout: "
+	      "%u) -> ret: %d\n",
+	      (void *)pq,
+	      did,
+	      (void *)frame,
+	      timeout,
+	      ret);
+
+	return MIN(ret, 0);
+}
+
+bool caniot_controller_query_ex_pending(struct caniot_controller *ctrl,
+					const struct caniot_pendq *pq)
+{
+#if CONFIG_CANIOT_CHECKS
+	if (!ctrl || !pq) return false;
+#endif
+
+	return pendq_ext_in_flight(ctrl, pq);
+}
+
+int caniot_controller_query_ex_cancel(struct caniot_controller *ctrl,
+				      struct caniot_pendq *pq,
+				      bool suppress)
+{
+#if CONFIG_CANIOT_CHECKS
+	if (!ctrl || !pq) return -CANIOT_EINVAL;
+#endif
+
+	if (pendq_ext_in_flight(ctrl, pq) == false) {
+		return -CANIOT_ENOHANDLE;
+	}
+
+	cancelled_query_event(ctrl, pq, suppress);
+
+	return 0;
+}
+
 bool caniot_controller_query_pending(struct caniot_controller *ctrl, uint8_t handle)
 {
 #if CONFIG_CANIOT_CHECKS
@@ -762,6 +2645,225 @@ is_response_to(const struct caniot_frame *frame, struct pendq *pq, bool *p_is_er
 	return match;
 }
 
+#if CONFIG_CANIOT_CTRL_RTT_STATS
+
+#define RTT_SUB_BITS 2u
+#define RTT_SUB_COUNT (1u << RTT_SUB_BITS)
+#define RTT_MAX_MS 0xFFFFu
+
+static uint32_t rtt_bucket_index(uint32_t rtt_ms)
+{
+	if (rtt_ms < RTT_SUB_COUNT) return rtt_ms;
+
+	rtt_ms = MIN(rtt_ms, RTT_MAX_MS);
+
+	/* position of the most significant bit */
+	const uint32_t msb = 31u - (uint32_t)__builtin_clz(rtt_ms);
+	const uint32_t sub = (rtt_ms >> (msb - RTT_SUB_BITS)) & (RTT_SUB_COUNT - 1u);
+
+	return RTT_SUB_COUNT + (msb - RTT_SUB_BITS) * RTT_SUB_COUNT + sub;
+}
+
+/* Highest round-trip time falling in the bucket */
+static uint32_t rtt_bucket_upper(uint32_t index)
+{
+	if (index < RTT_SUB_COUNT) return index;
+
+	const uint32_t shift = (index - RTT_SUB_COUNT) / RTT_SUB_COUNT;
+	const uint32_t sub   = (index - RTT_SUB_COUNT) % RTT_SUB_COUNT;
+
+	return ((RTT_SUB_COUNT + sub + 1u) << shift) - 1u;
+}
+
+static void rtt_hist_record(struct caniot_ctrl_rtt_hist *hist, uint32_t rtt_ms)
+{
+	hist->buckets[rtt_bucket_index(rtt_ms)]++;
+	hist->count++;
+	hist->max_ms = MAX(hist->max_ms, rtt_ms);
+}
+
+/* Upper bound of the bucket the given percentile falls in */
+static uint32_t rtt_hist_percentile(const struct caniot_ctrl_rtt_hist *hist, uint32_t pct)
+{
+	const uint32_t rank = (uint32_t)(((uint64_t)hist->count * pct + 99u) / 100u);
+	uint32_t cumul	    = 0u;
+
+	for (uint32_t i = 0u; i < CANIOT_CTRL_RTT_BUCKETS; i++) {
+		cumul += hist->buckets[i];
+		if ((cumul >= rank) && (cumul != 0u)) {
+			return MIN(rtt_bucket_upper(i), hist->max_ms);
+		}
+	}
+
+	return hist->max_ms;
+}
+
+static void rtt_hist_snapshot(const struct caniot_ctrl_rtt_hist *hist,
+			      struct caniot_ctrl_rtt_snapshot *snap)
+{
+	snap->count  = hist->count;
+	snap->p50_ms = rtt_hist_percentile(hist, 50u);
+	snap->p90_ms = rtt_hist_percentile(hist, 90u);
+	snap->p99_ms = rtt_hist_percentile(hist, 99u);
+	snap->max_ms = hist->max_ms;
+}
+
+int caniot_controller_rtt_snapshot_did(struct caniot_controller *ctrl,
+				       caniot_did_t did,
+				       struct caniot_ctrl_rtt_snapshot *snap)
+{
+#if CONFIG_CANIOT_CHECKS
+	if (!ctrl || !snap) return -CANIOT_EINVAL;
+#endif
+
+	if (did >= CANIOT_DID_MAX_COUNT) return -CANIOT_EDEVICE;
+
+	rtt_hist_snapshot(&ctrl->rtt.by_did[did], snap);
+
+	return 0;
+}
+
+int caniot_controller_rtt_snapshot_type(struct caniot_controller *ctrl,
+					caniot_frame_type_t type,
+					struct caniot_ctrl_rtt_snapshot *snap)
+{
+#if CONFIG_CANIOT_CHECKS
+	if (!ctrl || !snap) return -CANIOT_EINVAL;
+#endif
+
+	if ((uint32_t)type >= ARRAY_SIZE(ctrl->rtt.by_type)) return -CANIOT_EINVAL;
+
+	rtt_hist_snapshot(&ctrl->rtt.by_type[type], snap);
+
+	return 0;
+}
+
+void caniot_controller_rtt_reset(struct caniot_controller *ctrl)
+{
+#if CONFIG_CANIOT_CHECKS
+	if (!ctrl) return;
+#endif
+
+	memset(&ctrl->rtt, 0x00, sizeof(ctrl->rtt));
+}
+
+#endif /* CONFIG_CANIOT_CTRL_RTT_STATS */
+
+#if CONFIG_CANIOT_CTRL_ADAPTIVE_TIMEOUT
+
+/* Fixed-point scaling of the estimator (RFC 6298), srtt is stored x8 and
+ * rttvar x4 */
+#define RTO_SRTT_SHIFT	 3u
+#define RTO_RTTVAR_SHIFT 2u
+
+static void rto_update(struct caniot_controller *ctrl, caniot_did_t did, uint32_t rtt_ms)
+{
+	ASSERT(ctrl != NULL);
+	ASSERT(did < CANIOT_DID_MAX_COUNT);
+
+	struct caniot_ctrl_rto *const rto = &ctrl->rto[did];
+
+	rtt_ms = MIN(rtt_ms, CONFIG_CANIOT_CTRL_TIMEOUT_AUTO_MAX_MS);
+
+	if (rto->srtt_x8 == 0u) {
+		/* first sample: srtt = R, rttvar = R / 2 */
+		rto->srtt_x8   = MAX(rtt_ms, 1u) << RTO_SRTT_SHIFT;
+		rto->rttvar_x4 = (rtt_ms << RTO_RTTVAR_SHIFT) / 2u;
+	} else {
+		int32_t err = (int32_t)rtt_ms - (int32_t)(rto->srtt_x8 >> RTO_SRTT_SHIFT);
+
+		/* srtt += err / 8 */
+		rto->srtt_x8 = (uint32_t)MAX((int32_t)rto->srtt_x8 + err, 1);
+
+		/* rttvar += (|err| - rttvar) / 4 */
+		if (err < 0) err = -err;
+		rto->rttvar_x4 = rto->rttvar_x4 + (uint32_t)err -
+				 (rto->rttvar_x4 >> RTO_RTTVAR_SHIFT);
+	}
+
+	__DBG("rto_update(did: %u, rtt_ms: %u) -> srtt_x8: %u rttvar_x4: %u\n",
+	      did,
+	      rtt_ms,
+	      rto->srtt_x8,
+	      rto->rttvar_x4);
+}
+
+uint32_t caniot_controller_timeout_auto(const struct caniot_controller *ctrl,
+					caniot_did_t did)
+{
+#if CONFIG_CANIOT_CHECKS
+	if (!ctrl) return CONFIG_CANIOT_CTRL_TIMEOUT_AUTO_MAX_MS;
+#endif
+
+	uint32_t timeout;
+
+	if (did >= CANIOT_DID_MAX_COUNT) {
+		/* broadcast, wait for the slowest device */
+		timeout = CONFIG_CANIOT_CTRL_TIMEOUT_AUTO_MAX_MS;
+	} else if (ctrl->rto[did].srtt_x8 == 0u) {
+		/* no sample yet */
+		timeout = CONFIG_CANIOT_CTRL_TIMEOUT_AUTO_INIT_MS;
+	} else {
+		/* RTO = srtt + 4 * rttvar */
+		timeout = (ctrl->rto[did].srtt_x8 >> RTO_SRTT_SHIFT) + ctrl->rto[did].rttvar_x4;
+	}
+
+	timeout = MAX(timeout, CONFIG_CANIOT_CTRL_TIMEOUT_AUTO_MIN_MS);
+	return MIN(timeout, CONFIG_CANIOT_CTRL_TIMEOUT_AUTO_MAX_MS);
+}
+
+int caniot_controller_rto_get(const struct caniot_controller *ctrl,
+			      caniot_did_t did,
+			      struct caniot_ctrl_rto *rto)
+{
+#if CONFIG_CANIOT_CHECKS
+	if (!ctrl || !rto) return -CANIOT_EINVAL;
+#endif
+
+	if (did >= CANIOT_DID_MAX_COUNT) return -CANIOT_EINVAL;
+
+	*rto = ctrl->rto[did];
+
+	return 0;
+}
+
+#endif /* CONFIG_CANIOT_CTRL_ADAPTIVE_TIMEOUT */
+
+#if CONFIG_CANIOT_CTRL_RTT_STATS || CONFIG_CANIOT_CTRL_ADAPTIVE_TIMEOUT
+/* Feed the round-trip time of the query with the response to the statistics
+ * and the timeout estimator */
+static void pendq_rtt_sample(struct caniot_controller *ctrl,
+			     struct pendq *pq,
+			     const struct caniot_frame *response)
+{
+	ASSERT(ctrl != NULL);
+	ASSERT(pq != NULL);
+	ASSERT(response != NULL);
+
+	const caniot_did_t did = CANIOT_DID(response->id.cls, response->id.sid);
+	const uint32_t rtt_ms  = ctrl->clock_ms - pq->sent_ms;
+
+#if CONFIG_CANIOT_CTRL_RETRY
+	/* Karn's rule: the response to a retransmitted query is ambiguous */
+	if (pq->retry.attempt > 1u) return;
+#endif
+
+	/* devices answering a broadcast query are likely to be delayed by the
+	 * others (bus contention, response spreading), not representative of a
+	 * query to the device */
+	if (pendq_is_broadcast(pq) || (did >= CANIOT_DID_MAX_COUNT)) return;
+
+#if CONFIG_CANIOT_CTRL_RTT_STATS
+	rtt_hist_record(&ctrl->rtt.by_did[did], rtt_ms);
+	rtt_hist_record(&ctrl->rtt.by_type[pq->query_type], rtt_ms);
+#endif
+
+#if CONFIG_CANIOT_CTRL_ADAPTIVE_TIMEOUT
+	rto_update(ctrl, did, rtt_ms);
+#endif
+}
+#endif
+
 static void pendq_handle_device_resp(struct caniot_controller *ctrl,
 				     struct pendq *pq,
 				     const struct caniot_frame *response,
@@ -782,6 +2884,15 @@ static void pendq_handle_device_resp(struct caniot_controller *ctrl,
 		.user_data = pq->user_data,
 	};
 
+#if CONFIG_CANIOT_CTRL_RTT_STATS || CONFIG_CANIOT_CTRL_ADAPTIVE_TIMEOUT
+	pendq_rtt_sample(ctrl, pq, response);
+#endif
+
+#if CONFIG_CANIOT_CTRL_COALESCE
+	/* Queries waiting for this response are completed as well */
+	struct pendq *waiter = coalesce_take_waiters(pq);
+#endif
+
 	/* Release context before callback call in case the use wants to
 	 * perform operations on a pq which will no longer live
 	 */
@@ -791,7 +2902,73 @@ static void pendq_handle_device_resp(struct caniot_controller *ctrl,
 	 * non-broadcast query because the pq context has already been
 	 * released */
 	(void)call_user_callback(ctrl, &ev);
+
+#if CONFIG_CANIOT_CTRL_COALESCE
+	while (waiter != NULL) {
+		struct pendq *const next = waiter->waiter_next;
+		caniot_controller_event_t wev = ev;
+
+		wev.handle    = waiter->handle;
+		wev.user_data = waiter->user_data;
+
+		/* not tracked for the device, only referenced for timeout */
+		pendq_tqueue_remove(ctrl, waiter);
+		pendq_free(ctrl, waiter);
+
+		(void)call_user_callback(ctrl, &wev);
+
+		waiter = next;
+	}
+#endif
+}
+
+#if CONFIG_CANIOT_CTRL_BCAST_AGGREGATE
+static void pendq_handle_bcast_aggregate(struct caniot_controller *ctrl,
+					 struct pendq *pq,
+					 const struct caniot_frame *response)
+{
+	ASSERT(ctrl != NULL);
+	ASSERT(pq != NULL);
+	ASSERT(pq->bcast != NULL);
+
+	struct caniot_ctrl_bcast *const bcast = pq->bcast;
+	const caniot_did_t did = CANIOT_DID(response->id.cls, response->id.sid);
+
+	/* response with the broadcast address, no slot for it */
+	if (did >= CANIOT_DID_MAX_COUNT) {
+		__DBG("broadcast pq, invalid responder did %u\n", did);
+		return;
+	}
+
+	bcast->results[did].latency_ms = ctrl->clock_ms - bcast->sent_ms;
+	bcast->results[did].response   = *response;
+	bcast->answered |= 1llu << did;
+
+	if ((bcast->expected == 0u) ||
+	    ((bcast->answered & bcast->expected) != bcast->expected)) {
+		return;
+	}
+
+	const caniot_controller_event_t ev = {
+		.controller = ctrl,
+		.context    = CANIOT_CONTROLLER_EVENT_CONTEXT_QUERY,
+		.status	    = CANIOT_CONTROLLER_EVENT_STATUS_OK,
+
+		.did = pq->did,
+
+		.terminated = 1U,
+		.handle	    = pq->handle,
+
+		.response  = NULL,
+		.user_data = pq->user_data,
+	};
+
+	/* all expected devices answered, no need to wait for the timeout */
+	pendq_remove(ctrl, pq);
+
+	(void)call_user_callback(ctrl, &ev);
 }
+#endif
 
 static void pendq_handle_broadcast_resp(struct caniot_controller *ctrl,
 					struct pendq *pq,
@@ -815,14 +2992,25 @@ static void pendq_handle_broadcast_resp(struct caniot_controller *ctrl,
 
 	/* Make sure not more than one broadcast response is received
 	 * per device */
-	if (pq->notified & (1U << ev.did)) {
+	if (pq->notified & (1llu << ev.did)) {
 		/* Already notified for this device, ignore ... */
 		__DBG("broacast pq, device %u already notified\n", ev.did);
 		return;
 	} else {
 		__DBG("broacast pq, device %u not notified yet\n", ev.did);
-		pq->notified |= (1U << ev.did);
+		pq->notified |= (1llu << ev.did);
+	}
+
+#if CONFIG_CANIOT_CTRL_RTT_STATS || CONFIG_CANIOT_CTRL_ADAPTIVE_TIMEOUT
+	pendq_rtt_sample(ctrl, pq, response);
+#endif
+
+#if CONFIG_CANIOT_CTRL_BCAST_AGGREGATE
+	if (pq->bcast != NULL) {
+		pendq_handle_bcast_aggregate(ctrl, pq, response);
+		return;
 	}
+#endif
 
 	/* If discovery is enabled, call the discovery callback and
 	 * terminate discovery if the callback returns false
@@ -865,25 +3053,114 @@ static void pendq_handle_broadcast_resp(struct caniot_controller *ctrl,
  * @return true If frame can actually be handled by the pending query
  * @return false Otherwise
  */
-static bool pendq_handle_frame(struct caniot_controller *ctrl,
-			       struct pendq *pq,
-			       const struct caniot_frame *response)
+static bool pendq_handle_frame(struct caniot_controller *ctrl,
+			       struct pendq *pq,
+			       const struct caniot_frame *response)
+{
+	ASSERT(pq != NULL);
+	ASSERT(response != NULL);
+
+	bool is_error;
+
+	if (!is_response_to(response, pq, &is_error)) {
+		return false;
+	} else if (pendq_is_broadcast(pq)) {
+		pendq_handle_broadcast_resp(ctrl, pq, response, is_error);
+	} else {
+		pendq_handle_device_resp(ctrl, pq, response, is_error);
+	}
+
+	return true;
+}
+
+/**
+ * @brief Pass frame to the queries pending for the given device, the first
+ * query (in the order they were sent) the frame is a response to handles it.
+ *
+ * @param ctrl
+ * @param did
+ * @param frame
+ * @return true If frame has been handled by a pending query
+ * @return false Otherwise
+ */
+static bool pendq_dispatch_frame(struct caniot_controller *ctrl,
+				 caniot_did_t did,
+				 const struct caniot_frame *frame)
+{
+	ASSERT(ctrl != NULL);
+	ASSERT(frame != NULL);
+
+	struct pendq *pq;
+
+	for (pq = peek_pending_query(ctrl, did); pq != NULL; pq = pendq_next_of_did(pq)) {
+		if (pendq_handle_frame(ctrl, pq, frame)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+#if CONFIG_CANIOT_QUERY_ID
+static struct pendq *
+pendq_find_query_id(struct caniot_controller *ctrl, caniot_did_t did, uint16_t query_id)
+{
+	struct pendq *pq = peek_pending_query(ctrl, did);
+
+	while ((pq != NULL) && (pq->query_id != query_id)) {
+		pq = pendq_next_of_did(pq);
+	}
+
+	return pq;
+}
+
+/**
+ * @brief Pass frame to the query identified by the query id the frame carries
+ *
+ * @param ctrl
+ * @param did
+ * @param frame
+ * @return true If frame has been handled by the query
+ * @return false Otherwise
+ */
+static bool pendq_dispatch_query_id(struct caniot_controller *ctrl,
+				    caniot_did_t did,
+				    const struct caniot_frame *frame)
 {
-	ASSERT(pq != NULL);
-	ASSERT(response != NULL);
+	ASSERT(ctrl != NULL);
+	ASSERT(frame != NULL);
 
-	bool is_error;
+	const uint8_t handle = QUERY_ID_GET_HANDLE(frame->id.query_id);
+	struct pendq *pq     = NULL;
 
-	if (!is_response_to(response, pq, &is_error)) {
+	if (handle != CANIOT_HANDLE_EXT) {
+		pq = pendq_get_by_handle(ctrl, handle);
+	}
+
+	if ((pq == NULL) || (pq->query_id != frame->id.query_id)) {
+		/* Caller-owned contexts are not indexed by handle, and a query may
+		 * have taken over the id of a released one it was waiting for: look
+		 * for the query among the ones pending for this DID and for
+		 * broadcast */
+		pq = pendq_find_query_id(ctrl, did, frame->id.query_id);
+		if (pq == NULL) {
+			pq = pendq_find_query_id(
+				ctrl, CANIOT_DID_BROADCAST, frame->id.query_id);
+		}
+	}
+
+	/* The query may have been released and its context reused since */
+	if ((pq == NULL) || (pq->query_id != frame->id.query_id)) {
 		return false;
-	} else if (pendq_is_broadcast(pq)) {
-		pendq_handle_broadcast_resp(ctrl, pq, response, is_error);
-	} else {
-		pendq_handle_device_resp(ctrl, pq, response, is_error);
 	}
 
-	return true;
+	if (!caniot_deviceid_match(did, pq->did)) {
+		return false;
+	}
+
+	return pendq_handle_frame(ctrl, pq, frame);
 }
+#endif
 
 static int caniot_controller_handle_rx_frame(struct caniot_controller *ctrl,
 					     const struct caniot_frame *frame)
@@ -893,23 +3170,29 @@ static int caniot_controller_handle_rx_frame(struct caniot_controller *ctrl,
 	if (!caniot_controller_is_target(frame)) return -CANIOT_EUNEXPECTED;
 #endif
 
-	struct pendq *pq;
 	bool orphan	       = true;
 	const caniot_did_t did = CANIOT_DID(frame->id.cls, frame->id.sid);
 
+#if CONFIG_CANIOT_CTRL_CACHE_SIZE > 0
+	/* Cache the response before any callback is called */
+	cache_update(ctrl, frame);
+#endif
+
 	/* If a query is pending and the frame is the response for it
 	 * Call callback and clear pending query */
 
-	/* Try pass frame to query pending for this DID */
-	pq = peek_pending_query(ctrl, did);
-	if (pq != NULL) {
-		orphan &= !pendq_handle_frame(ctrl, pq, frame);
-	}
+#if CONFIG_CANIOT_QUERY_ID
+	/* The frame carries the id of the query it is a response to */
+	if (frame->id.query_id != 0u) {
+		orphan = !pendq_dispatch_query_id(ctrl, did, frame);
+	} else
+#endif
+	{
+		/* Try pass frame to queries pending for this DID */
+		orphan &= !pendq_dispatch_frame(ctrl, did, frame);
 
-	/* Try pass frame to query pending for broadcast */
-	pq = peek_pending_query(ctrl, CANIOT_DID_BROADCAST);
-	if (pq != NULL) {
-		orphan &= !pendq_handle_frame(ctrl, pq, frame);
+		/* Try pass frame to queries pending for broadcast */
+		orphan &= !pendq_dispatch_frame(ctrl, CANIOT_DID_BROADCAST, frame);
 	}
 
 	/* If frame is not a response to any pending query, call orphan callback */
@@ -920,6 +3203,15 @@ static int caniot_controller_handle_rx_frame(struct caniot_controller *ctrl,
 	return 0;
 }
 
+static void process_timeouts(struct caniot_controller *ctrl, uint32_t time_passed_ms)
+{
+	/* update timeouts */
+	pendq_shift(ctrl, time_passed_ms);
+
+	/* call callbacks for expired queries */
+	pendq_call_expired(ctrl);
+}
+
 int caniot_controller_rx_frame(struct caniot_controller *ctrl,
 			       uint32_t time_passed_ms,
 			       const struct caniot_frame *frame)
@@ -928,6 +3220,9 @@ int caniot_controller_rx_frame(struct caniot_controller *ctrl,
 	if (!ctrl) return -CANIOT_EINVAL;
 #endif
 
+	/* time passed before the frame was received */
+	ctrl->clock_ms += time_passed_ms;
+
 	if (frame != NULL) {
 		int ret;
 		if ((ret = caniot_controller_handle_rx_frame(ctrl, frame)) < 0) {
@@ -935,11 +3230,7 @@ int caniot_controller_rx_frame(struct caniot_controller *ctrl,
 		}
 	}
 
-	/* update timeouts */
-	pendq_shift(ctrl, time_passed_ms);
-
-	/* call callbacks for expired queries */
-	pendq_call_expired(ctrl);
+	process_timeouts(ctrl, time_passed_ms);
 
 	__DBG("caniot_controller_rx_frame(time_passed_ms: %u, frame: %p) -> ret: 0\n",
 	      time_passed_ms,
@@ -948,19 +3239,71 @@ int caniot_controller_rx_frame(struct caniot_controller *ctrl,
 	return 0U;
 }
 
+int caniot_controller_rx_frames(struct caniot_controller *ctrl,
+				uint32_t time_passed_ms,
+				const struct caniot_frame *frames,
+				size_t count,
+				int *status)
+{
+#if CONFIG_CANIOT_CHECKS
+	if (!ctrl || (!frames && count)) return -CANIOT_EINVAL;
+#endif
+
+	int ret = 0;
+
+	ctrl->clock_ms += time_passed_ms;
+
+	/* dispatch all frames first */
+	for (size_t i = 0u; i < count; i++) {
+		const int fret = caniot_controller_handle_rx_frame(ctrl, &frames[i]);
+
+		if (status != NULL) status[i] = fret;
+		if ((fret < 0) && (ret == 0)) ret = fret;
+	}
+
+	/* then process timeouts once for the whole batch */
+	process_timeouts(ctrl, time_passed_ms);
+
+	__DBG("caniot_controller_rx_frames(time_passed_ms: %u, frames: %p, count: %zu) -> "
+	      "ret: %d\n",
+	      time_passed_ms,
+	      (void *)frames,
+	      count,
+	      ret);
+
+	return ret;
+}
+
 int caniot_controller_deinit(struct caniot_controller *ctrl)
 {
 #if CONFIG_CANIOT_CHECKS
 	if (!ctrl) return -CANIOT_EINVAL;
 #endif
 
-	/* Iterate over all pending queries and cancel them */
 	struct pendq *pq;
 
-	while ((pq = pendq_pop(&ctrl->pendingq.timeout_queue)) != NULL) {
+	/* Release the queries pending for every device, including the ones waiting
+	 * without timeout (CANIOT_TIMEOUT_FOREVER) or for their frame to be sent.
+	 * Coalesced queries take the place of their leader when it is released.
+	 * The callback is not called on a controller being deinitialized. */
+	for (uint32_t did = 0u; did <= CANIOT_DID_MAX_COUNT; did++) {
+		while ((pq = pendq_get_by_did(ctrl, (caniot_did_t)did)) != NULL) {
+			cancelled_query_event(ctrl, pq, true);
+		}
+	}
+
+	/* Queries not tracked for any device */
+	while ((pq = pendq_pop(ctrl)) != NULL) {
 		cancelled_query_event(ctrl, pq, true);
 	}
 
+#if CONFIG_CANIOT_CTRL_TX_SHAPER
+	/* Drop the frames sent without context (caniot_controller_send()) */
+	while (ctrl->tx.head != NULL) {
+		txq_unlink(ctrl, NULL, ctrl->tx.head);
+	}
+#endif
+
 	return 0;
 }
 
@@ -986,7 +3329,14 @@ int caniot_controller_query(struct caniot_controller *ctrl,
 			    struct caniot_frame *frame,
 			    uint32_t timeout)
 {
-	int ret = query(ctrl, did, frame, timeout, true);
+	int ret = query(ctrl, did, frame, timeout, NULL, true);
+
+#if CONFIG_CANIOT_CTRL_RETRY
+	if (ret > 0) {
+		pendq_retry_arm(
+			ctrl, pendq_get_by_handle(ctrl, (uint8_t)ret), frame, &ctrl->retry.policy);
+	}
+#endif
 
 	__DBG("caniot_controller_query(did: %u, frame: %p, timeout: %u) -> ret (handle): "
 	      "%d\n",
@@ -998,6 +3348,138 @@ int caniot_controller_query(struct caniot_controller *ctrl,
 	return ret;
 }
 
+#if CONFIG_CANIOT_CTRL_RETRY
+int caniot_controller_query_retry(struct caniot_controller *ctrl,
+				  caniot_did_t did,
+				  struct caniot_frame *frame,
+				  uint32_t timeout,
+				  const struct caniot_ctrl_retry_policy *policy)
+{
+#if CONFIG_CANIOT_CHECKS
+	if (!ctrl || !frame || !policy) return -CANIOT_EINVAL;
+#endif
+
+	int ret = query(ctrl, did, frame, timeout, NULL, true);
+	if (ret > 0) {
+		pendq_retry_arm(ctrl, pendq_get_by_handle(ctrl, (uint8_t)ret), frame, policy);
+	}
+
+	__DBG("caniot_controller_query_retry(did: %u, frame: %p, timeout: %u, attempts: "
+	      "%u) -> ret (handle): %d\n",
+	      did,
+	      (void *)frame,
+	      timeout,
+	      policy->max_attempts,
+	      ret);
+
+	return ret;
+}
+#endif
+
+#if CONFIG_CANIOT_CTRL_BCAST_AGGREGATE
+int caniot_controller_query_broadcast(struct caniot_controller *ctrl,
+				      struct caniot_ctrl_bcast *bcast,
+				      struct caniot_frame *frame,
+				      uint32_t timeout)
+{
+#if CONFIG_CANIOT_CHECKS
+	if (!ctrl || !bcast || !frame) return -CANIOT_EINVAL;
+#endif
+
+	if (timeout == 0u) return -CANIOT_EINVAL;
+
+	/* updated when the frame is sent, if deferred */
+	bcast->answered = 0u;
+	bcast->sent_ms	= ctrl->clock_ms;
+
+	int ret = query(ctrl, CANIOT_DID_BROADCAST, frame, timeout, NULL, true);
+	if (ret > 0) {
+		struct pendq *const pq = pendq_get_by_handle(ctrl, (uint8_t)ret);
+
+		pq->bcast     = bcast;
+		pq->user_data = bcast;
+	}
+
+	__DBG("caniot_controller_query_broadcast(bcast: %p, frame: %p, timeout: %u) -> "
+	      "ret: %d\n",
+	      (void *)bcast,
+	      (void *)frame,
+	      timeout,
+	      ret);
+
+	return ret;
+}
+#endif
+
+#if CONFIG_CANIOT_CTRL_CACHE_SIZE > 0
+int caniot_controller_query_cached(struct caniot_controller *ctrl,
+				   caniot_did_t did,
+				   struct caniot_frame *frame,
+				   uint32_t timeout)
+{
+#if CONFIG_CANIOT_CHECKS
+	if (!ctrl || !frame) return -CANIOT_EINVAL;
+#endif
+
+	const struct caniot_frame *const cached =
+		caniot_controller_cache_get(ctrl, did, frame);
+
+	if (cached == NULL) {
+		return caniot_controller_query(ctrl, did, frame, timeout);
+	}
+
+	const caniot_controller_event_t ev = {
+		.controller = ctrl,
+		.context    = CANIOT_CONTROLLER_EVENT_CONTEXT_CACHE,
+		.status	    = CANIOT_CONTROLLER_EVENT_STATUS_OK,
+
+		.did = did,
+
+		.terminated = 1U,
+		.handle	    = INVALID_HANDLE,
+
+		.response  = cached,
+		.user_data = NULL,
+	};
+
+	(void)call_user_callback(ctrl, &ev);
+
+	return 0;
+}
+#endif
+
+int caniot_controller_query_ex(struct caniot_controller *ctrl,
+			       struct caniot_pendq *pq,
+			       caniot_did_t did,
+			       struct caniot_frame *frame,
+			       uint32_t timeout)
+{
+#if CONFIG_CANIOT_CHECKS
+	if (!ctrl || !pq || !frame) return -CANIOT_EINVAL;
+#endif
+
+	/* a context is required to track the query */
+	if (timeout == 0u) return -CANIOT_EINVAL;
+
+	int ret = query(ctrl, did, frame, timeout, pq, true);
+
+#if CONFIG_CANIOT_CTRL_RETRY
+	if (ret > 0) {
+		pendq_retry_arm(ctrl, pq, frame, &ctrl->retry.policy);
+	}
+#endif
+
+	__DBG("caniot_controller_query_ex(pq: %p, did: %u, frame: %p, timeout: %u) -> "
+	      "ret: %d\n",
+	      (void *)pq,
+	      did,
+	      (void *)frame,
+	      timeout,
+	      ret);
+
+	return MIN(ret, 0);
+}
+
 static uint32_t process_get_diff_ms(struct caniot_controller *ctrl)
 {
 	ASSERT(ctrl != NULL);
@@ -1013,7 +3495,199 @@ static uint32_t process_get_diff_ms(struct caniot_controller *ctrl)
 	       last_ms;
 }
 
-int caniot_controller_process(struct caniot_controller *ctrl)
+/* Advance the controller clock and the timeouts of the pending queries to the
+ * driver time, expired queries are notified on the next processing */
+static void clock_refresh(struct caniot_controller *ctrl)
+{
+	const uint32_t time_passed_ms = process_get_diff_ms(ctrl);
+
+	ctrl->clock_ms += time_passed_ms;
+	pendq_shift(ctrl, time_passed_ms);
+}
+
+#if CONFIG_CANIOT_CTRL_SUBMIT_QUEUE
+
+static void submitq_push(struct caniot_controller *ctrl, struct caniot_ctrl_submission *sub)
+{
+	ASSERT(ctrl != NULL);
+	ASSERT(sub != NULL);
+
+	struct caniot_ctrl_submission *head =
+		__atomic_load_n(&ctrl->submitq, __ATOMIC_RELAXED);
+
+	/* Treiber stack push, the consumer takes the whole stack at once so
+	 * there is no ABA issue */
+	do {
+		sub->next = head;
+	} while (!__atomic_compare_exchange_n(&ctrl->submitq,
+					      &head,
+					      sub,
+					      true,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+}
+
+int caniot_controller_submit_query(struct caniot_controller *ctrl,
+				   struct caniot_ctrl_submission *sub,
+				   struct caniot_pendq *pq,
+				   caniot_did_t did,
+				   const struct caniot_frame *frame,
+				   uint32_t timeout)
+{
+#if CONFIG_CANIOT_CHECKS
+	if (!ctrl || !sub || !frame) return -CANIOT_EINVAL;
+#endif
+
+	/* a context is required to track the query, and only then */
+	if ((pq == NULL) != (timeout == 0u)) return -CANIOT_EINVAL;
+
+	sub->op	      = CANIOT_CTRL_SUBMIT_QUERY;
+	sub->pq	      = pq;
+	sub->did      = did;
+	sub->timeout  = timeout;
+	sub->suppress = false;
+	sub->frame    = *frame;
+	sub->status   = 0;
+	sub->done     = 0u;
+
+	submitq_push(ctrl, sub);
+
+	return 0;
+}
+
+int caniot_controller_submit_cancel(struct caniot_controller *ctrl,
+				    struct caniot_ctrl_submission *sub,
+				    struct caniot_pendq *pq,
+				    bool suppress)
+{
+#if CONFIG_CANIOT_CHECKS
+	if (!ctrl || !sub || !pq) return -CANIOT_EINVAL;
+#endif
+
+	sub->op	      = CANIOT_CTRL_SUBMIT_CANCEL;
+	sub->pq	      = pq;
+	sub->suppress = suppress;
+	sub->status   = 0;
+	sub->done     = 0u;
+
+	submitq_push(ctrl, sub);
+
+	return 0;
+}
+
+bool caniot_controller_submission_done(const struct caniot_ctrl_submission *sub)
+{
+#if CONFIG_CANIOT_CHECKS
+	if (!sub) return false;
+#endif
+
+	return __atomic_load_n(&sub->done, __ATOMIC_ACQUIRE) != 0u;
+}
+
+static void submit_failed_event(struct caniot_controller *ctrl,
+				const struct caniot_ctrl_submission *sub)
+{
+	ASSERT(ctrl != NULL);
+	ASSERT(sub != NULL);
+
+	const caniot_controller_event_t ev = {
+		.controller = ctrl,
+		.context    = CANIOT_CONTROLLER_EVENT_CONTEXT_QUERY,
+		.status	    = CANIOT_CONTROLLER_EVENT_STATUS_CANCELLED,
+
+		.did = sub->did,
+
+		.terminated = 1U,
+		.handle	    = CANIOT_HANDLE_EXT,
+
+		.response  = NULL,
+		.user_data = sub->pq->user_data,
+	};
+
+	call_user_callback(ctrl, &ev);
+}
+
+static void submitq_execute(struct caniot_controller *ctrl,
+			    struct caniot_ctrl_submission *sub)
+{
+	ASSERT(ctrl != NULL);
+	ASSERT(sub != NULL);
+
+	int ret;
+
+	switch (sub->op) {
+	case CANIOT_CTRL_SUBMIT_QUERY:
+		ret = query(ctrl, sub->did, &sub->frame, sub->timeout, sub->pq, true);
+		ret = MIN(ret, 0);
+		if ((ret < 0) && (sub->pq != NULL)) {
+			submit_failed_event(ctrl, sub);
+		}
+		break;
+	case CANIOT_CTRL_SUBMIT_CANCEL:
+		ret = caniot_controller_query_ex_cancel(ctrl, sub->pq, sub->suppress);
+		break;
+	default:
+		ret = -CANIOT_EINVAL;
+		break;
+	}
+
+	__DBG("submitq_execute(sub: %p, op: %u) -> ret: %d\n",
+	      (void *)sub,
+	      (uint32_t)sub->op,
+	      ret);
+
+	sub->status = ret;
+
+	/* the submission storage belongs to the submitter from now on */
+	__atomic_store_n(&sub->done, 1u, __ATOMIC_RELEASE);
+}
+
+static void submitq_drain(struct caniot_controller *ctrl)
+{
+	ASSERT(ctrl != NULL);
+
+	struct caniot_ctrl_submission *sub, *next, *fifo = NULL;
+
+	/* take all submissions at once */
+	sub = __atomic_exchange_n(&ctrl->submitq, NULL, __ATOMIC_ACQUIRE);
+
+	/* reverse the stack to execute them in submission order */
+	while (sub != NULL) {
+		next	  = sub->next;
+		sub->next = fifo;
+		fifo	  = sub;
+		sub	  = next;
+	}
+
+	while (fifo != NULL) {
+		/* read next before the submitter can reuse the storage */
+		next = fifo->next;
+		submitq_execute(ctrl, fifo);
+		fifo = next;
+	}
+}
+
+#endif /* CONFIG_CANIOT_CTRL_SUBMIT_QUEUE */
+
+/* Number of frames received between two deliveries of the expired queries
+ * in a budgeted processing loop */
+#define PROCESS_EXPIRE_INTERVAL 8u
+
+static uint32_t process_now_ms(struct caniot_controller *ctrl)
+{
+	ASSERT(ctrl != NULL);
+
+	uint32_t sec;
+	uint16_t ms;
+
+	ctrl->driv->get_time(&sec, &ms);
+
+	return sec * 1000u + ms;
+}
+
+int caniot_controller_process_budget(struct caniot_controller *ctrl,
+				     uint32_t max_frames,
+				     uint32_t max_ms)
 {
 #if CONFIG_CANIOT_CHECKS
 	if (!ctrl) return -CANIOT_EINVAL;
@@ -1024,27 +3698,65 @@ int caniot_controller_process(struct caniot_controller *ctrl)
 
 	int ret;
 	struct caniot_frame frame;
+	uint32_t frames		      = 0u;
+	const uint32_t start_ms = process_now_ms(ctrl);
+
+	/* update timeouts before queries are sent, so that their timeouts start now */
+	clock_refresh(ctrl);
+
+#if CONFIG_CANIOT_CTRL_SUBMIT_QUEUE
+	submitq_drain(ctrl);
+#endif
+
+#if CONFIG_CANIOT_CTRL_TX_SHAPER
+	txq_release(ctrl);
+#endif
 
 	while (true) {
+		/* budget exhausted, frames may still be pending */
+		if (((max_frames != 0u) && (frames >= max_frames)) ||
+		    ((max_ms != 0u) && ((process_now_ms(ctrl) - start_ms) >= max_ms))) {
+			ret = 1;
+			break;
+		}
+
 		ret = ctrl->driv->recv(&frame);
 		if (ret == 0) {
 			if ((ret = caniot_controller_handle_rx_frame(ctrl, &frame)) < 0) {
-				return ret;
+				break;
 			}
 		} else if (ret == -CANIOT_EAGAIN) {
+			ret = 0;
 			break;
 		} else {
-			return ret;
+			break;
 		}
-	}
 
-	/* update timeouts */
-	pendq_shift(ctrl, process_get_diff_ms(ctrl));
+		/* don't hold the expired queries back for the whole burst, the
+		 * queries answered by the frames handled so far are not affected */
+		if ((++frames % PROCESS_EXPIRE_INTERVAL) == 0u) {
+			clock_refresh(ctrl);
+			pendq_call_expired(ctrl);
+		}
+	}
 
-	/* call callbacks for expired queries */
+	/* call callbacks for expired queries, even on error so that a failing
+	 * driver does not hold the timeouts back */
 	pendq_call_expired(ctrl);
 
-	return 0;
+	__DBG("caniot_controller_process_budget(max_frames: %u, max_ms: %u) -> frames: %u "
+	      "ret: %d\n",
+	      max_frames,
+	      max_ms,
+	      frames,
+	      ret);
+
+	return ret;
+}
+
+int caniot_controller_process(struct caniot_controller *ctrl)
+{
+	return MIN(caniot_controller_process_budget(ctrl, 0u, 0u), 0);
 }
 
 #endif
@@ -1166,6 +3878,8 @@ const char *caniot_controller_event_context_to_str(caniot_controller_event_conte
 		return "orphan";
 	case CANIOT_CONTROLLER_EVENT_CONTEXT_QUERY:
 		return "query";
+	case CANIOT_CONTROLLER_EVENT_CONTEXT_CACHE:
+		return "cache";
 	default:
 		return "<unknown>";
 	}
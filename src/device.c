@@ -11,6 +11,10 @@
 #include <caniot/caniot_private.h>
 #include <caniot/device.h>
 
+#if CONFIG_CANIOT_DEVICE_DELAYED_TX_SIZE > 0 && !CONFIG_CANIOT_DEVICE_DRIVERS_API
+#error "CONFIG_CANIOT_DEVICE_DELAYED_TX_SIZE requires CONFIG_CANIOT_DEVICE_DRIVERS_API"
+#endif
+
 typedef uint16_t attr_key_t;
 
 enum section_option {
@@ -1081,6 +1085,11 @@ exit:
 		resp_wrap_error(dev, resp, req, ret, p_arg);
 	}
 
+#if CONFIG_CANIOT_QUERY_ID
+	/* echo the query id for the controller to identify the query */
+	resp->id.query_id = req->id.query_id;
+#endif
+
 	return ret;
 }
 
@@ -1128,6 +1137,104 @@ uint32_t caniot_device_telemetry_remaining(struct caniot_device *dev)
 	return 1000u;
 }
 
+#if CONFIG_CANIOT_DEVICE_DELAYED_TX_SIZE > 0
+static uint32_t device_now_ms(struct caniot_device *dev)
+{
+	uint32_t sec;
+	uint16_t msec;
+
+	dev->driv->get_time(&sec, &msec);
+
+	return sec * 1000 + msec;
+}
+
+/* Queue the frame until release_ms, -CANIOT_EAGAIN if the queue is full */
+static int delayed_tx_queue(struct caniot_device *dev,
+			    const struct caniot_frame *frame,
+			    uint32_t release_ms)
+{
+	ASSERT(dev != NULL);
+	ASSERT(frame != NULL);
+
+	uint8_t i = dev->delayed_tx.count;
+
+	if (i == CONFIG_CANIOT_DEVICE_DELAYED_TX_SIZE) {
+		return -CANIOT_EAGAIN;
+	}
+
+	/* keep the queue sorted, frames with the same release time keep their
+	 * order */
+	while ((i > 0u) && ((int32_t)(release_ms - dev->delayed_tx.release_ms[i - 1u]) < 0)) {
+		dev->delayed_tx.frames[i]     = dev->delayed_tx.frames[i - 1u];
+		dev->delayed_tx.release_ms[i] = dev->delayed_tx.release_ms[i - 1u];
+		i--;
+	}
+
+	dev->delayed_tx.frames[i]     = *frame;
+	dev->delayed_tx.release_ms[i] = release_ms;
+	dev->delayed_tx.count++;
+
+	return 0;
+}
+
+static int delayed_tx_release(struct caniot_device *dev, uint32_t now_ms)
+{
+	ASSERT(dev != NULL);
+
+	uint8_t sent = 0u;
+	int ret	     = 0;
+
+	while ((sent < dev->delayed_tx.count) &&
+	       ((int32_t)(dev->delayed_tx.release_ms[sent] - now_ms) <= 0)) {
+		ret = dev->driv->send(&dev->delayed_tx.frames[sent], 0u);
+		if (ret != 0) {
+			break;
+		}
+
+		sent++;
+	}
+
+	if (sent != 0u) {
+		dev->delayed_tx.count -= sent;
+		memmove(dev->delayed_tx.frames,
+			&dev->delayed_tx.frames[sent],
+			dev->delayed_tx.count * sizeof(struct caniot_frame));
+		memmove(dev->delayed_tx.release_ms,
+			&dev->delayed_tx.release_ms[sent],
+			dev->delayed_tx.count * sizeof(uint32_t));
+	}
+
+	return ret;
+}
+#endif
+
+int caniot_device_process_delayed_tx(struct caniot_device *dev)
+{
+	ASSERT(dev != NULL);
+
+#if CONFIG_CANIOT_DEVICE_DELAYED_TX_SIZE > 0
+	return delayed_tx_release(dev, device_now_ms(dev));
+#else
+	return 0;
+#endif
+}
+
+uint32_t caniot_device_delayed_tx_remaining(struct caniot_device *dev)
+{
+	ASSERT(dev != NULL);
+
+#if CONFIG_CANIOT_DEVICE_DELAYED_TX_SIZE > 0
+	if (dev->delayed_tx.count != 0u) {
+		const int32_t remaining =
+			(int32_t)(dev->delayed_tx.release_ms[0u] - device_now_ms(dev));
+
+		return (remaining > 0) ? (uint32_t)remaining : 0u;
+	}
+#endif
+
+	return (uint32_t)-1;
+}
+
 static uint32_t get_response_delay(struct caniot_device *dev, bool random)
 {
 	ASSERT(dev != NULL);
@@ -1209,8 +1316,10 @@ int caniot_device_process(struct caniot_device *dev)
 	struct caniot_frame req, resp;
 
 	/* get current time (ms precision) */
+	uint32_t sec;
 	uint16_t msec;
-	dev->driv->get_time(&dev->system.time, &msec);
+	dev->driv->get_time(&sec, &msec);
+	dev->system.time   = sec;
 	dev->system.uptime = dev->system.time - dev->system.start_time;
 
 	/* check if we need to send telemetry (calculated in seconds) */
@@ -1225,6 +1334,12 @@ int caniot_device_process(struct caniot_device *dev)
 		(FMT_UINT_CAST)ellapsed_ms,
 		(FMT_UINT_CAST)dev->config->telemetry.period);
 
+#if CONFIG_CANIOT_DEVICE_DELAYED_TX_SIZE > 0
+	/* send the delayed frames which are due, a failure is retried on the
+	 * next call */
+	delayed_tx_release(dev, now_ms);
+#endif
+
 	if (ellapsed_ms >= dev->config->telemetry.period) {
 		caniot_device_trigger_telemetry_ep(dev,
 						   dev->config->flags.telemetry_endpoint);
@@ -1287,7 +1402,21 @@ int caniot_device_process(struct caniot_device *dev)
 	}
 
 	/* send response or error frame if configured */
-	ret = dev->driv->send(&resp, get_response_delay(dev, random_delay));
+	const uint32_t delay_ms = get_response_delay(dev, random_delay);
+
+#if CONFIG_CANIOT_DEVICE_DELAYED_TX_SIZE > 0
+	if (delay_ms != 0u) {
+		ret = delayed_tx_queue(dev, &resp, now_ms + delay_ms);
+
+		/* queue full, the driver handles the delay */
+		if (ret != 0) {
+			ret = dev->driv->send(&resp, delay_ms);
+		}
+	} else
+#endif
+	{
+		ret = dev->driv->send(&resp, delay_ms);
+	}
 	if (ret == 0) {
 		dev->system.sent.total++;
 
@@ -1318,7 +1447,13 @@ void caniot_app_init(struct caniot_device *dev)
 
 	memset(&dev->system, 0x00U, sizeof(dev->system));
 
-	dev->driv->get_time(&dev->system.start_time, NULL);
+#if CONFIG_CANIOT_DEVICE_DELAYED_TX_SIZE > 0
+	dev->delayed_tx.count = 0u;
+#endif
+
+	uint32_t sec;
+	dev->driv->get_time(&sec, NULL);
+	dev->system.start_time = sec;
 
 	dev->flags.initialized = 1u;
 }
@@ -1421,7 +1556,9 @@ bool caniot_device_targeted(caniot_did_t did, bool ext, bool rtr, uint32_t id)
 
 	(void)rtr;
 
-	if (!ext) {
+	/* Extended IDs are only expected if they carry a query id above the
+	 * standard CANIOT ID */
+	if (!ext || CONFIG_CANIOT_QUERY_ID) {
 		const uint16_t std_id = id & 0x7FFu; /* CAN standard ID mask (11 bits) */
 
 		const uint16_t mask	  = caniot_device_get_mask();
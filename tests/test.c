@@ -9,6 +9,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #include <caniot/caniot_private.h>
@@ -161,6 +162,24 @@ bool z_misc_id_conversion(void)
 	       (id.sid == id2.sid) && (id.endpoint == id2.endpoint);
 }
 
+#if CONFIG_CANIOT_QUERY_ID
+bool z_misc_ext_id_conversion(void)
+{
+	caniot_id_t id = gen_rdm_id();
+	id.query_id    = r16();
+
+	const uint32_t ext_canid = caniot_id_to_ext_canid(id);
+
+	const caniot_id_t id2 = caniot_ext_canid_to_id(ext_canid);
+
+	return (ext_canid < (1lu << 29u)) &&
+	       (CANIOT_EXT_ID_GET_STD_ID(ext_canid) == caniot_id_to_canid(id)) &&
+	       (id.type == id2.type) && (id.query == id2.query) && (id.cls == id2.cls) &&
+	       (id.sid == id2.sid) && (id.endpoint == id2.endpoint) &&
+	       (id.query_id == id2.query_id);
+}
+#endif
+
 static caniot_did_t gen_rdm_did(bool including_broadcast)
 {
 	if (including_broadcast) {
@@ -344,7 +363,7 @@ bool z_func_ctrl1(void)
 	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 1000U, NULL));
 	CHECK(caniot_controller_query_pending(&x.ctrl, x.handle) == false);
 	CHECK(x.ctrl.pendingq.pending_devices_bf == 0U);
-	CHECK(x.ctrl.pendingq.timeout_queue == NULL);
+	CHECK(caniot_controller_next_timeout(&x.ctrl) == (uint32_t)-1);
 	CHECK(caniot_controller_dbg_free_pendq(&x.ctrl) ==
 	      CONFIG_CANIOT_MAX_PENDING_QUERIES);
 
@@ -379,7 +398,7 @@ bool z_func_ctrl2(void)
 	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 1000U, &x.resp));
 	CHECK(caniot_controller_query_pending(&x.ctrl, x.handle) == false);
 	CHECK(x.ctrl.pendingq.pending_devices_bf == 0U);
-	CHECK(x.ctrl.pendingq.timeout_queue == NULL);
+	CHECK(caniot_controller_next_timeout(&x.ctrl) == (uint32_t)-1);
 	CHECK(caniot_controller_dbg_free_pendq(&x.ctrl) ==
 	      CONFIG_CANIOT_MAX_PENDING_QUERIES);
 
@@ -417,7 +436,7 @@ bool z_func_ctrl3(void)
 	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 1000U, &x.resp));
 	CHECK(caniot_controller_query_pending(&x.ctrl, x.handle) == false);
 	CHECK(x.ctrl.pendingq.pending_devices_bf == 0U);
-	CHECK(x.ctrl.pendingq.timeout_queue == NULL);
+	CHECK(caniot_controller_next_timeout(&x.ctrl) == (uint32_t)-1);
 	CHECK(caniot_controller_dbg_free_pendq(&x.ctrl) ==
 	      CONFIG_CANIOT_MAX_PENDING_QUERIES);
 
@@ -450,7 +469,7 @@ bool z_func_ctrl4(void)
 	CHECK(caniot_controller_query_pending(&x.ctrl, x.handle) == false);
 	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 1000U, NULL));
 	CHECK(x.ctrl.pendingq.pending_devices_bf == 0U);
-	CHECK(x.ctrl.pendingq.timeout_queue == NULL);
+	CHECK(caniot_controller_next_timeout(&x.ctrl) == (uint32_t)-1);
 	CHECK(caniot_controller_dbg_free_pendq(&x.ctrl) ==
 	      CONFIG_CANIOT_MAX_PENDING_QUERIES);
 
@@ -486,7 +505,7 @@ bool z_func_dev0(void)
 	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 1000U, &x.resp));
 	CHECK(caniot_controller_query_pending(&x.ctrl, x.handle) == false);
 	CHECK(x.ctrl.pendingq.pending_devices_bf == 0U);
-	CHECK(x.ctrl.pendingq.timeout_queue == NULL);
+	CHECK(caniot_controller_next_timeout(&x.ctrl) == (uint32_t)-1);
 	CHECK(caniot_controller_dbg_free_pendq(&x.ctrl) ==
 	      CONFIG_CANIOT_MAX_PENDING_QUERIES);
 
@@ -495,6 +514,1449 @@ bool z_func_dev0(void)
 
 /*____________________________________________________________________________*/
 
+struct z_ctrl_events_ctx {
+	struct caniot_controller ctrl;
+	uint32_t count;
+	caniot_controller_event_t last;
+
+	/* Handles of the events received, in order */
+	uint8_t handles[8u];
+};
+
+static bool z_ctrl_events_cb(const caniot_controller_event_t *ev, void *user_data)
+{
+	TEST_ASSERT(user_data != NULL);
+
+	struct z_ctrl_events_ctx *x = user_data;
+
+	if (x->count < ARRAY_SIZE(x->handles)) {
+		x->handles[x->count] = ev->handle;
+	}
+	x->count++;
+	x->last = *ev;
+
+	return true;
+}
+
+static void z_build_attr_resp(struct caniot_frame *resp, caniot_did_t did, uint16_t key)
+{
+	caniot_clear_frame(resp);
+	caniot_build_query_read_attribute(resp, key);
+	caniot_frame_set_did(resp, did);
+	resp->id.query = CANIOT_RESPONSE;
+	resp->len      = 6u;
+}
+
+#if CONFIG_CANIOT_CTRL_DRIVERS_API
+/* Stub drivers for the controller tests relying on the drivers API */
+static struct {
+	uint32_t sent;
+	struct caniot_frame last_sent;
+	int send_ret;
+
+	uint32_t sec;
+	uint16_t ms;
+
+	/* Frame received rx_pending times, each reception taking rx_ms */
+	struct caniot_frame rx;
+	uint32_t rx_pending;
+	uint16_t rx_ms;
+
+	/* Returned by recv() if not 0 */
+	int recv_ret;
+} z_driv;
+
+static int z_driv_send(const struct caniot_frame *frame, uint32_t delay_ms)
+{
+	(void)delay_ms;
+
+	if (z_driv.send_ret == 0) {
+		z_driv.sent++;
+		z_driv.last_sent = *frame;
+	}
+
+	return z_driv.send_ret;
+}
+
+static int z_driv_recv(struct caniot_frame *frame)
+{
+	if (z_driv.recv_ret != 0) return z_driv.recv_ret;
+	if (z_driv.rx_pending == 0u) return -CANIOT_EAGAIN;
+
+	z_driv.rx_pending--;
+	z_driv.ms += z_driv.rx_ms;
+	*frame = z_driv.rx;
+
+	return 0;
+}
+
+static void z_driv_get_time(uint32_t *sec, uint16_t *ms)
+{
+	*sec = z_driv.sec;
+	if (ms != NULL) *ms = z_driv.ms;
+}
+
+static void z_driv_entropy(uint8_t *buf, size_t len)
+{
+	memset(buf, 0x01, len);
+}
+
+static const struct caniot_drivers_api z_driv_api = {
+	.entropy  = z_driv_entropy,
+	.get_time = z_driv_get_time,
+	.send	  = z_driv_send,
+	.recv	  = z_driv_recv,
+};
+
+static int z_ctrl_driv_init(struct z_ctrl_events_ctx *x)
+{
+	memset(&z_driv, 0x00, sizeof(z_driv));
+
+	return caniot_controller_driv_init(&x->ctrl, &z_driv_api, z_ctrl_events_cb, x);
+}
+#endif
+
+/* Check the response to a query without timeout is matched */
+bool z_func_ctrl_forever(void)
+{
+	struct z_ctrl_events_ctx x = {.count = 0u};
+	const caniot_did_t did	   = gen_rdm_did(false);
+	struct caniot_frame req, resp;
+	int h;
+
+	CHECK_0(caniot_controller_init(&x.ctrl, z_ctrl_events_cb, &x));
+
+	caniot_build_query_read_attribute(&req, 0x1010u);
+	CHECK_STRICTLY_POSITIVE(h = caniot_controller_query_register(
+					&x.ctrl, did, &req, CANIOT_TIMEOUT_FOREVER));
+	CHECK(x.ctrl.pendingq.by_did[did] != NULL);
+
+	z_build_attr_resp(&resp, did, 0x1010u);
+#if CONFIG_CANIOT_QUERY_ID
+	resp.id.query_id = req.id.query_id;
+#endif
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 10U, &resp));
+	CHECK(x.count == 1u && x.handles[0] == h);
+	CHECK(x.last.context == CANIOT_CONTROLLER_EVENT_CONTEXT_QUERY);
+	CHECK(x.last.status == CANIOT_CONTROLLER_EVENT_STATUS_OK);
+	CHECK(x.ctrl.pendingq.by_did[did] == NULL);
+	CHECK(x.ctrl.pendingq.pending_devices_bf == 0U);
+	CHECK(caniot_controller_dbg_free_pendq(&x.ctrl) ==
+	      CONFIG_CANIOT_MAX_PENDING_QUERIES);
+
+	return true;
+}
+
+/* Check a batch of frames is dispatched before timeouts are processed */
+bool z_func_ctrl_rx_frames(void)
+{
+	struct z_ctrl_events_ctx x = {.count = 0u};
+	const caniot_did_t did1	   = CANIOT_DID(CANIOT_DEVICE_CLASS0, 1u);
+	const caniot_did_t did2	   = CANIOT_DID(CANIOT_DEVICE_CLASS0, 2u);
+	const caniot_did_t did3	   = CANIOT_DID(CANIOT_DEVICE_CLASS0, 3u);
+	struct caniot_frame req, resps[3u];
+	int status[3u];
+	int h1, h2, h3;
+
+	CHECK_0(caniot_controller_init(&x.ctrl, z_ctrl_events_cb, &x));
+
+	caniot_build_query_read_attribute(&req, 0x1010u);
+	CHECK_STRICTLY_POSITIVE(h1 = caniot_controller_query_register(
+					&x.ctrl, did1, &req, 1000U));
+	CHECK_STRICTLY_POSITIVE(h2 = caniot_controller_query_register(
+					&x.ctrl, did2, &req, 1000U));
+	CHECK_STRICTLY_POSITIVE(h3 = caniot_controller_query_register(
+					&x.ctrl, did3, &req, 5U));
+
+	z_build_attr_resp(&resps[0u], did2, 0x1010u);
+	z_build_attr_resp(&resps[1u], did1, 0x1010u);
+	z_build_attr_resp(&resps[2u], did1, 0x1010u); /* orphan */
+
+	CHECK_0(caniot_controller_rx_frames(&x.ctrl, 10U, resps, 3u, status));
+	CHECK(status[0u] == 0 && status[1u] == 0 && status[2u] == 0);
+	CHECK(x.count == 4u);
+	CHECK(x.handles[0u] == h2 && x.handles[1u] == h1);
+	CHECK(x.handles[2u] == 0u);
+	CHECK(x.handles[3u] == h3);
+	CHECK(x.last.status == CANIOT_CONTROLLER_EVENT_STATUS_TIMEOUT);
+	CHECK(x.ctrl.pendingq.pending_devices_bf == 0U);
+
+	/* An empty batch only processes timeouts */
+	CHECK_0(caniot_controller_rx_frames(&x.ctrl, 10U, NULL, 0u, NULL));
+
+	return true;
+}
+
+/* Check queries tracked with a caller-owned context */
+bool z_func_ctrl_query_ex(void)
+{
+	struct z_ctrl_events_ctx x = {.count = 0u};
+	const caniot_did_t did	   = gen_rdm_did(false);
+	struct caniot_frame req, resp;
+	struct caniot_pendq pq;
+	int user;
+
+	CHECK_0(caniot_controller_init(&x.ctrl, z_ctrl_events_cb, &x));
+
+	/* a context never used is not pending, whatever it holds */
+	memset(&pq, 0xFF, sizeof(pq));
+	CHECK(caniot_controller_query_ex_pending(&x.ctrl, &pq) == false);
+	CHECK(caniot_controller_query_ex_cancel(&x.ctrl, &pq, false) ==
+	      -CANIOT_ENOHANDLE);
+
+	caniot_build_query_read_attribute(&req, 0x1010u);
+	CHECK(caniot_controller_query_register_ex(&x.ctrl, &pq, did, &req, 0u) ==
+	      -CANIOT_EINVAL);
+
+	pq.user_data = &user;
+	CHECK_0(caniot_controller_query_register_ex(&x.ctrl, &pq, did, &req, 1000U));
+	CHECK(caniot_controller_query_ex_pending(&x.ctrl, &pq) == true);
+	CHECK(caniot_controller_dbg_free_pendq(&x.ctrl) ==
+	      CONFIG_CANIOT_MAX_PENDING_QUERIES);
+
+	/* the context is in use */
+	z_build_attr_resp(&resp, did, 0x1010u);
+#if CONFIG_CANIOT_QUERY_ID
+	resp.id.query_id = req.id.query_id;
+#endif
+	CHECK(caniot_controller_query_register_ex(&x.ctrl, &pq, did, &req, 1000U) ==
+	      -CANIOT_EBUSY);
+	CHECK(caniot_controller_query_ex_pending(&x.ctrl, &pq) == true);
+
+	/* a copy of the context is not tracking any query */
+	struct caniot_pendq copy = pq;
+	const caniot_did_t other = (did + 1u) % CANIOT_DID_MAX_COUNT;
+	CHECK(caniot_controller_query_ex_pending(&x.ctrl, &copy) == false);
+	CHECK_0(caniot_controller_query_register_ex(&x.ctrl, &copy, other, &req, 1000U));
+	CHECK_0(caniot_controller_query_ex_cancel(&x.ctrl, &copy, true));
+	CHECK(x.count == 0u);
+
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 10U, &resp));
+	CHECK(x.count == 1u && x.handles[0] == CANIOT_HANDLE_EXT);
+	CHECK(x.last.status == CANIOT_CONTROLLER_EVENT_STATUS_OK);
+	CHECK(x.last.terminated == 1u && x.last.user_data == &user);
+	CHECK(caniot_controller_query_ex_pending(&x.ctrl, &pq) == false);
+
+	/* Reuse the context and cancel the query */
+	CHECK_0(caniot_controller_query_register_ex(&x.ctrl, &pq, did, &req, 1000U));
+	CHECK_0(caniot_controller_query_ex_cancel(&x.ctrl, &pq, false));
+	CHECK(x.count == 2u);
+	CHECK(x.last.status == CANIOT_CONTROLLER_EVENT_STATUS_CANCELLED);
+	CHECK(caniot_controller_query_ex_pending(&x.ctrl, &pq) == false);
+	CHECK(caniot_controller_query_ex_cancel(&x.ctrl, &pq, false) ==
+	      -CANIOT_ENOHANDLE);
+
+	CHECK(x.ctrl.pendingq.pending_devices_bf == 0U);
+	CHECK(caniot_controller_dbg_free_pendq(&x.ctrl) ==
+	      CONFIG_CANIOT_MAX_PENDING_QUERIES);
+
+	return true;
+}
+
+#if CONFIG_CANIOT_CTRL_SUBMIT_QUEUE && CONFIG_CANIOT_CTRL_PIPELINE_DEPTH == 2
+/* Check requests submitted to the controller are executed in order by process() */
+bool z_func_ctrl_submit_queue(void)
+{
+	struct z_ctrl_events_ctx x = {.count = 0u};
+	const caniot_did_t did	   = gen_rdm_did(false);
+	struct caniot_ctrl_submission subs[4u];
+	struct caniot_pendq pqs[3u];
+	struct caniot_frame req;
+
+	CHECK_0(z_ctrl_driv_init(&x));
+
+	caniot_build_query_read_attribute(&req, 0x1010u);
+	CHECK(caniot_controller_submit_query(&x.ctrl, &subs[0u], NULL, did, &req, 1000u) ==
+	      -CANIOT_EINVAL);
+
+	for (uint8_t i = 0u; i < 3u; i++) {
+		caniot_build_query_read_attribute(&req, 0x1010u + i);
+		pqs[i].user_data = &pqs[i];
+		CHECK_0(caniot_controller_submit_query(
+			&x.ctrl, &subs[i], &pqs[i], did, &req, 1000u));
+	}
+	CHECK_0(caniot_controller_submit_cancel(&x.ctrl, &subs[3u], &pqs[0u], false));
+
+	/* nothing is executed before the controller is processed */
+	CHECK(z_driv.sent == 0u);
+	CHECK(caniot_controller_submission_done(&subs[0u]) == false);
+
+	CHECK_0(caniot_controller_process(&x.ctrl));
+	for (uint8_t i = 0u; i < 4u; i++) {
+		CHECK(caniot_controller_submission_done(&subs[i]) == true);
+	}
+
+	/* the third query exceeds the pipeline depth of the device */
+	CHECK(z_driv.sent == 2u);
+	CHECK(subs[0u].status == 0 && subs[1u].status == 0);
+	CHECK(subs[2u].status == -CANIOT_EBUSY);
+	CHECK(subs[3u].status == 0);
+
+	CHECK(x.count == 2u);
+	CHECK(caniot_controller_query_ex_pending(&x.ctrl, &pqs[0u]) == false);
+	CHECK(caniot_controller_query_ex_pending(&x.ctrl, &pqs[1u]) == true);
+	CHECK(x.last.status == CANIOT_CONTROLLER_EVENT_STATUS_CANCELLED);
+	CHECK(x.last.user_data == &pqs[0u]);
+
+	CHECK_0(caniot_controller_query_ex_cancel(&x.ctrl, &pqs[1u], true));
+
+	return true;
+}
+#endif
+
+#if CONFIG_CANIOT_CTRL_EVENT_RING_SIZE == 4
+/* Check events are queued in the completion ring if no callback is registered */
+bool z_func_ctrl_poll_events(void)
+{
+	struct caniot_controller ctrl;
+	struct caniot_controller_event_record recs[3u];
+	const caniot_did_t did1 = CANIOT_DID(CANIOT_DEVICE_CLASS0, 1u);
+	const caniot_did_t did2 = CANIOT_DID(CANIOT_DEVICE_CLASS0, 2u);
+	struct caniot_frame req, resp;
+	int h1, h2;
+
+	CHECK_0(caniot_controller_init(&ctrl, NULL, NULL));
+	CHECK(caniot_controller_poll_events(&ctrl, recs, 3u) == 0);
+
+	caniot_build_query_read_attribute(&req, 0x1010u);
+	CHECK_STRICTLY_POSITIVE(h1 = caniot_controller_query_register(
+					&ctrl, did1, &req, 1000U));
+	caniot_build_query_read_attribute(&req, 0x2020u);
+	CHECK_STRICTLY_POSITIVE(h2 = caniot_controller_query_register(
+					&ctrl, did2, &req, 1000U));
+
+	z_build_attr_resp(&resp, did1, 0x1010u);
+	CHECK_0(caniot_controller_rx_frame(&ctrl, 10U, &resp));
+	z_build_attr_resp(&resp, did2, 0x2020u);
+	CHECK_0(caniot_controller_rx_frame(&ctrl, 10U, &resp));
+
+	/* orphans, the last one does not fit in the ring */
+	for (uint8_t i = 0u; i < 3u; i++) {
+		CHECK_0(caniot_controller_rx_frame(&ctrl, 10U, &resp));
+	}
+	CHECK(ctrl.events.dropped == 1u);
+
+	CHECK(caniot_controller_poll_events(&ctrl, recs, 3u) == 3);
+	CHECK(recs[0u].ev.handle == h1 && recs[1u].ev.handle == h2);
+	CHECK(recs[0u].ev.context == CANIOT_CONTROLLER_EVENT_CONTEXT_QUERY);
+	CHECK(recs[0u].ev.response == &recs[0u].response);
+	CHECK(recs[0u].response.id.sid == CANIOT_DID_SID(did1));
+	CHECK(recs[1u].response.id.sid == CANIOT_DID_SID(did2));
+	CHECK(recs[2u].ev.context == CANIOT_CONTROLLER_EVENT_CONTEXT_ORPHAN);
+
+	CHECK(caniot_controller_poll_events(&ctrl, recs, 3u) == 1);
+	CHECK(recs[0u].ev.context == CANIOT_CONTROLLER_EVENT_CONTEXT_ORPHAN);
+	CHECK(caniot_controller_poll_events(&ctrl, recs, 3u) == 0);
+
+	return true;
+}
+#endif
+
+#if CONFIG_CANIOT_CTRL_CACHE_SIZE > 0
+/* Check telemetry and attribute responses are served from the cache while fresh */
+bool z_func_ctrl_cache(void)
+{
+	struct z_ctrl_events_ctx x = {.count = 0u};
+	const caniot_did_t did	   = gen_rdm_did(false);
+	struct caniot_frame req, resp;
+
+	CHECK_0(z_ctrl_driv_init(&x));
+
+	caniot_build_query_telemetry(&req, CANIOT_ENDPOINT_APP);
+	CHECK(caniot_controller_cache_get(&x.ctrl, did, &req) == NULL);
+
+	/* orphan telemetry */
+	caniot_clear_frame(&resp);
+	resp.id.type	 = CANIOT_FRAME_TYPE_TELEMETRY;
+	resp.id.query	 = CANIOT_RESPONSE;
+	resp.id.endpoint = CANIOT_ENDPOINT_APP;
+	resp.len	 = 8u;
+	resp.buf[0u]	 = 0x42u;
+	caniot_frame_set_did(&resp, did);
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 10U, &resp));
+	CHECK(x.count == 1u);
+
+	CHECK(caniot_controller_cache_get(&x.ctrl, did, &req) != NULL);
+	CHECK_0(caniot_controller_query_cached(&x.ctrl, did, &req, 0u));
+	CHECK(z_driv.sent == 0u && x.count == 2u);
+	CHECK(x.last.context == CANIOT_CONTROLLER_EVENT_CONTEXT_CACHE);
+	CHECK(x.last.response->buf[0u] == 0x42u);
+	CHECK(strcmp(caniot_controller_event_context_to_str(x.last.context), "cache") == 0);
+
+	/* stale, the driver time passed without the controller being processed */
+	z_driv.sec += CONFIG_CANIOT_CTRL_CACHE_TTL_MS / 1000u + 1u;
+	CHECK(caniot_controller_cache_get(&x.ctrl, did, &req) == NULL);
+	CHECK_0(caniot_controller_query_cached(&x.ctrl, did, &req, 0u));
+	CHECK(z_driv.sent == 1u && x.count == 2u);
+
+	/* attribute, invalidated by a write */
+	z_build_attr_resp(&resp, did, 0x1010u);
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 10U, &resp));
+	caniot_build_query_read_attribute(&req, 0x1010u);
+	CHECK(caniot_controller_cache_get(&x.ctrl, did, &req) != NULL);
+
+	caniot_build_query_write_attribute(&req, 0x1010u, 1u);
+	CHECK_0(caniot_controller_send(&x.ctrl, did, &req));
+	caniot_build_query_read_attribute(&req, 0x1010u);
+	CHECK(caniot_controller_cache_get(&x.ctrl, did, &req) == NULL);
+
+	return true;
+}
+#endif
+
+#if CONFIG_CANIOT_CTRL_COALESCE
+/* Check identical queries wait for the response to the one sent */
+bool z_func_ctrl_coalesce(void)
+{
+	struct z_ctrl_events_ctx x = {.count = 0u};
+	const caniot_did_t did	   = gen_rdm_did(false);
+	struct caniot_frame req, resp;
+	int h1, h2, h3;
+
+	CHECK_0(z_ctrl_driv_init(&x));
+
+	caniot_build_query_read_attribute(&req, 0x1010u);
+	CHECK_STRICTLY_POSITIVE(h1 = caniot_controller_query(&x.ctrl, did, &req, 1000U));
+	CHECK_STRICTLY_POSITIVE(h2 = caniot_controller_query(&x.ctrl, did, &req, 1000U));
+	CHECK_STRICTLY_POSITIVE(h3 = caniot_controller_query(&x.ctrl, did, &req, 1000U));
+	CHECK(z_driv.sent == 1u);
+	CHECK(h1 != h2 && h2 != h3);
+
+	z_build_attr_resp(&resp, did, 0x1010u);
+#if CONFIG_CANIOT_QUERY_ID
+	resp.id.query_id = z_driv.last_sent.id.query_id;
+#endif
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 10U, &resp));
+	CHECK(x.count == 3u);
+	CHECK(x.handles[0u] == h1 && x.handles[1u] == h2 && x.handles[2u] == h3);
+	CHECK(caniot_controller_dbg_free_pendq(&x.ctrl) ==
+	      CONFIG_CANIOT_MAX_PENDING_QUERIES);
+
+	/* the waiting query takes over the cancelled one */
+	CHECK_STRICTLY_POSITIVE(h1 = caniot_controller_query(&x.ctrl, did, &req, 1000U));
+	CHECK_STRICTLY_POSITIVE(h2 = caniot_controller_query(&x.ctrl, did, &req, 1000U));
+	CHECK(z_driv.sent == 2u);
+	CHECK_0(caniot_controller_query_cancel(&x.ctrl, h1, false));
+	CHECK(x.count == 4u && x.handles[3u] == h1);
+	CHECK(caniot_controller_query_pending(&x.ctrl, h2) == true);
+
+#if CONFIG_CANIOT_QUERY_ID
+	resp.id.query_id = z_driv.last_sent.id.query_id;
+#endif
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 10U, &resp));
+	CHECK(x.count == 5u && x.handles[4u] == h2);
+	CHECK(x.last.status == CANIOT_CONTROLLER_EVENT_STATUS_OK);
+
+	/* a waiting query times out on its own */
+	CHECK_STRICTLY_POSITIVE(h1 = caniot_controller_query(&x.ctrl, did, &req, 1000U));
+	CHECK_STRICTLY_POSITIVE(h2 = caniot_controller_query(&x.ctrl, did, &req, 5U));
+	CHECK_0(caniot_controller_rx_frames(&x.ctrl, 10U, NULL, 0u, NULL));
+	CHECK(x.count == 6u && x.handles[5u] == h2);
+	CHECK(x.last.status == CANIOT_CONTROLLER_EVENT_STATUS_TIMEOUT);
+
+#if CONFIG_CANIOT_QUERY_ID
+	resp.id.query_id = z_driv.last_sent.id.query_id;
+#endif
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 10U, &resp));
+	CHECK(x.count == 7u && x.handles[6u] == h1);
+	CHECK(x.ctrl.pendingq.pending_devices_bf == 0U);
+	CHECK(caniot_controller_dbg_free_pendq(&x.ctrl) ==
+	      CONFIG_CANIOT_MAX_PENDING_QUERIES);
+
+	return true;
+}
+#endif
+
+#if CONFIG_CANIOT_CTRL_BCAST_AGGREGATE
+static void z_build_telemetry_resp(struct caniot_frame *resp, caniot_did_t did)
+{
+	caniot_clear_frame(resp);
+	resp->id.type	  = CANIOT_FRAME_TYPE_TELEMETRY;
+	resp->id.query	  = CANIOT_RESPONSE;
+	resp->id.endpoint = CANIOT_ENDPOINT_APP;
+	resp->len	  = 8u;
+	caniot_frame_set_did(resp, did);
+}
+
+/* Check a broadcast query completes once all expected devices answered */
+bool z_func_ctrl_bcast_aggregate(void)
+{
+	struct z_ctrl_events_ctx x = {.count = 0u};
+	const caniot_did_t did1	   = CANIOT_DID(CANIOT_DEVICE_CLASS0, 1u);
+	const caniot_did_t did2	   = CANIOT_DID(CANIOT_DEVICE_CLASS1, 2u);
+	const caniot_did_t did3	   = CANIOT_DID(CANIOT_DEVICE_CLASS2, 3u);
+	struct caniot_ctrl_bcast bcast;
+	struct caniot_frame req, resp;
+	int h;
+
+	CHECK_0(z_ctrl_driv_init(&x));
+
+	bcast.expected = (1llu << did1) | (1llu << did2);
+	caniot_build_query_telemetry(&req, CANIOT_ENDPOINT_APP);
+	CHECK_STRICTLY_POSITIVE(
+		h = caniot_controller_query_broadcast(&x.ctrl, &bcast, &req, 1000u));
+	CHECK(z_driv.sent == 1u);
+
+	z_build_telemetry_resp(&resp, did1);
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 10U, &resp));
+	z_build_telemetry_resp(&resp, did3);
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 5U, &resp));
+	CHECK(x.count == 0u);
+
+	/* no device has the broadcast address */
+	z_build_telemetry_resp(&resp, CANIOT_DID_BROADCAST);
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 0U, &resp));
+	CHECK(x.count == 0u);
+
+	z_build_telemetry_resp(&resp, did2);
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 5U, &resp));
+	CHECK(x.count == 1u && x.handles[0u] == h);
+	CHECK(x.last.status == CANIOT_CONTROLLER_EVENT_STATUS_OK);
+	CHECK(x.last.terminated == 1u && x.last.user_data == &bcast);
+	CHECK(caniot_controller_query_pending(&x.ctrl, h) == false);
+
+	CHECK(bcast.answered == ((1llu << did1) | (1llu << did2) | (1llu << did3)));
+	CHECK(bcast.results[did1].latency_ms == 10u);
+	CHECK(bcast.results[did3].latency_ms == 15u);
+	CHECK(bcast.results[did2].latency_ms == 20u);
+	CHECK(bcast.results[did2].response.id.cls == CANIOT_DEVICE_CLASS1);
+
+	/* a device does not answer */
+	CHECK_STRICTLY_POSITIVE(
+		h = caniot_controller_query_broadcast(&x.ctrl, &bcast, &req, 1000u));
+	z_build_telemetry_resp(&resp, did1);
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 10U, &resp));
+	CHECK_0(caniot_controller_rx_frames(&x.ctrl, 1000U, NULL, 0u, NULL));
+	CHECK(x.count == 2u && x.handles[1u] == h);
+	CHECK(x.last.status == CANIOT_CONTROLLER_EVENT_STATUS_TIMEOUT);
+	CHECK(bcast.answered == (1llu << did1));
+
+#if CONFIG_CANIOT_CTRL_TX_SHAPER
+	/* the time spent in the tx queue is not part of the latency */
+	const struct caniot_ctrl_tx_rate rate = {
+		.frames_per_s = 10u,
+		.bits_per_s   = 0u,
+		.burst	      = 1u,
+	};
+	caniot_controller_tx_rate_set(&x.ctrl, &rate);
+	CHECK_0(caniot_controller_send(&x.ctrl, did3, &req));
+	CHECK_STRICTLY_POSITIVE(
+		h = caniot_controller_query_broadcast(&x.ctrl, &bcast, &req, 1000u));
+	CHECK(caniot_controller_tx_pending(&x.ctrl) == 1u);
+
+	z_driv.ms += 100u;
+	CHECK_0(caniot_controller_process(&x.ctrl));
+	CHECK(caniot_controller_tx_pending(&x.ctrl) == 0u);
+	z_build_telemetry_resp(&resp, did1);
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 10U, &resp));
+	CHECK(bcast.results[did1].latency_ms == 10u);
+#endif
+
+	return true;
+}
+#endif
+
+#if CONFIG_CANIOT_CTRL_RTT_STATS
+/* Check round-trip times are recorded per device and per query type */
+bool z_func_ctrl_rtt_stats(void)
+{
+	struct z_ctrl_events_ctx x = {.count = 0u};
+	const caniot_did_t did	   = gen_rdm_did(false);
+	struct caniot_ctrl_rtt_snapshot snap;
+	struct caniot_frame req, resp;
+
+	CHECK_0(caniot_controller_init(&x.ctrl, z_ctrl_events_cb, &x));
+
+	CHECK_0(caniot_controller_rtt_snapshot_did(&x.ctrl, did, &snap));
+	CHECK(snap.count == 0u && snap.p99_ms == 0u);
+
+	z_build_attr_resp(&resp, did, 0x1010u);
+	for (uint32_t i = 0u; i < 11u; i++) {
+		caniot_build_query_read_attribute(&req, 0x1010u);
+		CHECK_STRICTLY_POSITIVE(
+			caniot_controller_query_register(&x.ctrl, did, &req, 1000U));
+#if CONFIG_CANIOT_QUERY_ID
+		resp.id.query_id = req.id.query_id;
+#endif
+		CHECK_0(caniot_controller_rx_frame(
+			&x.ctrl, (i == 10u) ? 100U : 10U, &resp));
+	}
+
+	/* responses to a broadcast query are not sampled */
+	caniot_build_query_read_attribute(&req, 0x1010u);
+	CHECK_STRICTLY_POSITIVE(caniot_controller_query_register(
+		&x.ctrl, CANIOT_DID_BROADCAST, &req, 1000U));
+#if CONFIG_CANIOT_QUERY_ID
+	resp.id.query_id = req.id.query_id;
+#endif
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 500U, &resp));
+	CHECK(x.last.status == CANIOT_CONTROLLER_EVENT_STATUS_OK);
+
+	CHECK_0(caniot_controller_rtt_snapshot_did(&x.ctrl, did, &snap));
+	CHECK(snap.count == 11u);
+	CHECK(snap.p50_ms == 11u && snap.p90_ms == 11u);
+	CHECK(snap.p99_ms == 100u && snap.max_ms == 100u);
+
+	CHECK_0(caniot_controller_rtt_snapshot_type(
+		&x.ctrl, CANIOT_FRAME_TYPE_READ_ATTRIBUTE, &snap));
+	CHECK(snap.count == 11u);
+	CHECK_0(caniot_controller_rtt_snapshot_type(
+		&x.ctrl, CANIOT_FRAME_TYPE_TELEMETRY, &snap));
+	CHECK(snap.count == 0u);
+
+	caniot_controller_rtt_reset(&x.ctrl);
+	CHECK_0(caniot_controller_rtt_snapshot_did(&x.ctrl, did, &snap));
+	CHECK(snap.count == 0u);
+
+	return true;
+}
+#endif
+
+#if CONFIG_CANIOT_CTRL_ADAPTIVE_TIMEOUT
+/* Check the automatic timeout follows the round-trip times of the device */
+bool z_func_ctrl_timeout_auto(void)
+{
+	struct z_ctrl_events_ctx x = {.count = 0u};
+	const caniot_did_t did	   = gen_rdm_did(false);
+	struct caniot_frame req, resp;
+	uint32_t rto, prev;
+	int h;
+
+	CHECK_0(caniot_controller_init(&x.ctrl, z_ctrl_events_cb, &x));
+
+	CHECK(caniot_controller_timeout_auto(&x.ctrl, did) ==
+	      CONFIG_CANIOT_CTRL_TIMEOUT_AUTO_INIT_MS);
+	CHECK(caniot_controller_timeout_auto(&x.ctrl, CANIOT_DID_BROADCAST) ==
+	      CONFIG_CANIOT_CTRL_TIMEOUT_AUTO_MAX_MS);
+
+	/* first sample: srtt = 200, rttvar = 100 */
+	z_build_attr_resp(&resp, did, 0x1010u);
+	prev = 3u * 200u;
+	for (uint32_t i = 0u; i < 10u; i++) {
+		caniot_build_query_read_attribute(&req, 0x1010u);
+		CHECK_STRICTLY_POSITIVE(caniot_controller_query_register(
+			&x.ctrl, did, &req, CANIOT_TIMEOUT_AUTO));
+#if CONFIG_CANIOT_QUERY_ID
+		resp.id.query_id = req.id.query_id;
+#endif
+		CHECK_0(caniot_controller_rx_frame(&x.ctrl, 200U, &resp));
+		CHECK(x.last.status == CANIOT_CONTROLLER_EVENT_STATUS_OK);
+
+		/* the estimate tightens while the round-trip time is stable */
+		rto = caniot_controller_timeout_auto(&x.ctrl, did);
+		CHECK(i == 0u ? rto == prev : rto < prev);
+		CHECK(rto >= 200u);
+		prev = rto;
+	}
+
+	/* a response to a broadcast query is not sampled */
+	struct caniot_ctrl_rto before, after;
+	CHECK_0(caniot_controller_rto_get(&x.ctrl, did, &before));
+	caniot_build_query_read_attribute(&req, 0x1010u);
+	CHECK_STRICTLY_POSITIVE(caniot_controller_query_register(
+		&x.ctrl, CANIOT_DID_BROADCAST, &req, CANIOT_TIMEOUT_AUTO));
+#if CONFIG_CANIOT_QUERY_ID
+	resp.id.query_id = req.id.query_id;
+#endif
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 900U, &resp));
+	CHECK(x.last.status == CANIOT_CONTROLLER_EVENT_STATUS_OK);
+	CHECK_0(caniot_controller_rto_get(&x.ctrl, did, &after));
+	CHECK(memcmp(&before, &after, sizeof(before)) == 0);
+	CHECK(caniot_controller_timeout_auto(&x.ctrl, did) == rto);
+	CHECK(caniot_controller_query_cancel(&x.ctrl, (uint8_t)x.last.handle, false) == 0);
+
+	/* query times out according to the estimate */
+	caniot_build_query_read_attribute(&req, 0x2020u);
+	CHECK_STRICTLY_POSITIVE(
+		h = caniot_controller_query_register(&x.ctrl, did, &req, CANIOT_TIMEOUT_AUTO));
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, rto - 1u, NULL));
+	CHECK(caniot_controller_query_pending(&x.ctrl, h) == true);
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 1u, NULL));
+	CHECK(caniot_controller_query_pending(&x.ctrl, h) == false);
+	CHECK(x.last.status == CANIOT_CONTROLLER_EVENT_STATUS_TIMEOUT);
+
+	return true;
+}
+#endif
+
+#if CONFIG_CANIOT_CTRL_TIMING_WHEEL
+#define Z_WHEEL_SLOTS	CONFIG_CANIOT_CTRL_TIMING_WHEEL_SLOTS
+#define Z_WHEEL_TICK_MS CONFIG_CANIOT_CTRL_TIMING_WHEEL_TICK_MS
+
+static int z_wheel_query(struct z_ctrl_events_ctx *x, caniot_did_t did, uint32_t timeout)
+{
+	struct caniot_frame req;
+
+	caniot_build_query_read_attribute(&req, 0x1010u);
+
+	return caniot_controller_query_register(&x->ctrl, did, &req, timeout);
+}
+
+/* Query expiring in a slot after the wheel index wrapped */
+bool z_func_ctrl_wheel_wrap(void)
+{
+	struct z_ctrl_events_ctx x = {.count = 0u};
+	int h;
+
+	CHECK_0(caniot_controller_init(&x.ctrl, z_ctrl_events_cb, &x));
+
+	/* move to the middle of the last slot */
+	CHECK_0(caniot_controller_rx_frame(
+		&x.ctrl, (Z_WHEEL_SLOTS - 1u) * Z_WHEEL_TICK_MS + Z_WHEEL_TICK_MS / 2u, NULL));
+
+	const uint32_t timeout = 3u * Z_WHEEL_TICK_MS + 1u;
+	CHECK_STRICTLY_POSITIVE(h = z_wheel_query(&x, CANIOT_DID(1u, 1u), timeout));
+	CHECK(caniot_controller_next_timeout(&x.ctrl) == timeout);
+
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, timeout - 1u, NULL));
+	CHECK(caniot_controller_query_pending(&x.ctrl, h) == true);
+	CHECK(caniot_controller_next_timeout(&x.ctrl) == 1u);
+	CHECK(x.count == 0u);
+
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 1u, NULL));
+	CHECK(caniot_controller_query_pending(&x.ctrl, h) == false);
+	CHECK(x.count == 1u);
+	CHECK(x.last.status == CANIOT_CONTROLLER_EVENT_STATUS_TIMEOUT);
+	CHECK(caniot_controller_next_timeout(&x.ctrl) == (uint32_t)-1);
+
+	return true;
+}
+
+/* Queries hashed in the same slot for different rounds of the wheel */
+bool z_func_ctrl_wheel_multi_lap(void)
+{
+	struct z_ctrl_events_ctx x = {.count = 0u};
+	const uint32_t lap_ms = Z_WHEEL_SLOTS * Z_WHEEL_TICK_MS;
+	int h1, h2;
+
+	CHECK_0(caniot_controller_init(&x.ctrl, z_ctrl_events_cb, &x));
+
+	const uint32_t t1 = lap_ms + 3u;
+	const uint32_t t2 = 2u * lap_ms + 3u;
+	CHECK_STRICTLY_POSITIVE(h2 = z_wheel_query(&x, CANIOT_DID(1u, 2u), t2));
+	CHECK_STRICTLY_POSITIVE(h1 = z_wheel_query(&x, CANIOT_DID(1u, 1u), t1));
+	CHECK(caniot_controller_next_timeout(&x.ctrl) == t1);
+
+	/* slot visited by the first round, none expires */
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 4u, NULL));
+	CHECK(x.count == 0u);
+
+	/* whole rounds at once */
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, lap_ms - 2u, NULL));
+	CHECK(caniot_controller_query_pending(&x.ctrl, h1) == true);
+	CHECK(caniot_controller_next_timeout(&x.ctrl) == 1u);
+
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 1u, NULL));
+	CHECK(caniot_controller_query_pending(&x.ctrl, h1) == false);
+	CHECK(caniot_controller_query_pending(&x.ctrl, h2) == true);
+	CHECK(x.count == 1u);
+	CHECK(caniot_controller_next_timeout(&x.ctrl) == lap_ms);
+
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, lap_ms + 10u, NULL));
+	CHECK(caniot_controller_query_pending(&x.ctrl, h2) == false);
+	CHECK(x.count == 2u);
+	CHECK(x.handles[0u] == h1);
+	CHECK(x.handles[1u] == h2);
+
+	return true;
+}
+
+/* Cancel queries sharing a slot */
+bool z_func_ctrl_wheel_cancel(void)
+{
+	struct z_ctrl_events_ctx x = {.count = 0u};
+	int h1, h2, h3;
+
+	CHECK_0(caniot_controller_init(&x.ctrl, z_ctrl_events_cb, &x));
+
+	/* same tick, different ms within it */
+	CHECK_STRICTLY_POSITIVE(h1 = z_wheel_query(&x, CANIOT_DID(1u, 1u), 2u * Z_WHEEL_TICK_MS));
+	CHECK_STRICTLY_POSITIVE(h2 = z_wheel_query(&x, CANIOT_DID(1u, 2u), 2u * Z_WHEEL_TICK_MS + 1u));
+	CHECK_STRICTLY_POSITIVE(h3 = z_wheel_query(&x, CANIOT_DID(1u, 3u), 2u * Z_WHEEL_TICK_MS + 2u));
+
+	CHECK_0(caniot_controller_query_cancel(&x.ctrl, h2, false));
+	CHECK(caniot_controller_query_pending(&x.ctrl, h2) == false);
+	CHECK(x.count == 1u);
+	CHECK(x.last.status == CANIOT_CONTROLLER_EVENT_STATUS_CANCELLED);
+
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 2u * Z_WHEEL_TICK_MS, NULL));
+	CHECK(x.count == 2u);
+	CHECK(x.last.handle == h1);
+	CHECK(x.last.status == CANIOT_CONTROLLER_EVENT_STATUS_TIMEOUT);
+
+	CHECK_0(caniot_controller_query_cancel(&x.ctrl, h3, false));
+	CHECK(caniot_controller_next_timeout(&x.ctrl) == (uint32_t)-1);
+
+	/* cancelled queries do not time out */
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 10u * Z_WHEEL_TICK_MS, NULL));
+	CHECK(x.count == 3u);
+
+	/* the wheel is usable after the cancellations */
+	CHECK_STRICTLY_POSITIVE(h1 = z_wheel_query(&x, CANIOT_DID(1u, 1u), 5u));
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 5u, NULL));
+	CHECK(x.count == 4u);
+	CHECK(x.last.handle == h1);
+
+	return true;
+}
+#endif
+
+#if CONFIG_CANIOT_CTRL_DRIVERS_API
+/* Check the frames received in a processing call are bounded */
+bool z_func_ctrl_process_budget(void)
+{
+	struct z_ctrl_events_ctx x = {.count = 0u};
+
+	CHECK_0(z_ctrl_driv_init(&x));
+
+	/* frames from a device which was not queried */
+	z_build_attr_resp(&z_driv.rx, CANIOT_DID(CANIOT_DEVICE_CLASS0, 1u), 0x1010u);
+
+	z_driv.rx_pending = 10u;
+	CHECK(caniot_controller_process_budget(&x.ctrl, 4u, 0u) == 1);
+	CHECK(z_driv.rx_pending == 6u && x.count == 4u);
+	CHECK(x.last.context == CANIOT_CONTROLLER_EVENT_CONTEXT_ORPHAN);
+	CHECK_0(caniot_controller_process_budget(&x.ctrl, 0u, 0u));
+	CHECK(z_driv.rx_pending == 0u && x.count == 10u);
+
+	/* time slice */
+	z_driv.rx_pending = 10u;
+	z_driv.rx_ms	  = 10u;
+	CHECK(caniot_controller_process_budget(&x.ctrl, 0u, 25u) == 1);
+	CHECK(z_driv.rx_pending == 7u);
+	CHECK_0(caniot_controller_process(&x.ctrl));
+	CHECK(z_driv.rx_pending == 0u && x.count == 20u);
+
+	/* a query expiring during the burst is reported before its end */
+	struct caniot_frame req;
+	int h;
+	caniot_build_query_read_attribute(&req, 0x2020u);
+	CHECK_STRICTLY_POSITIVE(h = caniot_controller_query(
+					&x.ctrl, CANIOT_DID(CANIOT_DEVICE_CLASS0, 2u), &req, 100U));
+	z_driv.rx_pending = 10u;
+	z_driv.rx_ms	  = 20u;
+	CHECK_0(caniot_controller_process_budget(&x.ctrl, 0u, 0u));
+	CHECK(z_driv.rx_pending == 0u && x.count == 31u);
+	CHECK(caniot_controller_query_pending(&x.ctrl, (uint8_t)h) == false);
+	CHECK(x.last.context == CANIOT_CONTROLLER_EVENT_CONTEXT_ORPHAN);
+
+	/* expired queries are reported when the driver fails */
+	CHECK_STRICTLY_POSITIVE(caniot_controller_query(
+		&x.ctrl, CANIOT_DID(CANIOT_DEVICE_CLASS0, 2u), &req, 100U));
+	z_driv.recv_ret = -CANIOT_EDRIVER;
+	z_driv.rx_ms	= 0u;
+	z_driv.ms += 100u;
+	CHECK(caniot_controller_process_budget(&x.ctrl, 0u, 0u) == -CANIOT_EDRIVER);
+	CHECK(x.count == 32u);
+	CHECK(x.last.status == CANIOT_CONTROLLER_EVENT_STATUS_TIMEOUT);
+	z_driv.recv_ret = 0;
+
+	/* a query answered in the burst does not time out */
+	CHECK_STRICTLY_POSITIVE(caniot_controller_query(
+		&x.ctrl, CANIOT_DID(CANIOT_DEVICE_CLASS0, 1u), &req, 100U));
+	z_build_attr_resp(&z_driv.rx, CANIOT_DID(CANIOT_DEVICE_CLASS0, 1u), 0x2020u);
+#if CONFIG_CANIOT_QUERY_ID
+	z_driv.rx.id.query_id = req.id.query_id;
+#endif
+	z_driv.rx_pending = 1u;
+	z_driv.ms += 100u;
+	CHECK_0(caniot_controller_process_budget(&x.ctrl, 0u, 0u));
+	CHECK(x.count == 33u);
+	CHECK(x.last.status == CANIOT_CONTROLLER_EVENT_STATUS_OK);
+
+	return true;
+}
+#endif
+
+#if CONFIG_CANIOT_CTRL_DRIVERS_API
+/* Check the next deadline is given on the driver clock */
+bool z_func_ctrl_next_deadline(void)
+{
+	struct z_ctrl_events_ctx x = {.count = 0u};
+	struct caniot_frame req;
+	uint32_t deadline;
+	int h;
+
+	memset(&z_driv, 0x00, sizeof(z_driv));
+	z_driv.sec = 5u;
+	CHECK_0(caniot_controller_driv_init(&x.ctrl, &z_driv_api, z_ctrl_events_cb, &x));
+	CHECK(caniot_controller_next_deadline(&x.ctrl, &deadline) == false);
+
+	caniot_build_query_read_attribute(&req, 0x1010u);
+	CHECK_STRICTLY_POSITIVE(
+		h = caniot_controller_query(
+			&x.ctrl, CANIOT_DID(CANIOT_DEVICE_CLASS0, 1u), &req, 200U));
+	CHECK(caniot_controller_next_deadline(&x.ctrl, &deadline) == true);
+	CHECK(deadline == 5200u);
+
+	/* the deadline does not move with the clock */
+	z_driv.ms = 50u;
+	CHECK_0(caniot_controller_process(&x.ctrl));
+	CHECK(caniot_controller_next_deadline(&x.ctrl, &deadline) == true);
+	CHECK(deadline == 5200u);
+
+#if CONFIG_CANIOT_CTRL_TX_SHAPER
+	const struct caniot_ctrl_tx_rate rate = {
+		.frames_per_s = 10u,
+		.bits_per_s   = 0u,
+		.burst	      = 1u,
+	};
+	caniot_controller_tx_rate_set(&x.ctrl, &rate);
+
+	/* deferred frame is due when the bucket holds a token again */
+	CHECK_0(caniot_controller_send(&x.ctrl, CANIOT_DID(CANIOT_DEVICE_CLASS0, 2u), &req));
+	CHECK_0(caniot_controller_send(&x.ctrl, CANIOT_DID(CANIOT_DEVICE_CLASS0, 2u), &req));
+	CHECK(caniot_controller_tx_pending(&x.ctrl) == 1u);
+	CHECK(caniot_controller_next_deadline(&x.ctrl, &deadline) == true);
+	CHECK(deadline == 5150u);
+
+	z_driv.ms = 150u;
+	CHECK_0(caniot_controller_process(&x.ctrl));
+	CHECK(caniot_controller_tx_pending(&x.ctrl) == 0u);
+	CHECK(caniot_controller_next_deadline(&x.ctrl, &deadline) == true);
+	CHECK(deadline == 5200u);
+#endif
+
+	CHECK_0(caniot_controller_query_cancel(&x.ctrl, (uint8_t)h, false));
+	CHECK(caniot_controller_next_deadline(&x.ctrl, &deadline) == false);
+
+	return true;
+}
+#endif
+
+#if CONFIG_CANIOT_CTRL_DRIVERS_API && CONFIG_CANIOT_DEVICE_DRIVERS_API &&                \
+	CONFIG_CANIOT_DEVICE_DELAYED_TX_SIZE > 0
+static int z_dev_telemetry(struct caniot_device *dev,
+			   caniot_endpoint_t ep,
+			   unsigned char *buf,
+			   uint8_t *len)
+{
+	(void)dev;
+	(void)ep;
+
+	buf[0] = 0xAAu;
+	*len   = 1u;
+
+	return 0;
+}
+
+/* Check the response to a broadcast query is sent after its random delay */
+bool z_func_dev_delayed_tx(void)
+{
+	static const struct caniot_device_api api =
+		CANIOT_DEVICE_API_MIN_INIT(NULL, z_dev_telemetry);
+	struct caniot_device_id id	    = {.did = CANIOT_DID(CANIOT_DEVICE_CLASS1, 2u)};
+	struct caniot_device_config config = CANIOT_CONFIG_DEFAULT_INIT();
+	struct caniot_device dev	    = {
+		       .identification = &id,
+		       .config	       = &config,
+		       .api	       = &api,
+		       .driv	       = &z_driv_api,
+	};
+
+	memset(&z_driv, 0x00, sizeof(z_driv));
+	config.telemetry.delay_min = 100u;
+	config.telemetry.delay_max = 200u;
+	caniot_app_init(&dev);
+
+	caniot_build_query_telemetry(&z_driv.rx, CANIOT_ENDPOINT_APP);
+	caniot_frame_set_did(&z_driv.rx, CANIOT_DID_BROADCAST);
+	z_driv.rx_pending = 1u;
+
+	/* entropy gives 0x0101: 100 + 257 % 100 */
+	CHECK_0(caniot_device_process(&dev));
+	CHECK(z_driv.sent == 0u);
+	CHECK(caniot_device_delayed_tx_remaining(&dev) == 157u);
+
+	z_driv.ms = 156u;
+	CHECK_0(caniot_device_process_delayed_tx(&dev));
+	CHECK(z_driv.sent == 0u);
+	CHECK(caniot_device_delayed_tx_remaining(&dev) == 1u);
+
+	z_driv.ms = 157u;
+	CHECK(caniot_device_process(&dev) == -CANIOT_EAGAIN);
+	CHECK(z_driv.sent == 1u);
+	CHECK(z_driv.last_sent.id.query == CANIOT_RESPONSE);
+	CHECK(caniot_frame_get_did(&z_driv.last_sent) == id.did);
+	CHECK(z_driv.last_sent.len == 1u && z_driv.last_sent.buf[0] == 0xAAu);
+	CHECK(caniot_device_delayed_tx_remaining(&dev) == (uint32_t)-1);
+
+	/* response to the device itself is not delayed */
+	caniot_frame_set_did(&z_driv.rx, id.did);
+	z_driv.rx_pending = 1u;
+	CHECK_0(caniot_device_process(&dev));
+	CHECK(z_driv.sent == 2u);
+
+	return true;
+}
+#endif
+
+#if CONFIG_CANIOT_CTRL_TX_SHAPER
+/* Check frames exceeding the transmission rate are deferred */
+bool z_func_ctrl_tx_shaper(void)
+{
+	struct z_ctrl_events_ctx x = {.count = 0u};
+	const struct caniot_ctrl_tx_rate rate = {
+		.frames_per_s = 10u,
+		.bits_per_s   = 0u,
+		.burst	      = 2u,
+	};
+	struct caniot_frame req;
+	int h3, h4;
+
+	CHECK_0(z_ctrl_driv_init(&x));
+	caniot_controller_tx_rate_set(&x.ctrl, &rate);
+
+	/* burst */
+	caniot_build_query_read_attribute(&req, 0x1010u);
+	CHECK_STRICTLY_POSITIVE(caniot_controller_query(
+		&x.ctrl, CANIOT_DID(CANIOT_DEVICE_CLASS0, 1u), &req, 200U));
+	CHECK_STRICTLY_POSITIVE(caniot_controller_query(
+		&x.ctrl, CANIOT_DID(CANIOT_DEVICE_CLASS0, 2u), &req, 200U));
+	CHECK(z_driv.sent == 2u);
+
+	CHECK_STRICTLY_POSITIVE(h3 = caniot_controller_query(
+					&x.ctrl, CANIOT_DID(CANIOT_DEVICE_CLASS0, 3u), &req, 200U));
+	CHECK_0(caniot_controller_send(&x.ctrl, CANIOT_DID(CANIOT_DEVICE_CLASS0, 1u), &req));
+	CHECK(z_driv.sent == 2u);
+	CHECK(caniot_controller_tx_pending(&x.ctrl) == 2u);
+	CHECK(caniot_controller_query_pending(&x.ctrl, (uint8_t)h3) == true);
+
+	/* one frame every 100 ms */
+	z_driv.ms = 99u;
+	CHECK_0(caniot_controller_process(&x.ctrl));
+	CHECK(z_driv.sent == 2u);
+	z_driv.ms = 100u;
+	CHECK_0(caniot_controller_process(&x.ctrl));
+	CHECK(z_driv.sent == 3u && caniot_controller_tx_pending(&x.ctrl) == 1u);
+	CHECK(z_driv.last_sent.id.cls == CANIOT_DEVICE_CLASS0 &&
+	      z_driv.last_sent.id.sid == 3u);
+
+	z_driv.ms = 200u;
+	CHECK_0(caniot_controller_process(&x.ctrl));
+	CHECK(z_driv.sent == 4u && caniot_controller_tx_pending(&x.ctrl) == 0u);
+	CHECK(x.count == 2u);
+
+	/* a cancelled query is not sent */
+	caniot_build_query_read_attribute(&req, 0x2020u);
+	CHECK_STRICTLY_POSITIVE(h4 = caniot_controller_query(
+					&x.ctrl, CANIOT_DID(CANIOT_DEVICE_CLASS0, 4u), &req, 200U));
+	CHECK(caniot_controller_tx_pending(&x.ctrl) == 1u);
+	CHECK_0(caniot_controller_query_cancel(&x.ctrl, (uint8_t)h4, false));
+	CHECK(caniot_controller_tx_pending(&x.ctrl) == 0u);
+	CHECK(x.count == 3u && x.last.status == CANIOT_CONTROLLER_EVENT_STATUS_CANCELLED);
+
+	/* the timeout of the deferred query started when it was sent */
+	z_driv.ms = 299u;
+	CHECK_0(caniot_controller_process(&x.ctrl));
+	CHECK(caniot_controller_query_pending(&x.ctrl, (uint8_t)h3) == true);
+	z_driv.ms = 300u;
+	CHECK_0(caniot_controller_process(&x.ctrl));
+	CHECK(caniot_controller_query_pending(&x.ctrl, (uint8_t)h3) == false);
+	CHECK(x.count == 4u && x.handles[3] == h3);
+	CHECK(z_driv.sent == 4u);
+
+	return true;
+}
+
+/* Check every query is cancelled on deinit, whatever its state */
+bool z_func_ctrl_deinit(void)
+{
+	struct z_ctrl_events_ctx x = {.count = 0u};
+	const struct caniot_ctrl_tx_rate rate = {
+		.frames_per_s = 10u,
+		.bits_per_s   = 0u,
+		.burst	      = 2u,
+	};
+	struct caniot_frame req;
+	int h1, h2, h3;
+
+	CHECK_0(z_ctrl_driv_init(&x));
+	caniot_controller_tx_rate_set(&x.ctrl, &rate);
+
+	/* sent, waiting forever / sent, waiting for the timeout / deferred */
+	caniot_build_query_read_attribute(&req, 0x1010u);
+	CHECK_STRICTLY_POSITIVE(h1 = caniot_controller_query(&x.ctrl,
+							     CANIOT_DID(CANIOT_DEVICE_CLASS0, 1u),
+							     &req,
+							     CANIOT_TIMEOUT_FOREVER));
+	CHECK_STRICTLY_POSITIVE(h2 = caniot_controller_query(
+					&x.ctrl, CANIOT_DID(CANIOT_DEVICE_CLASS0, 2u), &req, 200U));
+	CHECK_STRICTLY_POSITIVE(h3 = caniot_controller_query(
+					&x.ctrl, CANIOT_DID(CANIOT_DEVICE_CLASS0, 3u), &req, 200U));
+	CHECK_0(caniot_controller_send(&x.ctrl, CANIOT_DID(CANIOT_DEVICE_CLASS0, 4u), &req));
+	CHECK(caniot_controller_tx_pending(&x.ctrl) == 2u);
+
+	/* queries are released silently */
+	CHECK_0(caniot_controller_deinit(&x.ctrl));
+	CHECK(x.count == 0u);
+	CHECK(caniot_controller_dbg_free_pendq(&x.ctrl) ==
+	      CONFIG_CANIOT_MAX_PENDING_QUERIES);
+	CHECK(caniot_controller_query_pending(&x.ctrl, (uint8_t)h1) == false);
+	CHECK(caniot_controller_query_pending(&x.ctrl, (uint8_t)h2) == false);
+	CHECK(caniot_controller_query_pending(&x.ctrl, (uint8_t)h3) == false);
+	CHECK(caniot_controller_tx_pending(&x.ctrl) == 0u);
+
+	/* deferred frames are dropped */
+	z_driv.ms = 500u;
+	CHECK_0(caniot_controller_process(&x.ctrl));
+	CHECK(z_driv.sent == 2u);
+
+	return true;
+}
+#endif
+
+#if CONFIG_CANIOT_CTRL_DEVICE_PACING && CONFIG_CANIOT_CTRL_PIPELINE_DEPTH >= 2
+/* Check frames to a paced device are deferred without delaying other devices */
+bool z_func_ctrl_pacing(void)
+{
+	struct z_ctrl_events_ctx x = {.count = 0u};
+	const caniot_did_t slow	   = CANIOT_DID(CANIOT_DEVICE_CLASS0, 1u);
+	const caniot_did_t custom  = CANIOT_DID(CANIOT_DEVICE_CLASS0, 2u);
+	const struct caniot_ctrl_pacing pacing = {
+		.min_gap_ms    = 50u,
+		.max_in_flight = 1u,
+	};
+	const struct caniot_ctrl_pacing unpaced = {
+		.min_gap_ms    = 0u,
+		.max_in_flight = 0u,
+	};
+	struct caniot_frame req, resp;
+	int h1, h2;
+
+	CHECK_0(z_ctrl_driv_init(&x));
+	CHECK_0(caniot_controller_pacing_set_class(&x.ctrl, CANIOT_DEVICE_CLASS0, &pacing));
+	CHECK_0(caniot_controller_pacing_set_did(&x.ctrl, custom, &unpaced));
+
+	caniot_build_query_read_attribute(&req, 0x1010u);
+	CHECK_STRICTLY_POSITIVE(h1 = caniot_controller_query(&x.ctrl, slow, &req, 1000U));
+	z_build_attr_resp(&resp, slow, 0x1010u);
+#if CONFIG_CANIOT_QUERY_ID
+	resp.id.query_id = req.id.query_id;
+#endif
+	caniot_build_query_read_attribute(&req, 0x2020u);
+	CHECK_STRICTLY_POSITIVE(h2 = caniot_controller_query(&x.ctrl, slow, &req, 1000U));
+	CHECK(z_driv.sent == 1u && caniot_controller_tx_pending(&x.ctrl) == 1u);
+
+	/* other devices are not held back, even in the same class */
+	CHECK_STRICTLY_POSITIVE(caniot_controller_query(&x.ctrl, custom, &req, 1000U));
+	caniot_build_query_read_attribute(&req, 0x1010u);
+	CHECK_STRICTLY_POSITIVE(caniot_controller_query(&x.ctrl, custom, &req, 1000U));
+	CHECK(z_driv.sent == 3u && caniot_controller_tx_pending(&x.ctrl) == 1u);
+
+	/* response received, the gap is not elapsed yet */
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 10U, &resp));
+	CHECK(x.count == 1u && x.handles[0] == h1);
+	z_driv.ms = 39u;
+	CHECK_0(caniot_controller_process(&x.ctrl));
+	CHECK(z_driv.sent == 3u);
+
+	z_driv.ms = 40u;
+	CHECK_0(caniot_controller_process(&x.ctrl));
+	CHECK(z_driv.sent == 4u && caniot_controller_tx_pending(&x.ctrl) == 0u);
+	CHECK(z_driv.last_sent.attr.key == 0x2020u);
+	CHECK(caniot_controller_query_pending(&x.ctrl, (uint8_t)h2) == true);
+
+	return true;
+}
+#endif
+
+#if CONFIG_CANIOT_CTRL_TX_PRIORITY
+/* Check deferred frames are sent by priority class, with aging */
+bool z_func_ctrl_tx_priority(void)
+{
+	struct z_ctrl_events_ctx x = {.count = 0u};
+	const struct caniot_ctrl_tx_rate rate = {
+		.frames_per_s = 10u,
+		.bits_per_s   = 0u,
+		.burst	      = 1u,
+	};
+	const uint8_t cmd[1u] = {0x01u};
+	struct caniot_frame req;
+	struct caniot_ctrl_tx_wait wait;
+
+	CHECK_0(z_ctrl_driv_init(&x));
+
+	/* default (unlimited) rate, frames are sent as they are submitted */
+	caniot_build_query_read_attribute(&req, 0x1010u);
+	CHECK_0(caniot_controller_send(&x.ctrl, CANIOT_DID(CANIOT_DEVICE_CLASS0, 1u), &req));
+	caniot_build_query_command(&req, CANIOT_ENDPOINT_APP, cmd, sizeof(cmd));
+	CHECK_0(caniot_controller_send(&x.ctrl, CANIOT_DID(CANIOT_DEVICE_CLASS0, 2u), &req));
+	CHECK(z_driv.sent == 2u && z_driv.last_sent.id.sid == 2u);
+	CHECK(caniot_controller_tx_pending(&x.ctrl) == 0u);
+
+	CHECK_0(caniot_controller_tx_wait_get(&x.ctrl, CANIOT_CTRL_TX_PRIO_ATTRIBUTE, &wait));
+	CHECK(wait.count == 1u && wait.max_ms == 0u);
+
+#if CONFIG_CANIOT_CTRL_TX_BACKPRESSURE
+	/* frames the driver cannot take are reordered whatever the rate */
+	z_driv.send_ret = -CANIOT_EAGAIN;
+	caniot_build_query_read_attribute(&req, 0x1010u);
+	CHECK_0(caniot_controller_send(&x.ctrl, CANIOT_DID(CANIOT_DEVICE_CLASS0, 1u), &req));
+	caniot_build_query_command(&req, CANIOT_ENDPOINT_APP, cmd, sizeof(cmd));
+	CHECK_0(caniot_controller_send(&x.ctrl, CANIOT_DID(CANIOT_DEVICE_CLASS0, 2u), &req));
+	CHECK(caniot_controller_tx_pending(&x.ctrl) == 2u);
+
+	/* the command is sent first */
+	z_driv.send_ret = 0;
+	CHECK_0(caniot_controller_process(&x.ctrl));
+	CHECK(z_driv.sent == 4u && z_driv.last_sent.id.sid == 1u);
+#endif
+
+	CHECK_0(z_ctrl_driv_init(&x));
+	caniot_controller_tx_rate_set(&x.ctrl, &rate);
+
+	caniot_build_query_read_attribute(&req, 0x1010u);
+	CHECK_0(caniot_controller_send(&x.ctrl, CANIOT_DID(CANIOT_DEVICE_CLASS0, 1u), &req));
+	CHECK_0(caniot_controller_send(&x.ctrl, CANIOT_DID(CANIOT_DEVICE_CLASS0, 2u), &req));
+	caniot_build_query_command(&req, CANIOT_ENDPOINT_APP, cmd, sizeof(cmd));
+	CHECK_0(caniot_controller_send(&x.ctrl, CANIOT_DID(CANIOT_DEVICE_CLASS0, 4u), &req));
+	CHECK(z_driv.sent == 1u && caniot_controller_tx_pending(&x.ctrl) == 2u);
+
+	/* the command overtakes the attribute read */
+	z_driv.ms = 100u;
+	CHECK_0(caniot_controller_process(&x.ctrl));
+	CHECK(z_driv.sent == 2u && z_driv.last_sent.id.sid == 4u);
+
+	caniot_build_query_telemetry(&req, CANIOT_ENDPOINT_APP);
+	CHECK_0(caniot_controller_send(&x.ctrl, CANIOT_DID(CANIOT_DEVICE_CLASS0, 5u), &req));
+
+	/* the attribute read waited long enough to be sent before the telemetry */
+	z_driv.ms = 200u;
+	CHECK_0(caniot_controller_process(&x.ctrl));
+	CHECK(z_driv.sent == 3u && z_driv.last_sent.id.sid == 2u);
+	z_driv.ms = 300u;
+	CHECK_0(caniot_controller_process(&x.ctrl));
+	CHECK(z_driv.sent == 4u && z_driv.last_sent.id.sid == 5u);
+
+	CHECK_0(caniot_controller_tx_wait_get(&x.ctrl, CANIOT_CTRL_TX_PRIO_COMMAND, &wait));
+	CHECK(wait.count == 1u && wait.total_ms == 100u && wait.max_ms == 100u);
+	CHECK_0(caniot_controller_tx_wait_get(&x.ctrl, CANIOT_CTRL_TX_PRIO_ATTRIBUTE, &wait));
+	CHECK(wait.count == 2u && wait.total_ms == 200u && wait.max_ms == 200u);
+	CHECK_0(caniot_controller_tx_wait_get(&x.ctrl, CANIOT_CTRL_TX_PRIO_TELEMETRY, &wait));
+	CHECK(wait.count == 1u && wait.max_ms == 200u);
+
+	return true;
+}
+#endif
+
+#if CONFIG_CANIOT_CTRL_TX_BACKPRESSURE
+/* Check frames the driver refuses are kept in the tx queue and sent later */
+bool z_func_ctrl_tx_backpressure(void)
+{
+	struct z_ctrl_events_ctx x = {.count = 0u};
+	const caniot_did_t did	   = CANIOT_DID(CANIOT_DEVICE_CLASS0, 1u);
+	struct caniot_ctrl_tx_stats stats;
+	struct caniot_frame req;
+	int h;
+
+	CHECK_0(z_ctrl_driv_init(&x));
+
+	z_driv.send_ret = -CANIOT_EAGAIN;
+	caniot_build_query_read_attribute(&req, 0x1010u);
+	CHECK_STRICTLY_POSITIVE(h = caniot_controller_query(&x.ctrl, did, &req, 200U));
+	CHECK_0(caniot_controller_send(&x.ctrl, CANIOT_DID(CANIOT_DEVICE_CLASS0, 2u), &req));
+	CHECK(caniot_controller_tx_pending(&x.ctrl) == 2u);
+
+	z_driv.ms = 100u;
+	CHECK_0(caniot_controller_process(&x.ctrl));
+	CHECK(z_driv.sent == 0u && caniot_controller_tx_pending(&x.ctrl) == 2u);
+
+	CHECK_0(caniot_controller_tx_stats_get(&x.ctrl, &stats));
+	CHECK(stats.pending == 2u && stats.deferred == 2u);
+	CHECK(stats.busy >= 2u && stats.dropped == 0u);
+
+	/* the timeout starts when the driver takes the frame */
+	z_driv.send_ret = 0;
+	z_driv.ms	= 150u;
+	CHECK_0(caniot_controller_process(&x.ctrl));
+	CHECK(z_driv.sent == 2u && caniot_controller_tx_pending(&x.ctrl) == 0u);
+	z_driv.ms = 349u;
+	CHECK_0(caniot_controller_process(&x.ctrl));
+	CHECK(caniot_controller_query_pending(&x.ctrl, (uint8_t)h) == true);
+	z_driv.ms = 350u;
+	CHECK_0(caniot_controller_process(&x.ctrl));
+	CHECK(x.count == 1u && x.last.status == CANIOT_CONTROLLER_EVENT_STATUS_TIMEOUT);
+
+	/* frames are dropped when the queue is full or if the driver fails */
+	z_driv.send_ret = -CANIOT_EAGAIN;
+	for (uint32_t i = 0u; i < CONFIG_CANIOT_CTRL_TXQ_SIZE; i++) {
+		CHECK_0(caniot_controller_send(&x.ctrl, did, &req));
+	}
+	CHECK(caniot_controller_send(&x.ctrl, did, &req) == -CANIOT_EAGAIN);
+
+	z_driv.send_ret = -CANIOT_EDRIVER;
+	CHECK_0(caniot_controller_process(&x.ctrl));
+	CHECK_0(caniot_controller_tx_stats_get(&x.ctrl, &stats));
+	CHECK(stats.pending == 0u && stats.max_pending == CONFIG_CANIOT_CTRL_TXQ_SIZE);
+	CHECK(stats.dropped == CONFIG_CANIOT_CTRL_TXQ_SIZE + 1u);
+
+	return true;
+}
+#endif
+
+#if CONFIG_CANIOT_CTRL_RETRY
+/* Check timed out queries are retransmitted with an exponential backoff */
+bool z_func_ctrl_retry(void)
+{
+	struct z_ctrl_events_ctx x = {.count = 0u};
+	const caniot_did_t did	   = gen_rdm_did(false);
+	const struct caniot_ctrl_retry_policy policy = {
+		.max_attempts	 = 3u,
+		.jitter_pct	 = 0u,
+		.base_backoff_ms = 100u,
+		.max_backoff_ms	 = 150u,
+	};
+	struct caniot_frame req, resp;
+	int h;
+
+	CHECK_0(z_ctrl_driv_init(&x));
+
+	/* all attempts time out */
+	caniot_build_query_read_attribute(&req, 0x1010u);
+	CHECK_STRICTLY_POSITIVE(
+		h = caniot_controller_query_retry(&x.ctrl, did, &req, 200U, &policy));
+	CHECK(z_driv.sent == 1u);
+
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 200U, NULL));
+	CHECK(x.count == 0u && caniot_controller_query_pending(&x.ctrl, h) == true);
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 99U, NULL));
+	CHECK(z_driv.sent == 1u);
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 1U, NULL));
+	CHECK(z_driv.sent == 2u);
+	CHECK(memcmp(&z_driv.last_sent, &req, sizeof(req)) == 0);
+
+	/* backoff doubled then bounded */
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 200U, NULL));
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 149U, NULL));
+	CHECK(z_driv.sent == 2u);
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 1U, NULL));
+	CHECK(z_driv.sent == 3u && x.count == 0u);
+
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 200U, NULL));
+	CHECK(z_driv.sent == 3u);
+	CHECK(x.count == 1u && x.handles[0] == h);
+	CHECK(x.last.status == CANIOT_CONTROLLER_EVENT_STATUS_TIMEOUT);
+	CHECK(caniot_controller_dbg_free_pendq(&x.ctrl) ==
+	      CONFIG_CANIOT_MAX_PENDING_QUERIES);
+
+	/* response to the retransmission completes the query */
+	caniot_build_query_read_attribute(&req, 0x1010u);
+	CHECK_STRICTLY_POSITIVE(
+		h = caniot_controller_query_retry(&x.ctrl, did, &req, 200U, &policy));
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 200U, NULL));
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 100U, NULL));
+	CHECK(z_driv.sent == 5u);
+
+	z_build_attr_resp(&resp, did, 0x1010u);
+#if CONFIG_CANIOT_QUERY_ID
+	resp.id.query_id = req.id.query_id;
+#endif
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 50U, &resp));
+	CHECK(x.count == 2u && x.handles[1] == h);
+	CHECK(x.last.status == CANIOT_CONTROLLER_EVENT_STATUS_OK);
+
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 1000U, NULL));
+	CHECK(x.count == 2u && z_driv.sent == 5u);
+
+#if CONFIG_CANIOT_CTRL_RTT_STATS
+	/* no round-trip time sample taken from a retransmitted query */
+	struct caniot_ctrl_rtt_snapshot snap;
+	CHECK_0(caniot_controller_rtt_snapshot_did(&x.ctrl, did, &snap));
+	CHECK(snap.count == 0u);
+#endif
+
+	return true;
+}
+#endif
+
+#if CONFIG_CANIOT_CTRL_PIPELINE_DEPTH == 2
+/* Check several queries pending for the same device, responses out of order */
+bool z_func_ctrl_pipeline(void)
+{
+	struct z_ctrl_events_ctx x = {.count = 0u};
+	const caniot_did_t did	   = gen_rdm_did(false);
+	struct caniot_frame req, resp;
+	int h1, h2;
+
+	CHECK_0(caniot_controller_init(&x.ctrl, z_ctrl_events_cb, &x));
+
+	caniot_build_query_read_attribute(&req, 0x1010u);
+	CHECK_STRICTLY_POSITIVE(h1 = caniot_controller_query_register(
+					&x.ctrl, did, &req, 1000U));
+	caniot_build_query_read_attribute(&req, 0x2020u);
+	CHECK_STRICTLY_POSITIVE(h2 = caniot_controller_query_register(
+					&x.ctrl, did, &req, 1000U));
+	CHECK(caniot_controller_query_register(&x.ctrl, did, &req, 1000U) ==
+	      -CANIOT_EBUSY);
+
+	/* Response to the second query first */
+	z_build_attr_resp(&resp, did, 0x2020u);
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 10U, &resp));
+	CHECK(x.count == 1u && x.handles[0] == h2);
+	CHECK(x.last.status == CANIOT_CONTROLLER_EVENT_STATUS_OK);
+	CHECK(caniot_controller_query_pending(&x.ctrl, h1) == true);
+	CHECK(caniot_controller_query_pending(&x.ctrl, h2) == false);
+
+	z_build_attr_resp(&resp, did, 0x1010u);
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 10U, &resp));
+	CHECK(x.count == 2u && x.handles[1] == h1);
+	CHECK(x.ctrl.pendingq.pending_devices_bf == 0U);
+	CHECK(caniot_controller_dbg_free_pendq(&x.ctrl) ==
+	      CONFIG_CANIOT_MAX_PENDING_QUERIES);
+
+	return true;
+}
+#endif
+
+#if CONFIG_CANIOT_QUERY_ID && CONFIG_CANIOT_CTRL_PIPELINE_DEPTH > 1
+/* Check responses are matched to identical queries by their query id */
+bool z_func_ctrl_query_id(void)
+{
+	struct z_ctrl_events_ctx x = {.count = 0u};
+	const caniot_did_t did	   = gen_rdm_did(false);
+	struct caniot_frame req, resp;
+	uint16_t qid1;
+	int h1, h2;
+
+	CHECK_0(caniot_controller_init(&x.ctrl, z_ctrl_events_cb, &x));
+
+	caniot_build_query_read_attribute(&req, 0x1010u);
+	CHECK_STRICTLY_POSITIVE(h1 = caniot_controller_query_register(
+					&x.ctrl, did, &req, 1000U));
+	CHECK(req.id.query_id != 0u);
+	qid1 = req.id.query_id;
+
+	caniot_build_query_read_attribute(&req, 0x1010u);
+	CHECK_STRICTLY_POSITIVE(h2 = caniot_controller_query_register(
+					&x.ctrl, did, &req, 1000U));
+	CHECK(req.id.query_id != 0u && req.id.query_id != qid1);
+
+	/* Response to the second query first */
+	z_build_attr_resp(&resp, did, 0x1010u);
+	resp.id.query_id = req.id.query_id;
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 10U, &resp));
+	CHECK(x.count == 1u && x.handles[0] == h2);
+	CHECK(x.last.context == CANIOT_CONTROLLER_EVENT_CONTEXT_QUERY);
+	CHECK(caniot_controller_query_pending(&x.ctrl, h1) == true);
+
+	/* Same response again, the query is no longer pending */
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 10U, &resp));
+	CHECK(x.count == 2u);
+	CHECK(x.last.context == CANIOT_CONTROLLER_EVENT_CONTEXT_ORPHAN);
+	CHECK(caniot_controller_query_pending(&x.ctrl, h1) == true);
+
+	resp.id.query_id = qid1;
+	CHECK_0(caniot_controller_rx_frame(&x.ctrl, 10U, &resp));
+	CHECK(x.count == 3u && x.handles[2] == h1);
+	CHECK(x.ctrl.pendingq.pending_devices_bf == 0U);
+
+	return true;
+}
+#endif
+
+/*____________________________________________________________________________*/
+
 struct test {
 	const char *name;
 	bool (*test_handler)(void);
@@ -515,6 +1977,9 @@ const struct test tests[] = {
 	TEST(z_func__caniot_id_to_canid, 100U),
 	TEST(z_struct__caniot_id_t, 1U),
 	TEST(z_misc_id_conversion, 100U),
+#if CONFIG_CANIOT_QUERY_ID
+	TEST(z_misc_ext_id_conversion, 100U),
+#endif
 	TEST(z_func__caniot_device_is_target, 100U),
 	TEST(z_func__caniot_resp_error_for, 1U),
 	TEST(z_func__caniot_validate_drivers_api, 1U),
@@ -528,6 +1993,65 @@ const struct test tests[] = {
 	TEST(z_func_ctrl3, 1U),
 	TEST(z_func_ctrl4, 1U),
 	TEST(z_func_dev0, 1U),
+	TEST(z_func_ctrl_forever, 10U),
+	TEST(z_func_ctrl_rx_frames, 1U),
+	TEST(z_func_ctrl_query_ex, 10U),
+#if CONFIG_CANIOT_CTRL_DRIVERS_API
+	TEST(z_func_ctrl_process_budget, 1U),
+	TEST(z_func_ctrl_next_deadline, 1U),
+#endif
+#if CONFIG_CANIOT_CTRL_DRIVERS_API && CONFIG_CANIOT_DEVICE_DRIVERS_API &&                \
+	CONFIG_CANIOT_DEVICE_DELAYED_TX_SIZE > 0
+	TEST(z_func_dev_delayed_tx, 1U),
+#endif
+#if CONFIG_CANIOT_CTRL_TIMING_WHEEL
+	TEST(z_func_ctrl_wheel_wrap, 1U),
+	TEST(z_func_ctrl_wheel_multi_lap, 1U),
+	TEST(z_func_ctrl_wheel_cancel, 1U),
+#endif
+#if CONFIG_CANIOT_CTRL_PIPELINE_DEPTH == 2
+	TEST(z_func_ctrl_pipeline, 10U),
+#endif
+#if CONFIG_CANIOT_CTRL_COALESCE
+	TEST(z_func_ctrl_coalesce, 10U),
+#endif
+#if CONFIG_CANIOT_CTRL_BCAST_AGGREGATE
+	TEST(z_func_ctrl_bcast_aggregate, 1U),
+#endif
+#if CONFIG_CANIOT_CTRL_RTT_STATS
+	TEST(z_func_ctrl_rtt_stats, 10U),
+#endif
+#if CONFIG_CANIOT_CTRL_ADAPTIVE_TIMEOUT
+	TEST(z_func_ctrl_timeout_auto, 10U),
+#endif
+#if CONFIG_CANIOT_CTRL_TX_SHAPER
+	TEST(z_func_ctrl_tx_shaper, 1U),
+	TEST(z_func_ctrl_deinit, 1U),
+#endif
+#if CONFIG_CANIOT_CTRL_DEVICE_PACING && CONFIG_CANIOT_CTRL_PIPELINE_DEPTH >= 2
+	TEST(z_func_ctrl_pacing, 1U),
+#endif
+#if CONFIG_CANIOT_CTRL_TX_PRIORITY
+	TEST(z_func_ctrl_tx_priority, 1U),
+#endif
+#if CONFIG_CANIOT_CTRL_TX_BACKPRESSURE
+	TEST(z_func_ctrl_tx_backpressure, 1U),
+#endif
+#if CONFIG_CANIOT_CTRL_RETRY
+	TEST(z_func_ctrl_retry, 10U),
+#endif
+#if CONFIG_CANIOT_CTRL_CACHE_SIZE > 0
+	TEST(z_func_ctrl_cache, 10U),
+#endif
+#if CONFIG_CANIOT_CTRL_EVENT_RING_SIZE == 4
+	TEST(z_func_ctrl_poll_events, 1U),
+#endif
+#if CONFIG_CANIOT_CTRL_SUBMIT_QUEUE && CONFIG_CANIOT_CTRL_PIPELINE_DEPTH == 2
+	TEST(z_func_ctrl_submit_queue, 10U),
+#endif
+#if CONFIG_CANIOT_QUERY_ID && CONFIG_CANIOT_CTRL_PIPELINE_DEPTH > 1
+	TEST(z_func_ctrl_query_id, 10U),
+#endif
 };
 
 int main(void)